@@ -28,6 +28,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include <string.h>
 #include <sys/types.h>
 #include <errno.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #ifdef NQ_HACK
 #include "quakedef.h"
@@ -74,6 +77,7 @@ qboolean msg_suppress_1 = 0;
 
 static void COM_InitFilesystem(void);
 static void COM_Path_f(void);
+static void COM_PathStats_f(void);
 static void *SZ_GetSpace(sizebuf_t *buf, int length);
 
 // if a packfile directory differs from this, it is assumed to be hacked
@@ -1097,6 +1101,7 @@ void COM_Init(void)
    Cvar_RegisterVariable(&cmdline);
 #endif
    Cmd_AddCommand("path", COM_Path_f);
+   Cmd_AddCommand("path_stats", COM_PathStats_f);
 
    COM_InitFilesystem();
    COM_CheckRegistered();
@@ -1127,6 +1132,47 @@ char *va(const char *format, ...)
    return buf;
 }
 
+/*
+============
+COM_HashString
+
+FNV-1a hash of a nul terminated string
+============
+*/
+unsigned COM_HashString(const char *s)
+{
+   unsigned hash = 2166136261u;
+
+   while (*s)
+   {
+      hash ^= (byte)*s++;
+      hash *= 16777619u;
+   }
+
+   return hash;
+}
+
+/*
+============
+COM_HashBytes
+
+The same hash over length bytes, for strings that aren't nul terminated
+============
+*/
+unsigned COM_HashBytes(const void *data, int length)
+{
+   const byte *p = (const byte *)data;
+   unsigned hash = 2166136261u;
+
+   while (length-- > 0)
+   {
+      hash ^= *p++;
+      hash *= 16777619u;
+   }
+
+   return hash;
+}
+
 
 /*
 =============================================================================
@@ -1150,6 +1196,9 @@ typedef struct pack_s
     char filename[MAX_OSPATH];
     int numfiles;
     packfile_t *files;
+    FILE *handle;		// kept open for COM_LoadFile
+    const byte *mapped;		// whole pack, if memory mapped
+    size_t mappedsize;
 } pack_t;
 
 // on disk
@@ -1182,6 +1231,38 @@ static searchpath_t *com_searchpaths;
 static searchpath_t *com_base_searchpaths;	// without gamedirs
 #endif
 
+/*
+ * Every pack file entry on the search path is kept in one open addressed
+ * hash table, so finding a file doesn't strcmp through each pack directory.
+ * Only the first (highest priority) occurrence of a name is stored. Loose
+ * files in directories are still probed on disk, since they can appear at
+ * any time.
+ */
+typedef struct {
+    const char *name;
+    packfile_t *file;
+    pack_t *pack;
+    searchpath_t *search;
+} packindex_t;
+
+static packindex_t *com_packindex;
+static unsigned com_packindex_mask;
+static int com_packindex_count;
+static qboolean com_packindex_dirty = true;	// search path has changed
+
+static struct {
+    int lookups;
+    int pakhits;
+    int dirhits;
+    int misses;
+    double seconds;
+    int loads;			// copied out by COM_LoadFile
+    double loadbytes;
+    double loadseconds;
+    int maps;			// handed out by COM_MapFile
+    double mapbytes;
+} com_pathstats;
+
 /*
 ================
 COM_filelength
@@ -1214,6 +1295,153 @@ error:
    return -1;
 }
 
+/*
+============
+COM_PackIndexSlot
+
+Returns the slot holding name, or the empty slot it would go in
+============
+*/
+static packindex_t *COM_PackIndexSlot(const char *name)
+{
+   unsigned slot = COM_HashString(name) & com_packindex_mask;
+
+   while (com_packindex[slot].name && strcmp(com_packindex[slot].name, name))
+      slot = (slot + 1) & com_packindex_mask;
+
+   return &com_packindex[slot];
+}
+
+/*
+============
+COM_BuildPackIndex
+============
+*/
+static void COM_BuildPackIndex(void)
+{
+   searchpath_t *search;
+   packindex_t *entry;
+   pack_t *pak;
+   unsigned size;
+   int i, numfiles = 0;
+
+   for (search = com_searchpaths; search; search = search->next)
+      if (search->pack)
+         numfiles += search->pack->numfiles;
+
+   /* keep the table at most half full */
+   for (size = 64; size < (unsigned)numfiles * 2; size <<= 1)
+      ;
+
+   free(com_packindex);
+   com_packindex = calloc(size, sizeof(*com_packindex));
+   if (!com_packindex)
+      Sys_Error("%s: out of memory (%u entries)", __func__, size);
+   com_packindex_mask = size - 1;
+   com_packindex_count = 0;
+
+   for (search = com_searchpaths; search; search = search->next)
+   {
+      if (!search->pack)
+         continue;
+      pak = search->pack;
+      for (i = 0; i < pak->numfiles; i++)
+      {
+         entry = COM_PackIndexSlot(pak->files[i].name);
+         if (entry->name)
+            continue;	// overridden by an earlier pack
+         entry->name = pak->files[i].name;
+         entry->file = &pak->files[i];
+         entry->pack = pak;
+         entry->search = search;
+         com_packindex_count++;
+      }
+   }
+
+   com_packindex_dirty = false;
+}
+
+/*
+============
+COM_FindFile
+
+Returns the search path element holding filename, or NULL if it can't be
+found. For a pack file *file is set to its directory entry, otherwise
+*file is NULL and path is filled in with the name of the file on disk.
+============
+*/
+static searchpath_t *COM_FindFile(const char *filename, packfile_t **file,
+      char *path, size_t pathsize)
+{
+   double start = Sys_DoubleTime();
+   searchpath_t *search, *found;
+   packindex_t *entry;
+
+   if (com_packindex_dirty)
+      COM_BuildPackIndex();
+
+   entry = COM_PackIndexSlot(filename);
+   found = entry->name ? entry->search : NULL;
+
+   /* directories ahead of the pack in the search path still override it */
+   for (search = com_searchpaths; search != found; search = search->next)
+   {
+      if (search->pack)
+         continue;
+      if (!static_registered)
+      {
+         // if not a registered version, don't ever go beyond base
+         if (strchr(filename, '/') || strchr(filename, '\\'))
+            continue;
+      }
+      snprintf(path, pathsize, "%s/%s", search->filename, filename);
+      if (Sys_FileTime(path) != -1)
+         break;
+   }
+
+   *file = NULL;
+   com_pathstats.lookups++;
+   if (!search)
+      com_pathstats.misses++;
+   else if (search == found)
+   {
+      *file = entry->file;
+      com_pathstats.pakhits++;
+   }
+   else
+      com_pathstats.dirhits++;
+   com_pathstats.seconds += Sys_DoubleTime() - start;
+
+   return search;
+}
+
+/*
+============
+COM_PathStats_f
+============
+*/
+static void COM_PathStats_f(void)
+{
+   int lookups = com_pathstats.lookups;
+
+   Con_Printf("%d lookups: %d from packs, %d from directories, %d missing\n",
+         lookups, com_pathstats.pakhits, com_pathstats.dirhits,
+         com_pathstats.misses);
+   Con_Printf("%.3f ms total, %.2f us per lookup\n",
+         com_pathstats.seconds * 1000.0,
+         lookups ? com_pathstats.seconds * 1000000.0 / lookups : 0.0);
+   Con_Printf("pack index: %d files in %u slots\n", com_packindex_count,
+         com_packindex ? com_packindex_mask + 1 : 0);
+   Con_Printf("%d files copied (%.0f bytes) in %.3f ms\n",
+         com_pathstats.loads, com_pathstats.loadbytes,
+         com_pathstats.loadseconds * 1000.0);
+   Con_Printf("%d files mapped (%.0f bytes)\n",
+         com_pathstats.maps, com_pathstats.mapbytes);
+
+   if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset"))
+      memset(&com_pathstats, 0, sizeof(com_pathstats));
+}
+
 /*
 ============
 COM_Path_f
@@ -1307,57 +1535,35 @@ int file_from_pak; // global indicating file came from pack file
 
 int COM_FOpenFile(const char *filename, FILE **file)
 {
-   searchpath_t *search;
    char path[MAX_OSPATH];
-   pack_t *pak;
-   int i;
-   int findtime;
+   searchpath_t *search;
+   packfile_t *packfile;
 
    file_from_pak = 0;
 
-   // search through the path, one element at a time
-   for (search = com_searchpaths; search; search = search->next)
+   search = COM_FindFile(filename, &packfile, path, sizeof(path));
+   if (!search)
    {
-      // is the element a pak file?
-      if (search->pack)
-      {
-         // look through all the pak file elements
-         pak = search->pack;
-         for (i = 0; i < pak->numfiles; i++)
-            if (!strcmp(pak->files[i].name, filename))
-            {	// found it!
-               // open a new file on the pakfile
-               *file = fopen(pak->filename, "rb");
-               if (!*file)
-                  Sys_Error("Couldn't reopen %s", pak->filename);
-               fseek(*file, pak->files[i].filepos, SEEK_SET);
-               com_filesize = pak->files[i].filelen;
-               file_from_pak = 1;
-               return com_filesize;
-            }
-      } else {
-         // check a file in the directory tree
-         if (!static_registered)
-         {
-            // if not a registered version, don't ever go beyond base
-            if (strchr(filename, '/') || strchr(filename, '\\'))
-               continue;
-         }
-         snprintf(path, sizeof(path), "%s/%s", search->filename, filename);
-         findtime = Sys_FileTime(path);
-         if (findtime == -1)
-            continue;
-
-         *file = fopen(path, "rb");
-         com_filesize = COM_filelength(*file);
-         return com_filesize;
-      }
+      *file = NULL;
+      com_filesize = -1;
+      return -1;
    }
 
-   *file = NULL;
-   com_filesize = -1;
+   if (packfile)
+   {
+      // open a new file on the pakfile
+      *file = fopen(search->pack->filename, "rb");
+      if (!*file)
+         Sys_Error("Couldn't reopen %s", search->pack->filename);
+      fseek(*file, packfile->filepos, SEEK_SET);
+      com_filesize = packfile->filelen;
+      file_from_pak = 1;
+      return com_filesize;
+   }
 
-   return -1;
+   *file = fopen(path, "rb");
+   com_filesize = COM_filelength(*file);
+   return com_filesize;
 }
 
 /*
@@ -1369,50 +1575,27 @@ Returns whether the file is found in the quake filesystem.
 */
 qboolean COM_FileExists (const char *filename)
 {
-   searchpath_t *search;
    char path[MAX_OSPATH];
-   pack_t *pak;
-   int i;
-   int findtime;
+   searchpath_t *search;
+   packfile_t *packfile;
 
    file_from_pak = 0;
 
-   // search through the path, one element at a time
-   for (search = com_searchpaths; search; search = search->next)
+   search = COM_FindFile(filename, &packfile, path, sizeof(path));
+   if (!search)
    {
-      // is the element a pak file?
-      if (search->pack)
-      {
-         // look through all the pak file elements
-         pak = search->pack;
-         for (i = 0; i < pak->numfiles; i++)
-            if (!strcmp(pak->files[i].name, filename))
-            {	// found it!
-               com_filesize = pak->files[i].filelen;
-               file_from_pak = 1;
-               return true;
-            }
-      } else {
-         // check a file in the directory tree
-         if (!static_registered)
-         {
-            // if not a registered version, don't ever go beyond base
-            if (strchr(filename, '/') || strchr(filename, '\\'))
-               continue;
-         }
-         snprintf(path, sizeof(path), "%s/%s", search->filename, filename);
-         findtime = Sys_FileTime(path);
-         if (findtime == -1)
-            continue;
-
-         return true;
-      }
+      Sys_Printf("FindFile: can't find %s\n", filename);
+      com_filesize = -1;
+      return false;
    }
 
-   Sys_Printf("FindFile: can't find %s\n", filename);
-   com_filesize = -1;
+   if (packfile)
+   {
+      com_filesize = packfile->filelen;
+      file_from_pak = 1;
+   }
 
-   return false;
+   return true;
 }
 
 static void COM_ScanDirDir(struct stree_root *root, struct RDIR *dir, const char *pfx,
@@ -1541,12 +1724,43 @@ static int loadsize;
 
 static void *COM_LoadFile(const char *path, int usehunk, unsigned long *length)
 {
+   double start = Sys_DoubleTime();
    FILE *f;
    char base[32];
+   char ospath[MAX_OSPATH];
+   searchpath_t *search;
+   packfile_t *packfile;
    byte *buf = NULL;			// quiet compiler warning
-   int len = com_filesize = COM_FOpenFile(path, &f);  // look for it in the filesystem or pack files
-   if (!f)
+   int len;
+
+   // look for it in the filesystem or pack files
+   file_from_pak = 0;
+   search = COM_FindFile(path, &packfile, ospath, sizeof(ospath));
+   if (!search)
+   {
+      com_filesize = -1;
       return NULL;
+   }
+
+   if (packfile)
+   {
+      // read straight from the pack's own handle
+      f = search->pack->handle;
+      fseek(f, packfile->filepos, SEEK_SET);
+      len = packfile->filelen;
+      file_from_pak = 1;
+   }
+   else
+   {
+      f = fopen(ospath, "rb");
+      if (!f)
+      {
+         com_filesize = -1;
+         return NULL;
+      }
+      len = COM_filelength(f);
+   }
+   com_filesize = len;
 
    if (length)
       *length = len;
@@ -1580,11 +1794,16 @@ static void *COM_LoadFile(const char *path, int usehunk, unsigned long *length)
    Draw_BeginDisc();
 #endif
    fread(buf, 1, len, f);
-   fclose(f);
+   if (!packfile)
+      fclose(f);
 #ifndef SERVERONLY
    Draw_EndDisc();
 #endif
 
+   com_pathstats.loads++;
+   com_pathstats.loadbytes += len;
+   com_pathstats.loadseconds += Sys_DoubleTime() - start;
+
    return buf;
 }
 
@@ -1618,6 +1837,43 @@ void *COM_LoadStackFile(const char *path, void *buffer, int bufsize,
    return buf;
 }
 
+/*
+============
+COM_MapFile
+
+Returns a read-only view of a file inside a memory mapped pack, without
+copying it anywhere. Returns NULL if the file can't be had that way, in
+which case the caller should fall back to one of the loaders above.
+============
+*/
+const void *COM_MapFile(const char *path, unsigned long *length)
+{
+   char ospath[MAX_OSPATH];
+   searchpath_t *search;
+   packfile_t *packfile;
+
+   search = COM_FindFile(path, &packfile, ospath, sizeof(ospath));
+   if (!search || !packfile || !search->pack->mapped)
+      return NULL;
+
+   /* loaders read whole ints and floats from their input */
+   if (packfile->filepos & 3)
+      return NULL;
+   if (packfile->filepos < 0 || packfile->filelen < 0 ||
+         (size_t)packfile->filepos + packfile->filelen > search->pack->mappedsize)
+      return NULL;
+
+   com_filesize = packfile->filelen;
+   file_from_pak = 1;
+   if (length)
+      *length = packfile->filelen;
+
+   com_pathstats.maps++;
+   com_pathstats.mapbytes += packfile->filelen;
+
+   return search->pack->mapped + packfile->filepos;
+}
+
 /*
 =================
 COM_LoadPackFile
@@ -1636,10 +1892,11 @@ static pack_t *COM_LoadPackFile(const char *packfile)
    dpackfile_t *dfiles;
    packfile_t *mfiles;
    pack_t *pack;
-   int i, numfiles;
+   int i, numfiles, packsize;
    unsigned short crc;
 
-   if (COM_FileOpenRead(packfile, &packhandle) == -1)
+   packsize = COM_FileOpenRead(packfile, &packhandle);
+   if (packsize == -1)
       goto error;
 
    fread(&header, 1, sizeof(header), packhandle);
@@ -1712,6 +1969,24 @@ static pack_t *COM_LoadPackFile(const char *packfile)
    strcpy(pack->filename, packfile);
    pack->numfiles = numfiles;
    pack->files = mfiles;
+   pack->handle = packhandle;
+
+   /*
+    * Loaders byte swap their input in place on big endian targets, so only
+    * hand out mapped views where the data can be used as is.
+    */
+#if defined(HAVE_MMAP) && !defined(MSB_FIRST)
+   if (!COM_CheckParm("-nommap"))
+   {
+      void *view = mmap(NULL, packsize, PROT_READ, MAP_PRIVATE,
+            fileno(packhandle), 0);
+      if (view != MAP_FAILED)
+      {
+         pack->mapped = (const byte *)view;
+         pack->mappedsize = packsize;
+      }
+   }
+#endif
 
    Con_Printf("Added packfile %s (%i files)\n", packfile, numfiles);
 
@@ -1766,6 +2041,7 @@ static void COM_AddGameDirectory(const char *base, const char *dir)
    strcpy(search->filename, com_gamedir);
    search->next = com_searchpaths;
    com_searchpaths = search;
+   com_packindex_dirty = true;
 
    // add any pak files in the format pak0.pak pak1.pak, ...
    for (i = 0;; i++)
@@ -1826,6 +2102,12 @@ void COM_Gamedir(const char *dir)
    {
       if (com_searchpaths->pack)
       {
+         fclose(com_searchpaths->pack->handle);
+#ifdef HAVE_MMAP
+         if (com_searchpaths->pack->mapped)
+            munmap((void *)com_searchpaths->pack->mapped,
+                  com_searchpaths->pack->mappedsize);
+#endif
          Z_Free(com_searchpaths->pack->files);
          Z_Free(com_searchpaths->pack);
       }
@@ -1833,6 +2115,7 @@ void COM_Gamedir(const char *dir)
       Z_Free(com_searchpaths);
       com_searchpaths = next;
    }
+   com_packindex_dirty = true;
 
    // flush all data, so it will be forced to reload
    Cache_Flush();
@@ -1847,6 +2130,7 @@ void COM_Gamedir(const char *dir)
    strcpy(search->filename, com_gamedir);
    search->next = com_searchpaths;
    com_searchpaths = search;
+   com_packindex_dirty = true;
 
    // add any pak files in the format pak0.pak pak1.pak, ...
    for (i = 0;; i++)
@@ -1927,6 +2211,7 @@ static void COM_InitFilesystem(void)
    if (i) {
       com_modified = true;
       com_searchpaths = NULL;
+      com_packindex_dirty = true;
       while (++i < com_argc) {
          if (!com_argv[i] || com_argv[i][0] == '+'
                || com_argv[i][0] == '-')
@@ -240,6 +240,8 @@ void COM_DefaultExtension(char *path, const char *extension);
 int COM_CheckExtension(const char *path, const char *extn);
 
 char *va(const char *format, ...);
+unsigned COM_HashString(const char *s);
+unsigned COM_HashBytes(const void *data, int length);
 
 // does a varargs printf into a temp buffer
 
@@ -260,6 +262,7 @@ void COM_ScanDir(struct stree_root *root, const char *path,
 
 void *COM_LoadStackFile(const char *path, void *buffer, int bufsize,
 			unsigned long *length);
+const void *COM_MapFile(const char *path, unsigned long *length);
 void *COM_LoadTempFile(const char *path);
 void *COM_LoadHunkFile(const char *path);
 void COM_LoadCacheFile(const char *path, struct cache_user_s *cu);
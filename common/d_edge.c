@@ -22,6 +22,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "d_local.h"
 #include "quakedef.h"
 #include "r_local.h"
+#include "sys.h"
+#include "tasks.h"
 
 #ifdef NQ_HACK
 #include "client.h"
@@ -29,6 +31,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 static int miplevel;
 static vec3_t transformed_modelorg;
+static vec3_t world_transformed_modelorg;
 
 float scale_for_mip;
 int ubasestep, errorterm, erroradjustup, erroradjustdown;
@@ -66,12 +69,12 @@ D_DrawSolidSurface
 
 // FIXME: clean this up
 
-static void D_DrawSolidSurface(surf_t *surf, int color)
+static void D_DrawSolidSurface(espan_t *spans, int color)
 {
    espan_t *span;
    int pix = (color << 24) | (color << 16) | (color << 8) | color;
 
-   for (span = surf->spans; span; span = span->pnext)
+   for (span = spans; span; span = span->pnext)
    {
       byte *pdest = (byte *)d_viewbuffer + screenwidth * span->v;
       int u = span->u;
@@ -143,135 +146,366 @@ static void D_CalcGradients(msurface_t *pface)
 }
 
 
+typedef enum {
+   DS_SKY,
+   DS_BACKGROUND,
+   DS_TURB,
+   DS_SOLID
+} drawsurf_type_t;
+
+THREAD_LOCAL surfcache_t *pcurrentcache;
+
 /*
 ==============
-D_DrawSurfaces
+D_SetupSurface
+
+Sets the span drawing state (gradients, cache block) for one surface,
+building its surface cache if needed. Submodel surfaces are rotated into
+place and the world drawing state is restored again before returning, since
+none of the span drawers depend on it.
 ==============
 */
-surfcache_t *pcurrentcache;
-void D_DrawSurfaces(void)
+static drawsurf_type_t D_SetupSurface(surf_t *s)
 {
-   surf_t *s;
    msurface_t *pface;
-   vec3_t world_transformed_modelorg;
    vec3_t local_modelorg;
    const entity_t *e = &r_worldentity;
+   drawsurf_type_t type;
 
-   TransformVector(modelorg, transformed_modelorg);
-   VectorCopy(transformed_modelorg, world_transformed_modelorg);
+   if (s->flags & SURF_DRAWBACKGROUND)
+   {
+      /* Set up a gradient for the background surface that places it
+       * effectively at infinity distance from the viewpoint */
+      d_zistepu = 0;
+      d_zistepv = 0;
+      d_ziorigin = -0.9;
+      return DS_BACKGROUND;
+   }
 
-   for (s = &surfaces[1]; s < surface_p; s++)
+   d_zistepu = s->d_zistepu;
+   d_zistepv = s->d_zistepv;
+   d_ziorigin = s->d_ziorigin;
+
+   if (s->flags & SURF_DRAWSKY)
+      return DS_SKY;
+
+   if (s->insubmodel)
    {
-      if (!s->spans)
-         continue;
+      /* FIXME: we don't want to do all this for every polygon!
+       * TODO: store once at start of frame
+       */
+      e = s->entity;	/* FIXME: make this passed in to R_RotateBmodel () */
+      VectorSubtract(r_origin, e->origin, local_modelorg);
+      TransformVector(local_modelorg, transformed_modelorg);
+
+      R_RotateBmodel(e);	/* FIXME: don't mess with the frustum, make entity passed in */
+   }
 
-      r_drawnpolycount++;
+   pface = (msurface_t*)s->data;
+
+   if (s->flags & SURF_DRAWTURB)
+   {
+      type = DS_TURB;
+      miplevel = 0;
+      cacheblock = (pixel_t *)
+         ((byte *)pface->texinfo->texture +
+          pface->texinfo->texture->offsets[0]);
+      cachewidth = 64;
+   }
+   else
+   {
+      type = DS_SOLID;
+      miplevel = D_MipLevelForScale(s->nearzi * scale_for_mip
+            * pface->texinfo->mipadjust);
+
+      /* FIXME: make this passed in to D_CacheSurface */
+      pcurrentcache = D_CacheSurface(e, pface, miplevel);
 
+      /* building the cache may have flushed queued bands on this thread */
       d_zistepu = s->d_zistepu;
       d_zistepv = s->d_zistepv;
       d_ziorigin = s->d_ziorigin;
 
-      if (s->flags & SURF_DRAWSKY)
-      {
-         D_DrawSkyScans8(s->spans);
-         D_DrawZSpans(s->spans);
-      }
-      else if (s->flags & SURF_DRAWBACKGROUND)
+      cacheblock = (pixel_t *)pcurrentcache->data;
+      cachewidth = pcurrentcache->width;
+   }
+
+   D_CalcGradients(pface);
+
+   if (s->insubmodel)
+   {
+      /* restore the old drawing state
+       *
+       * FIXME: we don't want to do this every time!
+       * TODO: speed up
+       */
+      VectorCopy(world_transformed_modelorg,
+            transformed_modelorg);
+      VectorCopy(base_vpn, vpn);
+      VectorCopy(base_vup, vup);
+      VectorCopy(base_vright, vright);
+      VectorCopy(base_modelorg, modelorg);
+      R_TransformFrustum();
+   }
+
+   return type;
+}
+
+/*
+==============
+D_ClearColorSpans
+
+Only solid surfaces have true color texels; zero the color view under the
+others so VID_Update falls back to their palette colors
+==============
+*/
+static void D_ClearColorSpans(espan_t *span)
+{
+   for (; span; span = span->pnext)
+      memset(d_colorview + span->v * screenwidth + span->u, 0,
+            span->count * sizeof(*d_colorview));
+}
+
+/*
+==============
+D_RasterSurface
+
+Draws a list of spans using the current span drawing state
+==============
+*/
+static void D_RasterSurface(drawsurf_type_t type, espan_t *spans)
+{
+   if (d_colorview && type != DS_SOLID)
+      D_ClearColorSpans(spans);
+
+   switch (type)
+   {
+      case DS_SKY:
+         D_DrawSkyScans8(spans);
+         break;
+      case DS_BACKGROUND:
+         D_DrawSolidSurface(spans, (int)r_clearcolor.value & 0xFF);
+         break;
+      case DS_TURB:
+         Turbulent8(spans);
+         break;
+      case DS_SOLID:
+         D_DrawSpans(spans);
+         break;
+   }
+   D_DrawZSpans(spans);
+}
+
+/*
+==============================================================================
+
+BANDED RASTERIZATION
+
+When more than one task thread is configured, D_DrawSurfaces only sets up
+each surface on the calling thread and queues it together with a copy of its
+span drawing state. The queued spans are then split into horizontal bands of
+the screen which are rasterized concurrently. Every pixel is covered by
+exactly one span, so the result is identical to drawing the surfaces one
+after the other.
+
+The surface cache blocks the queued surfaces read from are built in parallel
+as well, just before the bands are drawn. The queue has to be flushed early
+if another surface cache entry would overwrite a block that a queued surface
+still reads from; see D_SCAlloc and D_CacheSurface.
+==============================================================================
+*/
+
+typedef struct {
+   drawsurf_type_t type;
+   espan_t *spans;
+   espan_t *bandspans[MAX_TASK_THREADS];
+
+   float sdivzstepu, tdivzstepu, zistepu;
+   float sdivzstepv, tdivzstepv, zistepv;
+   float sdivzorigin, tdivzorigin, ziorigin;
+   fixed16_t sadjust, tadjust, bbextents, bbextentt;
+   pixel_t *cacheblock;
+   int cachewidth;
+   surfcache_t *cache;
+} bandsurf_t;
+
+int d_bandmark = 1;
+int d_numbandsurfs;
+
+static bandsurf_t *bandsurfs;
+static int maxbandsurfs;
+static int numbands;
+
+static void D_QueueBandSurface(drawsurf_type_t type, espan_t *spans)
+{
+   bandsurf_t *bs;
+
+   if (d_numbandsurfs == maxbandsurfs)
+   {
+      maxbandsurfs = maxbandsurfs ? maxbandsurfs * 2 : 256;
+      bandsurfs = realloc(bandsurfs, maxbandsurfs * sizeof(*bandsurfs));
+      if (!bandsurfs)
+         Sys_Error("%s: out of memory", __func__);
+   }
+
+   bs = &bandsurfs[d_numbandsurfs++];
+   bs->type = type;
+   bs->spans = spans;
+   bs->sdivzstepu = d_sdivzstepu;
+   bs->tdivzstepu = d_tdivzstepu;
+   bs->zistepu = d_zistepu;
+   bs->sdivzstepv = d_sdivzstepv;
+   bs->tdivzstepv = d_tdivzstepv;
+   bs->zistepv = d_zistepv;
+   bs->sdivzorigin = d_sdivzorigin;
+   bs->tdivzorigin = d_tdivzorigin;
+   bs->ziorigin = d_ziorigin;
+   bs->sadjust = sadjust;
+   bs->tadjust = tadjust;
+   bs->bbextents = bbextents;
+   bs->bbextentt = bbextentt;
+   bs->cacheblock = cacheblock;
+   bs->cachewidth = cachewidth;
+   bs->cache = NULL;
+
+   if (type == DS_SOLID)
+   {
+      bs->cache = pcurrentcache;
+      pcurrentcache->bandmark = d_bandmark;
+   }
+}
+
+static void D_DrawBand(void *data, int band)
+{
+   int i;
+
+   for (i = 0; i < d_numbandsurfs; i++)
+   {
+      const bandsurf_t *bs = &bandsurfs[i];
+
+      if (!bs->bandspans[band])
+         continue;
+
+      d_sdivzstepu = bs->sdivzstepu;
+      d_tdivzstepu = bs->tdivzstepu;
+      d_zistepu = bs->zistepu;
+      d_sdivzstepv = bs->sdivzstepv;
+      d_tdivzstepv = bs->tdivzstepv;
+      d_zistepv = bs->zistepv;
+      d_sdivzorigin = bs->sdivzorigin;
+      d_tdivzorigin = bs->tdivzorigin;
+      d_ziorigin = bs->ziorigin;
+      sadjust = bs->sadjust;
+      tadjust = bs->tadjust;
+      bbextents = bs->bbextents;
+      bbextentt = bs->bbextentt;
+      cacheblock = bs->cacheblock;
+      cachewidth = bs->cachewidth;
+      pcurrentcache = bs->cache;
+
+      D_RasterSurface(bs->type, bs->bandspans[band]);
+   }
+}
+
+/*
+==============
+D_FlushBands
+
+Rasterize everything queued so far
+==============
+*/
+void D_FlushBands(void)
+{
+   int i, band, top, bottom, rows;
+   vec3_t save_vpn, save_vup, save_vright;
+   espan_t *span, *next;
+
+   D_BuildSurfaces();
+
+   if (!d_numbandsurfs)
+      return;
+
+   /* find the scanlines covered by the queue and split it into bands */
+   top = MAXHEIGHT;
+   bottom = -1;
+   for (i = 0; i < d_numbandsurfs; i++)
+   {
+      for (span = bandsurfs[i].spans; span; span = span->pnext)
       {
-         /* Set up a gradient for the background surface that places it
-          * effectively at infinity distance from the viewpoint */
-         d_zistepu = 0;
-         d_zistepv = 0;
-         d_ziorigin = -0.9;
-
-         D_DrawSolidSurface(s, (int)r_clearcolor.value & 0xFF);
-         D_DrawZSpans(s->spans);
+         if (span->v < top)
+            top = span->v;
+         if (span->v > bottom)
+            bottom = span->v;
       }
-      else if (s->flags & SURF_DRAWTURB)
+   }
+   rows = bottom - top + 1;
+
+   for (i = 0; i < d_numbandsurfs; i++)
+   {
+      bandsurf_t *bs = &bandsurfs[i];
+
+      memset(bs->bandspans, 0, sizeof(bs->bandspans));
+      for (span = bs->spans; span; span = next)
       {
-         pface = (msurface_t*)s->data;
-         miplevel = 0;
-         cacheblock = (pixel_t *)
-            ((byte *)pface->texinfo->texture +
-             pface->texinfo->texture->offsets[0]);
-         cachewidth = 64;
-
-         if (s->insubmodel)
-         {
-            /* FIXME: we don't want to do all this for every polygon!
-             * TODO: store once at start of frame
-             */
-            e = s->entity;	/* FIXME: make this passed in to // R_RotateBmodel () */
-            VectorSubtract(r_origin, e->origin, local_modelorg);
-            TransformVector(local_modelorg, transformed_modelorg);
-
-            R_RotateBmodel(e);	/* FIXME: don't mess with the frustum, make entity passed in */
-         }
-
-         D_CalcGradients(pface);
-         Turbulent8(s->spans);
-         D_DrawZSpans(s->spans);
-
-         if (s->insubmodel)
-         {
-            /* restore the old drawing state
-             *
-             * FIXME: we don't want to do this every time!
-             * TODO: speed up
-             */
-            e = &r_worldentity;
-            VectorCopy(world_transformed_modelorg,
-                  transformed_modelorg);
-            VectorCopy(base_vpn, vpn);
-            VectorCopy(base_vup, vup);
-            VectorCopy(base_vright, vright);
-            VectorCopy(base_modelorg, modelorg);
-            R_TransformFrustum();
-         }
+         next = span->pnext;
+         band = ((span->v - top) * numbands) / rows;
+         span->pnext = bs->bandspans[band];
+         bs->bandspans[band] = span;
       }
+      bs->spans = NULL;
+   }
+
+   /*
+    * The sky is projected with the view vectors, which may currently be
+    * rotated for a submodel if we were called from D_CacheSurface.
+    */
+   VectorCopy(vpn, save_vpn);
+   VectorCopy(vup, save_vup);
+   VectorCopy(vright, save_vright);
+   VectorCopy(base_vpn, vpn);
+   VectorCopy(base_vup, vup);
+   VectorCopy(base_vright, vright);
+
+   Tasks_Run(D_DrawBand, NULL, numbands);
+
+   VectorCopy(save_vpn, vpn);
+   VectorCopy(save_vup, vup);
+   VectorCopy(save_vright, vright);
+
+   d_numbandsurfs = 0;
+   d_bandmark++;
+}
+
+
+/*
+==============
+D_DrawSurfaces
+==============
+*/
+void D_DrawSurfaces(void)
+{
+   surf_t *s;
+
+   TransformVector(modelorg, transformed_modelorg);
+   VectorCopy(transformed_modelorg, world_transformed_modelorg);
+
+   numbands = Tasks_NumThreads();
+
+   for (s = &surfaces[1]; s < surface_p; s++)
+   {
+      drawsurf_type_t type;
+
+      if (!s->spans)
+         continue;
+
+      r_drawnpolycount++;
+
+      type = D_SetupSurface(s);
+      if (numbands > 1)
+         D_QueueBandSurface(type, s->spans);
       else
-      {
-         if (s->insubmodel)
-         {
-            // FIXME: we don't want to do all this for every polygon!
-            // TODO: store once at start of frame
-            e = s->entity;	//FIXME: make this passed in to
-            // R_RotateBmodel ()
-            VectorSubtract(r_origin, e->origin, local_modelorg);
-            TransformVector(local_modelorg, transformed_modelorg);
-
-            R_RotateBmodel(e);	// FIXME: don't mess with the frustum,
-            // make entity passed in
-         }
-
-         pface = (msurface_t*)s->data;
-         miplevel = D_MipLevelForScale(s->nearzi * scale_for_mip
-               * pface->texinfo->mipadjust);
-
-         /* FIXME: make this passed in to D_CacheSurface */
-         pcurrentcache = D_CacheSurface(e, pface, miplevel);
-
-         cacheblock = (pixel_t *)pcurrentcache->data;
-         cachewidth = pcurrentcache->width;
-
-         D_CalcGradients(pface);
-         D_DrawSpans(s->spans);
-         D_DrawZSpans(s->spans);
-
-         if (s->insubmodel)
-         {
-            // restore the old drawing state
-            // FIXME: we don't want to do this every time!
-            // TODO: speed up
-            e = &r_worldentity;
-            VectorCopy(world_transformed_modelorg,
-                  transformed_modelorg);
-            VectorCopy(base_vpn, vpn);
-            VectorCopy(base_vup, vup);
-            VectorCopy(base_vright, vright);
-            VectorCopy(base_modelorg, modelorg);
-            R_TransformFrustum();
-         }
-      }
+         D_RasterSurface(type, s->spans);
    }
+
+   D_FlushBands();
 }
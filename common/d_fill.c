@@ -19,6 +19,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // d_clear: clears a specified rectangle to the specified color
 
+#include "d_iface.h"
 #include "quakedef.h"
 #include "vid.h"
 
@@ -54,6 +55,7 @@ void D_FillRect(vrect_t *rect, int color)
    if (rwidth < 1 || rheight < 1)
       return;
 
+   D_DropColor(rx, ry, rwidth, rheight);
    dest = ((byte *)vid.buffer + ry * vid.rowbytes + rx);
 
    if (((rwidth & 0x03) == 0) && (((long)dest & 0x03) == 0))
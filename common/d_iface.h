@@ -21,6 +21,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #ifndef D_IFACE_H
 #define D_IFACE_H
 
+#include "common.h"
 #include "cvar.h"
 #include "mathlib.h"
 #include "model.h"
@@ -112,6 +113,28 @@ extern float r_aliasuvscale;	// scale-up factor for screen u and v
 extern int r_pixbytes;
 extern qboolean r_dowarp;
 
+/*
+ * With r_truecolor set the surface cache holds 32-bit texels, the lit color
+ * as 0xRRGGBB with D_COLOR_OWNED in the top byte. Where d_colorview is not
+ * NULL (laid out like d_viewbuffer) the span drawers write those texels to
+ * it and nothing to the 8-bit view. Everything else that draws over them
+ * clears the top byte, and VID_Update shows the color only where it is set.
+ */
+extern int r_truecolor;
+extern unsigned *d_colorview;
+
+#define D_COLOR_OWNED 0xff000000u
+
+#define D_PALETTE_TEXEL(index) \
+    (D_COLOR_OWNED | ((d_8to24table[index] & 0xff) << 16) | \
+     (d_8to24table[index] & 0xff00) | ((d_8to24table[index] >> 16) & 0xff))
+
+/* the closest palette index to a color view pixel */
+#define D_COLOR_INDEX(c) \
+    palmap2[((c) >> 18) & 63][((c) >> 10) & 63][((c) >> 2) & 63]
+
+void D_DropColor(int x, int y, int width, int height);
+
 extern affinetridesc_t r_affinetridesc;
 extern spritedesc_t r_spritedesc;
 
@@ -179,7 +202,7 @@ typedef struct {
     int surfheight;		// in mipmapped texels
 } drawsurf_t;
 
-extern drawsurf_t r_drawsurf;
+extern THREAD_LOCAL drawsurf_t r_drawsurf;
 
 void R_DrawSurface(void);
 
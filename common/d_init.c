@@ -37,6 +37,8 @@ float d_scalemip[NUM_MIPS - 1];
 
 static float basemip[NUM_MIPS - 1] = { 1.0, 0.5 * 0.8, 0.25 * 0.8 };
 
+static vrect_t d_colorvrect;	// view the color view was last drawn for
+
 void (*D_DrawSpans)(espan_t *pspan);
 
 /*
@@ -54,6 +56,7 @@ D_Init(void)
     Cvar_RegisterVariable(&d_mipcap);
     Cvar_RegisterVariable(&d_mipscale);
     Cvar_RegisterVariable(&dither_filter);
+    D_InitCacheStats();
 
     r_recursiveaffinetriangles = true;
     r_pixbytes = 1;
@@ -122,13 +125,81 @@ D_SetupFrame(void)
 
    D_DrawSpans = D_DrawSpans8;
 
-   if (cvar && cvar->value == 1.0f)
+   /*
+    * The warp is resampled from the 8-bit view only. Otherwise the color
+    * view stays in use until the next frame, so the 2D drawing on top of
+    * this one can give its pixels back (see D_DropColor).
+    */
+   d_colorview = NULL;
+   if (r_truecolor && !r_dowarp)
+   {
+      d_colorview = vid.colorbuffer;
+
+      /* nothing is drawn over a view that has moved away */
+      if (memcmp(&r_refdef.vrect, &d_colorvrect, sizeof(d_colorvrect)))
+      {
+         memset(d_colorview, 0, vid.rowbytes * vid.height * sizeof(*d_colorview));
+         d_colorvrect = r_refdef.vrect;
+      }
+   }
+
+   if (r_truecolor)
+      D_DrawSpans = D_DrawSpans16Qb32;
+   else if (cvar && cvar->value == 1.0f)
       D_DrawSpans = D_DrawSpans16QbDither;
    else
       D_DrawSpans = D_DrawSpans16Qb;
 }
 
 
+/*
+===============
+D_DropColor
+
+Give a rectangle of the screen back to the 8-bit view before drawing over
+it in 8 bits. True color pixels are reduced to their closest palette
+index, so that whatever shows through transparent parts still matches.
+===============
+*/
+void D_DropColor(int x, int y, int width, int height)
+{
+   unsigned *pcolor;
+   byte *pdest;
+   int u, v;
+
+   if (!d_colorview)
+      return;
+
+   if (x < 0)
+   {
+      width += x;
+      x = 0;
+   }
+   if (y < 0)
+   {
+      height += y;
+      y = 0;
+   }
+   if (x + width > (int)vid.width)
+      width = vid.width - x;
+   if (y + height > (int)vid.height)
+      height = vid.height - y;
+
+   pcolor = d_colorview + y * vid.rowbytes + x;
+   pdest = vid.buffer + y * vid.rowbytes + x;
+   for (v = 0; v < height; v++, pcolor += vid.rowbytes, pdest += vid.rowbytes)
+   {
+      for (u = 0; u < width; u++)
+      {
+         if (pcolor[u])
+         {
+            pdest[u] = D_COLOR_INDEX(pcolor[u]);
+            pcolor[u] = 0;
+         }
+      }
+   }
+}
+
 /*
 ===============
 D_UpdateRects
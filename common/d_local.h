@@ -48,6 +48,7 @@ typedef struct surfcache_s {
     unsigned width;
     unsigned height;		// DEBUG only needed for debug
     float mipscale;
+    int bandmark;		// queued for building/drawing if == d_bandmark
     struct texture_s *texture;	// checked for animating textures
     byte data[4];		// width*height elements
 } surfcache_t;
@@ -59,16 +60,21 @@ typedef struct sspan_s {
 
 extern float scale_for_mip;
 
+extern int d_bandmark;
+extern int d_numbandsurfs;
+void D_FlushBands(void);
+void D_BuildSurfaces(void);
+
 extern qboolean d_roverwrapped;
 extern surfcache_t *sc_rover;
 extern surfcache_t *d_initial_rover;
 
-extern float d_sdivzstepu, d_tdivzstepu, d_zistepu;
-extern float d_sdivzstepv, d_tdivzstepv, d_zistepv;
-extern float d_sdivzorigin, d_tdivzorigin, d_ziorigin;
+extern THREAD_LOCAL float d_sdivzstepu, d_tdivzstepu, d_zistepu;
+extern THREAD_LOCAL float d_sdivzstepv, d_tdivzstepv, d_zistepv;
+extern THREAD_LOCAL float d_sdivzorigin, d_tdivzorigin, d_ziorigin;
 
-extern fixed16_t sadjust, tadjust;
-extern fixed16_t bbextents, bbextentt;
+extern THREAD_LOCAL fixed16_t sadjust, tadjust;
+extern THREAD_LOCAL fixed16_t bbextents, bbextentt;
 
 void D_DrawSpans8(espan_t *pspans);
 void D_DrawSpans16(espan_t *pspans);
@@ -76,6 +82,7 @@ extern void (*D_DrawSpans)(espan_t *pspan);
 
 void D_DrawSpans16Qb(espan_t *pspans);
 void D_DrawSpans16QbDither(espan_t *pspans);
+void D_DrawSpans16Qb32(espan_t *pspans);
 
 void D_DrawZSpans(espan_t *pspans);
 void Turbulent8(espan_t *pspan);
@@ -195,4 +195,19 @@ void D_DrawParticle(particle_t *pparticle)
          }
          break;
    }
+
+   /* uncover the pixels the particle went in front of, found by their z */
+   if (d_colorview)
+   {
+      unsigned *pcolor = d_colorview + d_scantable[v] + u;
+
+      pz = d_pzbuffer + (d_zwidth * v) + u;
+      count = pix << d_y_aspect_shift;
+      for (; count; count--, pz += d_zwidth, pcolor += screenwidth)
+      {
+         for (i = 0; i < pix; i++)
+            if (pz[i] == (short)izi)
+               pcolor[i] = 0;
+      }
+   }
 }
@@ -227,6 +227,8 @@ D_PolysetDrawFinalVerts(finalvert_t *fv, int numverts)
                pix = skintable[fv->v[3] >> 16][fv->v[2] >> 16];
                pix = ((byte *)acolormap)[pix + (fv->v[4] & 0xFF00)];
                d_viewbuffer[d_scantable[fv->v[1]] + fv->v[0]] = pix;
+               if (d_colorview)
+                  d_colorview[d_scantable[fv->v[1]] + fv->v[0]] = 0;
             }
          }
       }
@@ -425,6 +427,8 @@ split:
       *zbuf = z;
       pix = d_pcolormap[skintable[newobj[3] >> 16][newobj[2] >> 16]];
       d_viewbuffer[d_scantable[newobj[1]] + newobj[0]] = pix;
+      if (d_colorview)
+         d_colorview[d_scantable[newobj[1]] + newobj[0]] = 0;
    }
 
 nodraw:
@@ -612,6 +616,7 @@ void D_PolysetDrawSpansRGB(spanpackage_t *pspanpackage);
 void D_PolysetDrawSpans8(spanpackage_t *pspanpackage)
 {
    byte *lpdest;
+   unsigned *lpcolor;
    byte *lptex;
    int lsfrac, ltfrac;
    int llight;
@@ -634,6 +639,7 @@ void D_PolysetDrawSpans8(spanpackage_t *pspanpackage)
       if (lcount)
       {
          lpdest = (byte*)pspanpackage->pdest;
+         lpcolor = d_colorview ? d_colorview + (lpdest - d_viewbuffer) : NULL;
          lptex = pspanpackage->ptex;
          lpz = pspanpackage->pz;
          lsfrac = pspanpackage->sfrac;
@@ -645,9 +651,13 @@ void D_PolysetDrawSpans8(spanpackage_t *pspanpackage)
          {
             if ((lzi >> 16) >= *lpz) {
                *lpdest = ((byte *)acolormap)[*lptex + (llight & 0xFF00)];
+               if (lpcolor)
+                  *lpcolor = 0;
                *lpz = lzi >> 16;
             }
             lpdest++;
+            if (lpcolor)
+               lpcolor++;
             lzi += r_zistepx;
             lpz++;
             llight += r_lstepx;
@@ -674,6 +684,7 @@ extern	int			host_fullbrights;   // for preserving fullbrights in color operatio
 void D_PolysetDrawSpansRGB(spanpackage_t *pspanpackage)
 {
    byte *lpdest;
+   unsigned *lpcolor;
    byte *lptex;
    byte ah;
    vec3_t lc;
@@ -704,6 +715,7 @@ void D_PolysetDrawSpansRGB(spanpackage_t *pspanpackage)
       if (lcount)
       {
          lpdest = (byte*)pspanpackage->pdest;
+         lpcolor = d_colorview ? d_colorview + (lpdest - d_viewbuffer) : NULL;
          lptex = pspanpackage->ptex;
          lpz = pspanpackage->pz;
          lsfrac = pspanpackage->sfrac;
@@ -754,7 +766,16 @@ void D_PolysetDrawSpansRGB(spanpackage_t *pspanpackage)
 	        //        *lpdest = ((byte *)acolormap)[ah + (llight & 0xFF00)];
 		         //*lpdest = ((byte *)acolormap)[ah];
 		
-			*lpdest = palmap2 [trans[0]] [trans[1]] [trans[2]];
+			if (lpcolor)
+			{
+				for (seven=0;seven<3;seven++)
+					if (trans[seven] > 63)
+						trans[seven] = 63;
+				*lpcolor = D_COLOR_OWNED | (trans[0] << 18)
+					| (trans[1] << 10) | (trans[2] << 2);
+			}
+			else
+				*lpdest = palmap2 [trans[0]] [trans[1]] [trans[2]];
 
 		        // *lpdest = palmap2 [trans[0] >> 17] [trans[1] >> 17] [trans[2] >> 17];
 
@@ -762,10 +783,14 @@ void D_PolysetDrawSpansRGB(spanpackage_t *pspanpackage)
 		else
 		{
 		*lpdest = *lptex; // go directly to the color
+		if (lpcolor)
+			*lpcolor = D_PALETTE_TEXEL(*lptex);
 		}
                *lpz = lzi >> 16;
             }
             lpdest++;
+            if (lpcolor)
+               lpcolor++;
             lzi += r_zistepx;
             lpz++;
             llight += r_lstepx;
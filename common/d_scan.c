@@ -25,10 +25,10 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "r_local.h"
 #include "d_local.h"
 
-unsigned char *r_turb_pbase, *r_turb_pdest;
-fixed16_t r_turb_s, r_turb_t, r_turb_sstep, r_turb_tstep;
-int *r_turb_turb;
-int r_turb_spancount;
+THREAD_LOCAL unsigned char *r_turb_pbase, *r_turb_pdest;
+THREAD_LOCAL fixed16_t r_turb_s, r_turb_t, r_turb_sstep, r_turb_tstep;
+THREAD_LOCAL int *r_turb_turb;
+THREAD_LOCAL int r_turb_spancount;
 
 void D_DrawTurbulent8Span(void);
 
@@ -257,12 +257,6 @@ FIXME: actually make this subdivide by 16 instead of 8!!!  qb:  OK!!!!
             //unrolled- mh, MK, qbism
             //============================================*/
 
-   static int          count, spancount;
-   static byte         *pbase, *pdest;
-   static fixed16_t    s, t, snext, tnext, sstep, tstep;
-   static float        sdivz, tdivz, zi, z, du, dv, spancountminus1;
-   static float        sdivzstepu, tdivzstepu, zistepu;
-
    int dither_kernel[2][2][2] =
 {
    {
@@ -276,9 +270,9 @@ FIXME: actually make this subdivide by 16 instead of 8!!!  qb:  OK!!!!
       }
 };
 
-#define SOLID(i) pdest[i] = pbase[(s >> 16) + (t >> 16) * cachewidth]
-#define DITHERED_SOLID(i) pdest[i] = pbase[idiths + iditht * cachewidth]
-#define DITHERED_SOLID_B(i) pdest[i] = pbase[idiths_b + iditht_b * cachewidth]
+#define SOLID(i) pdest[i] = pbase[(s >> 16) + (t >> 16) * cachew]
+#define DITHERED_SOLID(i) pdest[i] = pbase[idiths + iditht * cachew]
+#define DITHERED_SOLID_B(i) pdest[i] = pbase[idiths_b + iditht_b * cachew]
 
 #define DITHERED_SOLID_B_UPDATE() \
    idiths_b = (s + dither_val_s_b) >> 16; iditht_b = (t + dither_val_t_b) >> 16; \
@@ -291,12 +285,20 @@ idiths = idiths ? ((idiths) - 1) : idiths; \
 iditht = iditht ? ((iditht) - 1) : iditht
 
 //qbism: pointer to pbase and macroize idea from mankrip
-#define WRITEPDEST(i) { pdest[i] = *(pbase + (s >> 16) + (t >> 16) * cachewidth); s+=sstep; t+=tstep;}
+#define WRITEPDEST(i) { pdest[i] = *(pbase + (s >> 16) + (t >> 16) * cachew); s+=sstep; t+=tstep;}
 
-extern surfcache_t		*pcurrentcache;
+extern THREAD_LOCAL surfcache_t *pcurrentcache;
 
 void D_DrawSpans16Qb(espan_t *pspan) //qb: up it from 8 to 16.  This + unroll = big speed gain!
 {
+   /* locals rather than file statics, so bands can be drawn concurrently */
+   const int    cachew = cachewidth;
+   int          count, spancount;
+   byte         *pbase, *pdest;
+   fixed16_t    s, t, snext, tnext, sstep, tstep;
+   float        sdivz, tdivz, zi, z, du, dv, spancountminus1;
+   float        sdivzstepu, tdivzstepu, zistepu;
+
    sstep = 0;   // keep compiler happy
    tstep = 0;   // ditto
 
@@ -432,12 +434,174 @@ void D_DrawSpans16Qb(espan_t *pspan) //qb: up it from 8 to 16.  This + unroll =
    } while ((pspan = pspan->pnext) != NULL);
 }
 
+/*
+ * The surface cache holds 32-bit texels in true color mode (see
+ * d_colorview), which only go to the color view. Warped frames have no
+ * color view and get the closest palette index instead. There is no
+ * dithered version.
+ */
+#define WRITEPDEST32(i) { texel = *(pbase + (s >> 16) + (t >> 16) * cachew); \
+   if (pcolor) pcolor[i] = texel; else pdest[i] = D_COLOR_INDEX(texel); \
+   s+=sstep; t+=tstep;}
+
+void D_DrawSpans16Qb32(espan_t *pspan)
+{
+   const int    cachew = cachewidth;
+   int          count, spancount;
+   const unsigned *pbase;
+   unsigned     texel, *pcolor;
+   byte         *pdest;
+   fixed16_t    s, t, snext, tnext, sstep, tstep;
+   float        sdivz, tdivz, zi, z, du, dv, spancountminus1;
+   float        sdivzstepu, tdivzstepu, zistepu;
+
+   sstep = 0;   // keep compiler happy
+   tstep = 0;   // ditto
+
+   pbase = (const unsigned *)cacheblock;
+   sdivzstepu = d_sdivzstepu * 16;
+   tdivzstepu = d_tdivzstepu * 16;
+   zistepu = d_zistepu * 16;
+
+   do
+   {
+      pdest = (byte *)((byte *)d_viewbuffer + (screenwidth * pspan->v) + pspan->u);
+      pcolor = d_colorview ? d_colorview + (pdest - d_viewbuffer) : NULL;
+      count = pspan->count >> 4;
+
+      spancount = pspan->count % 16;
+
+      // calculate the initial s/z, t/z, 1/z, s, and t and clamp
+      du = (float)pspan->u;
+      dv = (float)pspan->v;
+
+      sdivz = d_sdivzorigin + dv*d_sdivzstepv + du*d_sdivzstepu;
+      tdivz = d_tdivzorigin + dv*d_tdivzstepv + du*d_tdivzstepu;
+      zi = d_ziorigin + dv*d_zistepv + du*d_zistepu;
+      z = (float)0x10000 / zi;   // prescale to 16.16 fixed-point
+
+      s = (int)(sdivz * z) + sadjust;
+      if (s < 0) s = 0;
+      else if (s > bbextents) s = bbextents;
+
+      t = (int)(tdivz * z) + tadjust;
+      if (t < 0) t = 0;
+      else if (t > bbextentt) t = bbextentt;
+
+      while (count-- > 0)
+      {
+         sdivz += sdivzstepu;
+         tdivz += tdivzstepu;
+         zi += zistepu;
+         z = (float)0x10000 / zi;   // prescale to 16.16 fixed-point
+
+         snext = (int)(sdivz * z) + sadjust;
+         if (snext < 16) snext = 16;
+         else if (snext > bbextents) snext = bbextents;
+
+         tnext = (int)(tdivz * z) + tadjust;
+         if (tnext < 16) tnext = 16;
+         else if (tnext > bbextentt) tnext = bbextentt;
+
+         sstep = (snext - s) >> 4;
+         tstep = (tnext - t) >> 4;
+         pdest += 16;
+         if (pcolor)
+            pcolor += 16;
+
+         WRITEPDEST32(-16);
+         WRITEPDEST32(-15);
+         WRITEPDEST32(-14);
+         WRITEPDEST32(-13);
+         WRITEPDEST32(-12);
+         WRITEPDEST32(-11);
+         WRITEPDEST32(-10);
+         WRITEPDEST32(-9);
+         WRITEPDEST32(-8);
+         WRITEPDEST32(-7);
+         WRITEPDEST32(-6);
+         WRITEPDEST32(-5);
+         WRITEPDEST32(-4);
+         WRITEPDEST32(-3);
+         WRITEPDEST32(-2);
+         WRITEPDEST32(-1);
+
+         s = snext;
+         t = tnext;
+      }
+      if (spancount > 0)
+      {
+         spancountminus1 = (float)(spancount - 1);
+         sdivz += d_sdivzstepu * spancountminus1;
+         tdivz += d_tdivzstepu * spancountminus1;
+         zi += d_zistepu * spancountminus1;
+         z = (float)0x10000 / zi;   // prescale to 16.16 fixed-point
+
+         snext = (int)(sdivz * z) + sadjust;
+         if (snext < 16) snext = 16;
+         else if (snext > bbextents) snext = bbextents;
+
+         tnext = (int)(tdivz * z) + tadjust;
+         if (tnext < 16) tnext = 16;
+         else if (tnext > bbextentt) tnext = bbextentt;
+
+         if (spancount > 1)
+         {
+            sstep = (snext - s) / (spancount - 1);
+            tstep = (tnext - t) / (spancount - 1);
+         }
+
+         pdest += spancount;
+         if (pcolor)
+            pcolor += spancount;
+
+         switch (spancount)
+         {
+            case 16:
+               WRITEPDEST32(-16);
+            case 15:
+               WRITEPDEST32(-15);
+            case 14:
+               WRITEPDEST32(-14);
+            case 13:
+               WRITEPDEST32(-13);
+            case 12:
+               WRITEPDEST32(-12);
+            case 11:
+               WRITEPDEST32(-11);
+            case 10:
+               WRITEPDEST32(-10);
+            case  9:
+               WRITEPDEST32(-9);
+            case  8:
+               WRITEPDEST32(-8);
+            case  7:
+               WRITEPDEST32(-7);
+            case  6:
+               WRITEPDEST32(-6);
+            case  5:
+               WRITEPDEST32(-5);
+            case  4:
+               WRITEPDEST32(-4);
+            case  3:
+               WRITEPDEST32(-3);
+            case  2:
+               WRITEPDEST32(-2);
+            case  1:
+               WRITEPDEST32(-1);
+               break;
+         }
+      }
+   } while ((pspan = pspan->pnext) != NULL);
+}
+
 void D_DrawSpans16QbDither (espan_t *pspan) //qbism up it from 8 to 16. This + unroll = big speed gain!
 {
    int spancount;
    uint8_t *pbase;
    fixed16_t snext, tnext, sstep, tstep;
    float sdivzstepu, tdivzstepu, zistepu;
+   const int cachew = cachewidth;
 
    // mipmaps shouldn't be dithered
    if (pcurrentcache->mipscale < 1.0f)
@@ -622,6 +786,7 @@ D_DrawSpans8(espan_t *pspan)
    fixed16_t tstep = 0;			// ditto
 
    unsigned char *pbase = (unsigned char *)cacheblock;
+   const int cachew     = cachewidth;
    float sdivz8stepu    = d_sdivzstepu * 8;
    float tdivz8stepu    = d_tdivzstepu * 8;
    float zi8stepu       = d_zistepu * 8;
@@ -724,7 +889,7 @@ D_DrawSpans8(espan_t *pspan)
 
          do
          {
-            *pdest++ = *(pbase + (s >> 16) + (t >> 16) * cachewidth);
+            *pdest++ = *(pbase + (s >> 16) + (t >> 16) * cachew);
             s += sstep;
             t += tstep;
          } while (--spancount > 0);
@@ -749,6 +914,7 @@ void D_DrawSpans16 (espan_t *pspan) //qbism up it from 8 to 16.  This + unroll =
    fixed16_t tstep = 0;   // ditto
 
    uint8_t *pbase = (uint8_t*)cacheblock;
+   const int cachew = cachewidth;
 
    float sdivzstepu = d_sdivzstepu * 16;
    float tdivzstepu = d_tdivzstepu * 16;
@@ -853,7 +1019,7 @@ void D_DrawSpans16 (espan_t *pspan) //qbism up it from 8 to 16.  This + unroll =
          }
 
          do {
-            *pdest++ = *(pbase + (s >> 16) + (t >> 16) * cachewidth);
+            *pdest++ = *(pbase + (s >> 16) + (t >> 16) * cachew);
             s += sstep;
             t += tstep;
          } while (--spancount > 0);
@@ -26,7 +26,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define SKY_SPAN_SHIFT	5
 #define SKY_SPAN_MAX	(1 << SKY_SPAN_SHIFT)
 
-static float   timespeed1, timespeed2; // Manoel Kasimier - smooth sky
+static THREAD_LOCAL float timespeed1, timespeed2; // Manoel Kasimier - smooth sky
 
 byte *skyunderlay;
 byte *skyoverlay;
@@ -41,6 +41,7 @@ D_SpriteDrawSpans(sspan_t * pspan)
    int count, spancount;
    int izi;
    byte *pdest;
+   unsigned *pcolor;
    fixed16_t s, t, snext, tnext;
    float sdivz, tdivz, zi, z, du, dv, spancountminus1;
    byte btemp;
@@ -61,6 +62,7 @@ D_SpriteDrawSpans(sspan_t * pspan)
    do {
       pdest = (byte *)d_viewbuffer + (screenwidth * pspan->v) + pspan->u;
       pz = d_pzbuffer + (d_zwidth * pspan->v) + pspan->u;
+      pcolor = d_colorview ? d_colorview + (pdest - d_viewbuffer) : NULL;
 
       count = pspan->count;
 
@@ -160,11 +162,15 @@ D_SpriteDrawSpans(sspan_t * pspan)
                   if (*pz <= (izi >> 16)) {
                      *pz = izi >> 16;
                      *pdest = btemp;
+                     if (pcolor)
+                        *pcolor = 0;
                   }
                }
 
                izi += izistep;
                pdest++;
+               if (pcolor)
+                  pcolor++;
                pz++;
                s += sstep;
                t += tstep;
@@ -19,11 +19,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // d_surf.c: rasterization driver surface heap manager
 
+#include "cmd.h"
 #include "console.h"
 #include "d_local.h"
 #include "quakedef.h"
 #include "r_local.h"
 #include "sys.h"
+#include "tasks.h"
 
 #ifdef NQ_HACK
 #include "host.h"
@@ -31,12 +33,67 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 float surfscale;
 qboolean r_cache_thrash;	// set if surface cache is thrashing
+int r_cache_evictions;		// blocks thrown out this frame
+int r_cache_bytesbuilt;		// texels drawn into the cache this frame
 
 int sc_size;
 surfcache_t *sc_rover, *sc_base;
 
 #define GUARDSIZE       4
 
+/*
+ * Why D_CacheSurface had to (re)build a block
+ */
+typedef enum {
+   SC_BUILD_NEW,	// never cached, or evicted by the rover
+   SC_BUILD_LIGHTSTYLE,	// a light style changed value
+   SC_BUILD_DLIGHT,	// lit by dynamic lights now or last time
+   SC_BUILD_ANIMATION,	// the texture animated
+   SC_NUM_BUILDS
+} sc_build_t;
+
+static const char *sc_buildnames[SC_NUM_BUILDS] = {
+   "new", "lightstyle", "dlight", "animation"
+};
+
+typedef struct {
+   int builds[SC_NUM_BUILDS];
+   int bytesalloced;		// handed out by D_SCAlloc, headers included
+   int bytesused;		// in the blocks drawn from
+   int wraps;			// times the rover went back to the start
+   int evictions;
+   int styleskips;		// kept though lit by an animating light style
+} sc_framestats_t;
+
+typedef struct {
+   int frames;
+   int thrashframes;
+   int builds[SC_NUM_BUILDS];
+   long long bytesalloced;
+   int wraps;
+   int evictions;
+   int styleskips;
+   int peak_alloced;		// most bytes allocated in a frame
+   int peak_used;		// largest working set of a frame
+   int resizes;
+} sc_stats_t;
+
+/* frames since D_AdaptCacheSize last settled on a size */
+typedef struct {
+   int frames;
+   int thrashframes;
+   int peak_used;
+} sc_window_t;
+
+static sc_framestats_t sc_frame;
+static sc_stats_t sc_stats;
+static sc_window_t sc_window;
+
+/* the adaptive cache grows quickly but only shrinks after a while */
+#define SC_GROW_THRASHFRAMES	2
+#define SC_SHRINK_FRAMES	300
+#define SC_GRANULARITY		0x10000
+
 int D_SurfaceCacheForRes(int width, int height)
 {
    int size, pix;
@@ -97,10 +154,119 @@ D_InitCaches(void *buffer, int size)
     sc_base->next = NULL;
     sc_base->owner = NULL;
     sc_base->size = sc_size;
+    sc_base->bandmark = 0;
+
+    memset(&sc_window, 0, sizeof(sc_window));
 
     D_ClearCacheGuard();
 }
 
+/*
+================
+D_EndCacheFrame
+
+Fold the surface cache counters of the frame just drawn into the totals
+================
+*/
+void D_EndCacheFrame(void)
+{
+   int i;
+
+   sc_stats.frames++;
+   if (r_cache_thrash)
+      sc_stats.thrashframes++;
+   for (i = 0; i < SC_NUM_BUILDS; i++)
+      sc_stats.builds[i] += sc_frame.builds[i];
+   sc_stats.bytesalloced += sc_frame.bytesalloced;
+   sc_stats.wraps += sc_frame.wraps;
+   sc_stats.evictions += sc_frame.evictions;
+   sc_stats.styleskips += sc_frame.styleskips;
+   sc_stats.peak_alloced = qmax(sc_stats.peak_alloced, sc_frame.bytesalloced);
+   sc_stats.peak_used = qmax(sc_stats.peak_used, sc_frame.bytesused);
+
+   sc_window.frames++;
+   if (r_cache_thrash)
+      sc_window.thrashframes++;
+   sc_window.peak_used = qmax(sc_window.peak_used, sc_frame.bytesused);
+
+   memset(&sc_frame, 0, sizeof(sc_frame));
+}
+
+/*
+================
+D_AdaptCacheSize
+
+Returns the size the surface cache should have, between minsize and
+maxsize, going by the frames drawn since the size last changed. Thrashing
+doubles it (or more, to twice the working set); a cache left mostly idle
+for SC_SHRINK_FRAMES is shrunk to twice its working set. The caller
+reallocates it when the answer differs from the current size.
+================
+*/
+int D_AdaptCacheSize(int minsize, int maxsize)
+{
+   const int cursize = sc_size + GUARDSIZE;
+   int size = cursize;
+
+   minsize = qmin(minsize, maxsize);
+
+   if (sc_window.thrashframes >= SC_GROW_THRASHFRAMES && cursize < maxsize)
+      size = qmax(cursize * 2, sc_window.peak_used * 2);
+   else if (sc_window.frames >= SC_SHRINK_FRAMES)
+   {
+      if (!sc_window.thrashframes && sc_window.peak_used * 4 < cursize)
+         size = sc_window.peak_used * 2;
+      memset(&sc_window, 0, sizeof(sc_window));
+   }
+
+   size = (size + SC_GRANULARITY - 1) & ~(SC_GRANULARITY - 1);
+   size = qmax(minsize, qmin(size, maxsize));
+   if (size != cursize)
+      sc_stats.resizes++;
+
+   return size;
+}
+
+/*
+================
+D_SurfaceCacheStats_f
+================
+*/
+static void D_SurfaceCacheStats_f(void)
+{
+   int i;
+
+   if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset"))
+   {
+      memset(&sc_stats, 0, sizeof(sc_stats));
+      return;
+   }
+
+   Con_Printf("surface cache: %ik, %i resizes\n",
+         (sc_size + GUARDSIZE) / 1024, sc_stats.resizes);
+   Con_Printf("frames: %i, %i thrashing\n",
+         sc_stats.frames, sc_stats.thrashframes);
+   Con_Printf("builds:");
+   for (i = 0; i < SC_NUM_BUILDS; i++)
+      Con_Printf(" %i %s", sc_stats.builds[i], sc_buildnames[i]);
+   Con_Printf("\n");
+   Con_Printf("allocated: %lldk, %ik per frame, %ik peak\n",
+         sc_stats.bytesalloced / 1024,
+         sc_stats.frames
+            ? (int)(sc_stats.bytesalloced / sc_stats.frames / 1024) : 0,
+         sc_stats.peak_alloced / 1024);
+   Con_Printf("working set peak: %ik\n", sc_stats.peak_used / 1024);
+   Con_Printf("rover wraps: %i, evictions: %i\n",
+         sc_stats.wraps, sc_stats.evictions);
+   Con_Printf("animating light styles: %i rebuilds, %i avoided\n",
+         sc_stats.builds[SC_BUILD_LIGHTSTYLE], sc_stats.styleskips);
+}
+
+void D_InitCacheStats(void)
+{
+   Cmd_AddCommand("surfcachestats", D_SurfaceCacheStats_f);
+}
+
 
 /*
 ==================
@@ -125,6 +291,7 @@ D_FlushCaches(void)
    sc_base->next = NULL;
    sc_base->owner = NULL;
    sc_base->size = sc_size;
+   sc_base->bandmark = 0;
 }
 
 /*
@@ -141,13 +308,36 @@ D_SCAlloc(int width, int size)
    if ((width < 0) || (width > 256))
       Sys_Error("%s: bad cache width %d", __func__, width);
 
-   if ((size <= 0) || (size > 0x10000))
+   if ((size <= 0) || (size > (r_truecolor ? 0x40000 : 0x10000)))
       Sys_Error("%s: bad cache size %d", __func__, size);
 
    size = (unsigned long)&((surfcache_t *)0)->data[size];
    size = (size + 3) & ~3;
    if (size > sc_size)
       Sys_Error("%s: %i > cache size", __func__, size);
+   sc_frame.bytesalloced += size;
+
+   /*
+    * Don't hand out memory that a surface queued for banded drawing is
+    * still going to read from; draw the queue first.
+    */
+   if (d_numbandsurfs)
+   {
+      surfcache_t *c = sc_rover;
+      int freed = 0;
+
+      if (!c || (byte *)c - (byte *)sc_base > sc_size - size)
+         c = sc_base;
+      for (; c && freed < size; c = c->next)
+      {
+         if (c->owner && c->bandmark == d_bandmark)
+         {
+            D_FlushBands();
+            break;
+         }
+         freed += c->size;
+      }
+   }
 
    // if there is not size bytes after the rover, reset to the start
    wrapped_this_time = false;
@@ -155,13 +345,18 @@ D_SCAlloc(int width, int size)
    if (!sc_rover || (byte *)sc_rover - (byte *)sc_base > sc_size - size) {
       if (sc_rover) {
          wrapped_this_time = true;
+         sc_frame.wraps++;
       }
       sc_rover = sc_base;
    }
    // colect and free surfcache_t blocks until the rover block is large enough
    new_surf = sc_rover;
    if (sc_rover->owner)
+   {
       *sc_rover->owner = NULL;
+      r_cache_evictions++;
+      sc_frame.evictions++;
+   }
 
    while (new_surf->size < size) {
       // free another
@@ -169,7 +364,11 @@ D_SCAlloc(int width, int size)
       if (!sc_rover)
          Sys_Error("%s: hit the end of memory", __func__);
       if (sc_rover->owner)
+      {
          *sc_rover->owner = NULL;
+         r_cache_evictions++;
+         sc_frame.evictions++;
+      }
 
       new_surf->size += sc_rover->size;
       new_surf->next = sc_rover->next;
@@ -182,6 +381,7 @@ D_SCAlloc(int width, int size)
       sc_rover->next = new_surf->next;
       sc_rover->width = 0;
       sc_rover->owner = NULL;
+      sc_rover->bandmark = 0;
       new_surf->next = sc_rover;
       new_surf->size = size;
    } else
@@ -190,9 +390,11 @@ D_SCAlloc(int width, int size)
    new_surf->width = width;
    // DEBUG
    if (width > 0)
-      new_surf->height = (size - sizeof(*new_surf) + sizeof(new_surf->data)) / width;
+      new_surf->height = (size - sizeof(*new_surf) + sizeof(new_surf->data))
+         / (width << (r_truecolor ? 2 : 0));
 
    new_surf->owner = NULL;		// should be set properly after return
+   new_surf->bandmark = 0;
 
    if (d_roverwrapped) {
       if (wrapped_this_time || (sc_rover >= d_initial_rover))
@@ -256,6 +458,58 @@ D_log2(int num)
 
 //=============================================================================
 
+/*
+==============================================================================
+
+PARALLEL SURFACE BUILDING
+
+While the surfaces are drawn in bands (see D_FlushBands), D_CacheSurface
+only allocates and stamps the cache block and queues the build. The queued
+builds are lit and drawn into their blocks concurrently by D_BuildSurfaces
+before any band reads them. Blocks are still handed out on one thread, so
+they never overlap and the builders need no locking. A block can not be
+evicted while its build is pending, since D_SCAlloc flushes the queue first.
+==============================================================================
+*/
+
+static drawsurf_t *sc_builds;
+static int sc_numbuilds;
+static int sc_maxbuilds;
+
+static void D_QueueSurfaceBuild(const drawsurf_t *drawsurf)
+{
+   if (sc_numbuilds == sc_maxbuilds)
+   {
+      sc_maxbuilds = sc_maxbuilds ? sc_maxbuilds * 2 : 256;
+      sc_builds = realloc(sc_builds, sc_maxbuilds * sizeof(*sc_builds));
+      if (!sc_builds)
+         Sys_Error("%s: out of memory", __func__);
+   }
+   sc_builds[sc_numbuilds++] = *drawsurf;
+}
+
+static void D_BuildSurface(void *data, int index)
+{
+   r_drawsurf = sc_builds[index];
+   R_DrawSurface();
+}
+
+/*
+================
+D_BuildSurfaces
+
+Build every queued surface cache block
+================
+*/
+void D_BuildSurfaces(void)
+{
+   if (!sc_numbuilds)
+      return;
+
+   Tasks_Run(D_BuildSurface, NULL, sc_numbuilds);
+   sc_numbuilds = 0;
+}
+
 /*
 ================
 D_CacheSurface
@@ -265,61 +519,96 @@ surfcache_t *
 D_CacheSurface(const entity_t *e, msurface_t *surface, int miplevel)
 {
    surfcache_t *cache;
+   drawsurf_t drawsurf;	/* flushing the queues reuses r_drawsurf */
+   const int texelbytes = r_truecolor ? 4 : 1;
 
    /* if the surface is animating or flashing, flush the cache */
-   r_drawsurf.texture = R_TextureAnimation(e, surface->texinfo->texture);
-   r_drawsurf.lightadj[0] = d_lightstylevalue[surface->styles[0]];
-   r_drawsurf.lightadj[1] = d_lightstylevalue[surface->styles[1]];
-   r_drawsurf.lightadj[2] = d_lightstylevalue[surface->styles[2]];
-   r_drawsurf.lightadj[3] = d_lightstylevalue[surface->styles[3]];
-
-   /* see if the cache holds apropriate data */
+   drawsurf.texture = R_TextureAnimation(e, surface->texinfo->texture);
+   drawsurf.lightadj[0] = d_lightstylevalue[surface->styles[0]];
+   drawsurf.lightadj[1] = d_lightstylevalue[surface->styles[1]];
+   drawsurf.lightadj[2] = d_lightstylevalue[surface->styles[2]];
+   drawsurf.lightadj[3] = d_lightstylevalue[surface->styles[3]];
+
+   /*
+    * See if the cache holds apropriate data. Light styles animate every
+    * tenth of a second at most, and only the values of the styles this
+    * surface is lit by matter, so they are compared by value rather than
+    * rebuilding whenever a style animates.
+    */
    cache = surface->cachespots[miplevel];
 
-   if (cache && !cache->dlight && surface->dlightframe != r_framecount
-         && cache->texture == r_drawsurf.texture
-         && cache->lightadj[0] == r_drawsurf.lightadj[0]
-         && cache->lightadj[1] == r_drawsurf.lightadj[1]
-         && cache->lightadj[2] == r_drawsurf.lightadj[2]
-         && cache->lightadj[3] == r_drawsurf.lightadj[3])
+   if (!cache)
+      sc_frame.builds[SC_BUILD_NEW]++;
+   else if (cache->dlight || surface->dlightframe == r_framecount)
+      sc_frame.builds[SC_BUILD_DLIGHT]++;
+   else if (cache->texture != drawsurf.texture)
+      sc_frame.builds[SC_BUILD_ANIMATION]++;
+   else if (cache->lightadj[0] != drawsurf.lightadj[0]
+         || cache->lightadj[1] != drawsurf.lightadj[1]
+         || cache->lightadj[2] != drawsurf.lightadj[2]
+         || cache->lightadj[3] != drawsurf.lightadj[3])
+      sc_frame.builds[SC_BUILD_LIGHTSTYLE]++;
+   else
+   {
+      if (surface->stylemask & d_lightstyleanimated)
+         sc_frame.styleskips++;
+      sc_frame.bytesused += cache->size;
       return cache;
+   }
 
    /* determine shape of surface */
    surfscale = 1.0 / (1 << miplevel);
-   r_drawsurf.surfmip = miplevel;
-   r_drawsurf.surfwidth = surface->extents[0] >> miplevel;
-   r_drawsurf.rowbytes = r_drawsurf.surfwidth;
-   r_drawsurf.surfheight = surface->extents[1] >> miplevel;
+   drawsurf.surfmip = miplevel;
+   drawsurf.surfwidth = surface->extents[0] >> miplevel;
+   drawsurf.rowbytes = drawsurf.surfwidth;
+   drawsurf.surfheight = surface->extents[1] >> miplevel;
+
+   /* the block is about to be redrawn; draw anything queued from it first */
+   if (cache && d_numbandsurfs && cache->bandmark == d_bandmark)
+      D_FlushBands();
 
    /* allocate memory if needed */
    /* if a texture just animated, don't reallocate it */
    if (!cache)			
    {
-      cache = D_SCAlloc(r_drawsurf.surfwidth,
-            r_drawsurf.surfwidth * r_drawsurf.surfheight);
+      cache = D_SCAlloc(drawsurf.surfwidth,
+            drawsurf.surfwidth * drawsurf.surfheight * texelbytes);
       surface->cachespots[miplevel] = cache;
       cache->owner = &surface->cachespots[miplevel];
       cache->mipscale = surfscale;
    }
 
+   sc_frame.bytesused += cache->size;
+
    if (surface->dlightframe == r_framecount)
       cache->dlight = 1;
    else
       cache->dlight = 0;
 
-   r_drawsurf.surfdat = (pixel_t *)cache->data;
+   drawsurf.surfdat = (pixel_t *)cache->data;
 
-   cache->texture = r_drawsurf.texture;
-   cache->lightadj[0] = r_drawsurf.lightadj[0];
-   cache->lightadj[1] = r_drawsurf.lightadj[1];
-   cache->lightadj[2] = r_drawsurf.lightadj[2];
-   cache->lightadj[3] = r_drawsurf.lightadj[3];
+   cache->texture = drawsurf.texture;
+   cache->lightadj[0] = drawsurf.lightadj[0];
+   cache->lightadj[1] = drawsurf.lightadj[1];
+   cache->lightadj[2] = drawsurf.lightadj[2];
+   cache->lightadj[3] = drawsurf.lightadj[3];
 
    /* draw and light the surface texture */
-   r_drawsurf.surf = surface;
+   drawsurf.surf = surface;
 
    c_surf++;
-   R_DrawSurface();
+   r_cache_bytesbuilt += drawsurf.surfwidth * drawsurf.surfheight;
+
+   if (Tasks_NumThreads() > 1)
+   {
+      cache->bandmark = d_bandmark;
+      D_QueueSurfaceBuild(&drawsurf);
+   }
+   else
+   {
+      r_drawsurf = drawsurf;
+      R_DrawSurface();
+   }
 
    return surface->cachespots[miplevel];
 }
@@ -21,11 +21,15 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 // draw.c -- this is the only file outside the refresh that touches the
 // vid buffer
 
+#include <limits.h>
+#include <stdlib.h>
+
 #include "common.h"
 #include "console.h"
 #include "d_iface.h"
 #include "quakedef.h"
 #include "sys.h"
+#include "tasks.h"
 #include "vid.h"
 #include "view.h"
 #include "wad.h"
@@ -197,6 +201,7 @@ Draw_Character(int x, int y, int num)
     } else
 	drawline = 8;
 
+    D_DropColor(x, y, 8, drawline);
     if (r_pixbytes == 1) {
 	dest = vid.conbuffer + y * vid.conrowbytes + x;
 
@@ -284,6 +289,7 @@ Draw_Alt_String(int x, int y, char *str)
 static void
 Draw_Pixel(int x, int y, byte color)
 {
+   D_DropColor(x, y, 1, 1);
    if (r_pixbytes == 1)
    {
       uint8_t *dest = vid.conbuffer + y * vid.conrowbytes + x;
@@ -341,6 +347,7 @@ void Draw_Pic(int x, int y, const qpic_t *pic)
 
    source = pic->data;
 
+   D_DropColor(x, y, pic->width, pic->height);
    if (r_pixbytes == 1)
    {
       uint8_t *dest = vid.buffer + y * vid.rowbytes + x;
@@ -386,6 +393,7 @@ void Draw_SubPic(int x, int y, const qpic_t *pic, int srcx, int srcy, int width,
 
    source = pic->data + srcy * pic->width + srcx;
 
+   D_DropColor(x, y, width, height);
    if (r_pixbytes == 1)
    {
       uint8_t *dest = vid.buffer + y * vid.rowbytes + x;
@@ -433,6 +441,7 @@ void Draw_TransPic(int x, int y, const qpic_t *pic)
 
    source = pic->data;
 
+   D_DropColor(x, y, pic->width, pic->height);
    if (r_pixbytes == 1) {
       dest = vid.buffer + y * vid.rowbytes + x;
 
@@ -508,6 +517,7 @@ void Draw_TransPicTranslate(int x, int y, const qpic_t *pic, byte *translation)
 
    source = pic->data;
 
+   D_DropColor(x, y, pic->width, pic->height);
    if (r_pixbytes == 1) {
       dest = vid.buffer + y * vid.rowbytes + x;
 
@@ -641,6 +651,7 @@ Draw_ConsoleBackground(int lines)
     Draw_ConbackString(conback, stringify(TYR_VERSION));
 
     /* draw the pic */
+    D_DropColor(0, 0, vid.conwidth, lines);
     if (r_pixbytes == 1) {
 	dest = vid.conbuffer;
 
@@ -701,6 +712,7 @@ R_DrawRect8(vrect_t *prect, int rowbytes, const byte *psrc, int transparent)
     int i, j, srcdelta, destdelta;
     byte *pdest;
 
+    D_DropColor(prect->x, prect->y, prect->width, prect->height);
     pdest = vid.buffer + (prect->y * vid.rowbytes) + prect->x;
 
     srcdelta = rowbytes - prect->width;
@@ -875,6 +887,7 @@ Draw_Fill(int x, int y, int w, int h, int c)
 	return;
     }
 
+    D_DropColor(x, y, w, h);
     if (r_pixbytes == 1) {
 	dest = vid.buffer + y * vid.rowbytes + x;
 	for (v = 0; v < h; v++, dest += vid.rowbytes)
@@ -904,6 +917,7 @@ Draw_FadeScreen(void)
    int x, y;
    byte *pbuf;
 
+   D_DropColor(0, 0, vid.width, vid.height);
    for (y = 0; y < vid.height; y++)
    {
       int t;
@@ -1000,35 +1014,90 @@ byte BestColor (int r, int g, int b, int start, int stop)
 
 	
 
-void Draw_Generate18BPPTable (void)
-{
+/*
+ * BestColor for every cell of palmap2, made cheap by working on blocks of
+ * cells. The palette entry whose farthest point in a block is nearest
+ * bounds the best match for every cell in it, so only the entries that
+ * come at least that close to the block need to be tried. They are kept in
+ * palette order, so ties still go to the lowest index and the table comes
+ * out exactly as BestColor would fill it.
+ */
+#define PALMAP_BLOCK	8	// cells per side of a block
+#define PALMAP_BLOCKS	(64 / PALMAP_BLOCK)
 
-	int		i, j, l, c;
-	float  red, green, blue;
-	int		r, g, b;
-	int		beastcolor;
-	int	ugly;
-	
-	unsigned char*	thepaltouse;
+static void
+Draw_Generate18BPPBlock(void *data, int index)
+{
+    const byte *pal;
+    int block[3], lo[3], hi[3];
+    int candidates[255], numcandidates;
+    int i, axis, near, far, mindist, maxdist, bound;
+    int r, g, b, dr, dg, db, distortion, best, bestcolor;
+
+    block[0] = index / (PALMAP_BLOCKS * PALMAP_BLOCKS);
+    block[1] = index / PALMAP_BLOCKS % PALMAP_BLOCKS;
+    block[2] = index % PALMAP_BLOCKS;
+    for (axis = 0; axis < 3; axis++) {
+	lo[axis] = block[axis] * PALMAP_BLOCK * 4;
+	hi[axis] = lo[axis] + (PALMAP_BLOCK - 1) * 4;
+    }
 
-	ugly = 0;
+    bound = INT_MAX;
+    for (i = 0, pal = host_basepal; i < 255; i++, pal += 3) {
+	maxdist = 0;
+	for (axis = 0; axis < 3; axis++) {
+	    far = qmax(abs(pal[axis] - lo[axis]), abs(pal[axis] - hi[axis]));
+	    maxdist += far * far;
+	}
+	bound = qmin(bound, maxdist);
+    }
 
-	// Make the 18-bit lookup table here
+    numcandidates = 0;
+    for (i = 0, pal = host_basepal; i < 255; i++, pal += 3) {
+	mindist = 0;
+	for (axis = 0; axis < 3; axis++) {
+	    if (pal[axis] < lo[axis])
+		near = lo[axis] - pal[axis];
+	    else if (pal[axis] > hi[axis])
+		near = pal[axis] - hi[axis];
+	    else
+		near = 0;
+	    mindist += near * near;
+	}
+	if (mindist <= bound)
+	    candidates[numcandidates++] = i;
+    }
 
-	printf ("\nGenerating 18-bit lookup table - ");
-	for (r=0 ; r<256 ; r+=4)
-	{
-		for (g=0 ; g<256 ; g+=4)
-		{
-			for (b=0 ; b<256 ; b+=4)
-			{
-				beastcolor = BestColor (r, g, b, 0, 254);
-				palmap2[r>>2][g>>2][b>>2] = beastcolor;
-			}
+    for (r = lo[0]; r <= hi[0]; r += 4) {
+	for (g = lo[1]; g <= hi[1]; g += 4) {
+	    for (b = lo[2]; b <= hi[2]; b += 4) {
+		best = INT_MAX;
+		bestcolor = 0;
+		for (i = 0; i < numcandidates; i++) {
+		    pal = host_basepal + candidates[i] * 3;
+		    dr = r - pal[0];
+		    dg = g - pal[1];
+		    db = b - pal[2];
+		    distortion = dr * dr + dg * dg + db * db;
+		    if (distortion < best) {
+			best = distortion;
+			bestcolor = candidates[i];
+		    }
 		}
+		palmap2[r >> 2][g >> 2][b >> 2] = bestcolor;
+	    }
 	}
-	printf ("\nGenerated 18-bit lookup table - ");
+    }
+}
+
+void Draw_Generate18BPPTable (void)
+{
+    double start = Sys_DoubleTime();
 
+    Tasks_Run(Draw_Generate18BPPBlock, NULL,
+	      PALMAP_BLOCKS * PALMAP_BLOCKS * PALMAP_BLOCKS);
 
+    Con_DPrintf("Generated 18-bit lookup table in %.1f ms\n",
+		(Sys_DoubleTime() - start) * 1000);
 }
 
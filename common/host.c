@@ -31,6 +31,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "net.h"
 #include "protocol.h"
 #include "quakedef.h"
+#include "savestate.h"
 #include "sbar.h"
 #include "screen.h"
 #include "server.h"
@@ -789,6 +790,7 @@ Host_Init(quakeparms_t *parms)
     Mod_Init(R_ModelLoader());
     NET_Init();
     SV_Init();
+    SaveState_Init();
 
     Con_Printf("Exe: " __TIME__ " " __DATE__ "\n");
     Con_Printf("%4.1f megabyte heap\n", parms->memsize / (1024 * 1024.0));
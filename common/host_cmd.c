@@ -673,6 +673,9 @@ void Host_Loadgame_f(void)
    sv.num_edicts = entnum;
    sv.time = time;
 
+   /* the edicts above were marked in use without ED_Alloc */
+   ED_ResetFreeList();
+
    fclose(f);
 
    for (i = 0; i < NUM_SPAWN_PARMS; i++)
@@ -718,7 +721,8 @@ void Host_Name_f(void)
       if (strcmp(host_client->name, new_name) != 0)
          Con_Printf("%s renamed to %s\n", host_client->name, new_name);
    strcpy(host_client->name, new_name);
-   host_client->edict->v.netname = PR_SetString(host_client->name);
+   host_client->edict->v.netname = PR_SetTempString(host_client->name);
+   ED_Changed(host_client->edict);
 
    // send notification to all clients
 
@@ -1021,7 +1025,8 @@ Host_Spawn_f(void)
 	memset(&ent->v, 0, progs->entityfields * 4);
 	ent->v.colormap = NUM_FOR_EDICT(ent);
 	ent->v.team = (host_client->colors & 15) + 1;
-	ent->v.netname = PR_SetString(host_client->name);
+	ent->v.netname = PR_SetTempString(host_client->name);
+	ED_Changed(ent);
 
 	// copy spawn parms out of the client_t
 
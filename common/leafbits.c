@@ -0,0 +1,134 @@
+/*
+Copyright (C) 1996-1997 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+// leafbits.c -- word parallel operations on leaf bit sets
+
+#include "common.h"
+#include "model.h"
+#include "sys.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+typedef __m128i leafvec_t;
+#define LeafVec_Load(p)		_mm_loadu_si128((const __m128i *)(p))
+#define LeafVec_Store(p, v)	_mm_storeu_si128((__m128i *)(p), (v))
+#define LeafVec_Or(a, b)	_mm_or_si128((a), (b))
+#define HAVE_LEAFVEC
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+typedef uint8x16_t leafvec_t;
+#define LeafVec_Load(p)		vld1q_u8((const uint8_t *)(p))
+#define LeafVec_Store(p, v)	vst1q_u8((uint8_t *)(p), (v))
+#define LeafVec_Or(a, b)	vorrq_u8((a), (b))
+#define HAVE_LEAFVEC
+#endif
+
+#ifdef HAVE_LEAFVEC
+#define LEAFVEC_BLOCKS ((int)(sizeof(leafvec_t) / sizeof(leafblock_t)))
+#endif
+
+static INLINE int
+Mod_LeafBlocks(const leafbits_t *leafbits)
+{
+    return (leafbits->numleafs + LEAFMASK) >> LEAFSHIFT;
+}
+
+static INLINE int
+Mod_PopCount(leafblock_t block)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountl(block);
+#else
+    int count = 0;
+
+    while (block) {
+	count++;
+	block &= (block - 1); /* remove least significant bit */
+    }
+
+    return count;
+#endif
+}
+
+void
+Mod_AddLeafBits(leafbits_t *dst, const leafbits_t *src)
+{
+    int i, leafblocks;
+    const leafblock_t *srcblock;
+    leafblock_t *dstblock;
+
+    if (src->numleafs != dst->numleafs)
+	Sys_Error("%s: src->numleafs (%d) != dst->numleafs (%d)",
+		  __func__, src->numleafs, dst->numleafs);
+
+    srcblock = src->bits;
+    dstblock = dst->bits;
+    leafblocks = Mod_LeafBlocks(src);
+    i = 0;
+#ifdef HAVE_LEAFVEC
+    for (; i + LEAFVEC_BLOCKS <= leafblocks; i += LEAFVEC_BLOCKS) {
+	leafvec_t v = LeafVec_Or(LeafVec_Load(dstblock + i),
+				 LeafVec_Load(srcblock + i));
+	LeafVec_Store(dstblock + i, v);
+    }
+#endif
+    for (; i < leafblocks; i++)
+	dstblock[i] |= srcblock[i];
+}
+
+int
+Mod_CountLeafBits(const leafbits_t *leafbits)
+{
+    int i, leafblocks, count;
+
+    count = 0;
+    leafblocks = Mod_LeafBlocks(leafbits);
+    for (i = 0; i < leafblocks; i++)
+	count += Mod_PopCount(leafbits->bits[i]);
+
+    return count;
+}
+
+/*
+ * The leafs of one entity are scattered over the set, so rather than
+ * vectors this gathers four bits at a time and only branches once per
+ * group.
+ */
+qboolean
+Mod_TestLeafBits(const leafbits_t *leafbits, const int *leafnums, int count)
+{
+    const leafblock_t *bits = leafbits->bits;
+    leafblock_t hit = 0;
+    int i;
+
+#define LEAFBIT(n) (bits[(n) >> LEAFSHIFT] >> ((n) & LEAFMASK))
+
+    for (i = 0; i + 4 <= count; i += 4) {
+	hit = LEAFBIT(leafnums[i]) | LEAFBIT(leafnums[i + 1]) |
+	      LEAFBIT(leafnums[i + 2]) | LEAFBIT(leafnums[i + 3]);
+	if (hit & 1)
+	    return true;
+    }
+    for (; i < count; i++)
+	hit |= LEAFBIT(leafnums[i]);
+
+#undef LEAFBIT
+
+    return hit & 1;
+}
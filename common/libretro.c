@@ -43,8 +43,10 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "cmd.h"
 #include "common.h"
+#include "console.h"
 #include "quakedef.h"
 #include "d_local.h"
+#include "savestate.h"
 #include "sys.h"
 
 #include "qtypes.h"
@@ -52,6 +54,14 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "bgmusic.h"
 #include "keys.h"
 #include "cdaudio_driver.h"
+#include "tasks.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+#define HAVE_CONVERT_AVX2
+#include <immintrin.h>
+#endif
+#endif
 
 #ifdef NQ_HACK
 #include "client.h"
@@ -70,6 +80,10 @@ qboolean isDedicated;
 
 #define SURFCACHE_SIZE 10485760
 
+/* the surface cache size core options, in bytes of 8-bit texels */
+static int surfcache_maxsize = SURFCACHE_SIZE;
+static bool surfcache_adaptive = false;
+
 #define RETRO_DEVICE_MODERN  RETRO_DEVICE_SUBCLASS(RETRO_DEVICE_ANALOG, 2)
 #define RETRO_DEVICE_JOYPAD_ALT  RETRO_DEVICE_SUBCLASS(RETRO_DEVICE_JOYPAD, 1)
 
@@ -485,6 +499,7 @@ void retro_init(void)
 void retro_deinit(void)
 {
    Sys_Quit();
+   Tasks_Shutdown();
    if (heap)
       free(heap);
 
@@ -809,15 +824,29 @@ static void update_variables(bool startup)
    var.key = "tyrquake_colored_lighting";
    var.value = NULL;
 
-   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && startup)
+   if (startup)
    {
-      if (!strcmp(var.value, "enabled"))
+      if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var)
+            && !strcmp(var.value, "enabled"))
          coloredlights = 1;
       else
          coloredlights = 0;
+
+      /* true color needs the colored lightmaps and an XRGB8888 frontend */
+      r_truecolor = 0;
+      var.key = "tyrquake_true_color";
+      var.value = NULL;
+      if (coloredlights && environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var)
+            && !strcmp(var.value, "enabled"))
+      {
+         enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+
+         if (environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+            r_truecolor = 1;
+         else if (log_cb)
+            log_cb(RETRO_LOG_WARN, "XRGB8888 is not supported, true color disabled.\n");
+      }
    }
-   else
-      coloredlights = 0;
    
    var.key = "tyrquake_resolution";
    var.value = NULL;
@@ -841,6 +870,28 @@ static void update_variables(bool startup)
       initial_resolution_set = true;
    }
 
+   var.key = "tyrquake_threads";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      Tasks_SetThreads(atoi(var.value));
+
+   var.key = "tyrquake_surfcache_size";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      surfcache_maxsize = atoi(var.value) * 1024 * 1024;
+   else
+      surfcache_maxsize = SURFCACHE_SIZE;
+
+   var.key = "tyrquake_surfcache_adaptive";
+   var.value = NULL;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value)
+      surfcache_adaptive = !strcmp(var.value, "enabled");
+   else
+      surfcache_adaptive = false;
+
    var.key = "tyrquake_rumble";
    var.value = NULL;
 
@@ -896,11 +947,12 @@ static void update_env_variables(void)
 
 byte *vid_buffer;
 short *zbuffer;
-short *finalimage;
+short *finalimage;	/* RGB565, or XRGB8888 with r_truecolor */
 byte* surfcache;
 
 static void audio_process(void);
 static void audio_callback(void);
+static void VID_UpdateSurfaceCache(void);
 
 static bool did_flip;
 
@@ -922,6 +974,7 @@ void retro_run(void)
    }
 
    Host_Frame(1.0 / framerate);
+   VID_UpdateSurfaceCache();
 
    if (rumble_touch_counter > -1)
    {
@@ -935,7 +988,7 @@ void retro_run(void)
       return;
 
    if (!did_flip)
-      video_cb(NULL, width, height, width << 1); /* dupe */
+      video_cb(NULL, width, height, width << (r_truecolor ? 2 : 1)); /* dupe */
    audio_process();
    audio_callback();
 }
@@ -1173,17 +1226,17 @@ bool retro_load_game_special(unsigned type, const struct retro_game_info *info,
 
 size_t retro_serialize_size(void)
 {
-   return 0;
+   return SaveState_Size();
 }
 
 bool retro_serialize(void *data_, size_t size)
 {
-   return false;
+   return SaveState_Save(data_, size);
 }
 
 bool retro_unserialize(const void *data_, size_t size)
 {
-   return false;
+   return SaveState_Load(data_, size);
 }
 
 void *retro_get_memory_data(unsigned id)
@@ -1219,14 +1272,39 @@ unsigned short d_8to16table[256];
 #define MAKECOLOR(r, g, b) (((r & 0xf8) << 8) | ((g & 0xfc) << 3) | ((b & 0xf8) >> 3))
 
 
+/*
+ * VID_Update only expands the parts of the 8-bit frame named by its rects;
+ * the rest of finalimage is left over from earlier frames. A new palette
+ * or buffer invalidates all of it.
+ */
+static qboolean vid_fullupdate = true;
+
+/* d_8to16table widened for the gather in VID_ConvertRow_AVX2 */
+static uint32_t d_8to16table32[256];
+
+/* the palette as XRGB8888, and the shifts for true color texels */
+static uint32_t d_8to32table[256];
+static byte vid_colorramps[3][256];
+
 void VID_SetPalette(unsigned char *palette)
 {
    unsigned i, j;
    unsigned short *pal = &d_8to16table[0];
 
    for(i = 0, j = 0; i < 256; i++, j += 3)
-      *pal++ = MAKECOLOR(palette[j], palette[j+1], palette[j+2]);
+   {
+      *pal = MAKECOLOR(palette[j], palette[j+1], palette[j+2]);
+      d_8to16table32[i] = *pal++;
+      d_8to32table[i] = (palette[j] << 16) | (palette[j+1] << 8) | palette[j+2];
+   }
+
+   vid_fullupdate = true;
+}
 
+void VID_SetColorRamps(byte colorramps[3][256])
+{
+   memcpy(vid_colorramps, colorramps, sizeof(vid_colorramps));
+   vid_fullupdate = true;
 }
 
 unsigned 	d_8to24table[256];
@@ -1266,12 +1344,227 @@ void VID_ShiftPalette(unsigned char *palette)
    VID_SetPalette(palette);
 }
 
+/*
+ * Palette to RGB565 conversion kernels
+ */
+typedef void (*convertrow_t)(const byte *src, uint16_t *dst, int count);
+
+static void VID_ConvertRow_C(const byte *src, uint16_t *dst, int count)
+{
+   const unsigned short *pal = d_8to16table;
+
+   for (; count >= 4; count -= 4, src += 4, dst += 4)
+   {
+      dst[0] = pal[src[0]];
+      dst[1] = pal[src[1]];
+      dst[2] = pal[src[2]];
+      dst[3] = pal[src[3]];
+   }
+   while (count--)
+      *dst++ = pal[*src++];
+}
+
+#ifdef HAVE_CONVERT_AVX2
+__attribute__((target("avx2")))
+static void VID_ConvertRow_AVX2(const byte *src, uint16_t *dst, int count)
+{
+   const int *pal = (const int *)d_8to16table32;
+
+   for (; count >= 16; count -= 16, src += 16, dst += 16)
+   {
+      __m256i lo = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)src));
+      __m256i hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + 8)));
+
+      lo = _mm256_i32gather_epi32(pal, lo, 4);
+      hi = _mm256_i32gather_epi32(pal, hi, 4);
+
+      /* packus works per 128-bit lane; put the quadwords back in order */
+      lo = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+      _mm256_storeu_si256((__m256i *)dst, lo);
+   }
+   VID_ConvertRow_C(src, dst, count);
+}
+#endif
+
+static convertrow_t VID_ConvertRow = VID_ConvertRow_C;
+
+/*
+ * True color: output the shifted color of the pixels the color view still
+ * owns (see D_COLOR_OWNED); anything drawn over them since, or a frame
+ * drawn without it, gets the palette color.
+ */
+static void VID_ConvertRow32(const byte *src, const uint32_t *colors,
+      uint32_t *dst, int count)
+{
+   int i;
+
+   if (!colors)
+   {
+      for (i = 0; i < count; i++)
+         dst[i] = d_8to32table[src[i]];
+      return;
+   }
+
+   for (i = 0; i < count; i++)
+   {
+      const uint32_t c = colors[i];
+
+      if (c & D_COLOR_OWNED)
+         dst[i] = (vid_colorramps[0][(c >> 16) & 0xff] << 16)
+            | (vid_colorramps[1][(c >> 8) & 0xff] << 8)
+            | vid_colorramps[2][c & 0xff];
+      else
+         dst[i] = d_8to32table[src[i]];
+   }
+}
+
+static void VID_SelectConvertRow(void)
+{
+   VID_ConvertRow = VID_ConvertRow_C;
+#ifdef HAVE_CONVERT_AVX2
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx2"))
+      VID_ConvertRow = VID_ConvertRow_AVX2;
+#endif
+}
+
+/*
+================
+VID_ConvertBench_f
+
+Time each conversion kernel over a full frame at every resolution offered
+by the tyrquake_resolution core option
+================
+*/
+static double VID_ConvertBench(convertrow_t convert, const byte *src,
+      uint16_t *dst, int w, int h)
+{
+   int i, y, frames;
+   double start;
+
+   /* at least ~32M pixels so the small modes still time reliably */
+   frames = (32 << 20) / (w * h) + 1;
+
+   start = Sys_DoubleTime();
+   for (i = 0; i < frames; i++)
+      for (y = 0; y < h; y++)
+         convert(src + y * w, dst + y * w, w);
+
+   return (Sys_DoubleTime() - start) * 1e9 / ((double)frames * w * h);
+}
+
+static void VID_ConvertBench_f(void)
+{
+   const struct retro_core_option_definition *def;
+   const struct retro_core_option_value *val;
+   unsigned seed = 1;
+   byte *src;
+   uint16_t *dst;
+   int i, w, h;
+
+   for (def = option_defs_us; def->key; def++)
+      if (!strcmp(def->key, "tyrquake_resolution"))
+         break;
+   if (!def->key)
+      return;
+
+   Con_Printf("resolution    C ns/px");
+#ifdef HAVE_CONVERT_AVX2
+   if (__builtin_cpu_supports("avx2"))
+      Con_Printf("  AVX2 ns/px");
+#endif
+   Con_Printf("\n");
+
+   for (val = def->values; val->value; val++)
+   {
+      if (sscanf(val->value, "%dx%d", &w, &h) != 2)
+         continue;
+
+      src = malloc(w * h);
+      dst = malloc(w * h * sizeof(*dst));
+      if (!src || !dst)
+      {
+         free(src);
+         free(dst);
+         Con_Printf("%s: out of memory\n", __func__);
+         return;
+      }
+      for (i = 0; i < w * h; i++)
+      {
+         seed = seed * 1103515245 + 12345;
+         src[i] = seed >> 16;
+      }
+
+      Con_Printf("%-12s  %7.3f", val->value,
+            VID_ConvertBench(VID_ConvertRow_C, src, dst, w, h));
+#ifdef HAVE_CONVERT_AVX2
+      if (__builtin_cpu_supports("avx2"))
+         Con_Printf("  %10.3f",
+               VID_ConvertBench(VID_ConvertRow_AVX2, src, dst, w, h));
+#endif
+      Con_Printf("\n");
+
+      free(src);
+      free(dst);
+   }
+}
+
+/*
+ * The surface cache is reallocated between frames when the size options
+ * change, or when the adaptive cache asks for a new size. Sizes are in
+ * bytes, four per texel with true color.
+ */
+static int surfcache_size;
+
+static void VID_SurfaceCacheLimits(int *minsize, int *maxsize)
+{
+   const int texelbytes = r_truecolor ? 4 : 1;
+
+   *maxsize = surfcache_maxsize * texelbytes;
+   *minsize = qmin(D_SurfaceCacheForRes(width, height) * texelbytes, *maxsize);
+}
+
+static void VID_AllocSurfaceCache(int size)
+{
+   if (surfcache)
+   {
+      D_FlushCaches();
+      free(surfcache);
+   }
+
+   surfcache = malloc(size);
+   if (!surfcache)
+      Sys_Error("%s: couldn't allocate %i bytes", __func__, size);
+   surfcache_size = size;
+   D_InitCaches(surfcache, size);
+}
+
+static void VID_UpdateSurfaceCache(void)
+{
+   int minsize, maxsize, size;
+
+   if (!surfcache)
+      return;
+
+   VID_SurfaceCacheLimits(&minsize, &maxsize);
+   if (surfcache_adaptive)
+      size = D_AdaptCacheSize(minsize, maxsize);
+   else
+      size = maxsize;
+
+   if (size != surfcache_size)
+      VID_AllocSurfaceCache(size);
+}
+
 void VID_Init(unsigned char *palette)
 {
+   int i, minsize, maxsize;
+
    /* TODO */
    vid_buffer = (byte*)malloc(width * height * sizeof(byte));
    zbuffer = (short*)malloc(width * height * sizeof(short));
-   finalimage = (short*)malloc(width * height * sizeof(short));
+   finalimage = (short*)malloc(width * height
+         * (r_truecolor ? sizeof(uint32_t) : sizeof(short)));
 
     vid.width = width;
     vid.height = height;
@@ -1288,8 +1581,19 @@ void VID_Init(unsigned char *palette)
     vid.aspect = ((float)vid.height / (float)vid.width) * (320.0 / 240.0);
 
     d_pzbuffer = zbuffer;
-    surfcache = malloc(SURFCACHE_SIZE);
-    D_InitCaches(surfcache, SURFCACHE_SIZE);
+    vid.colorbuffer = NULL;
+    if (r_truecolor)
+    {
+       vid.colorbuffer = (unsigned*)calloc(width * height, sizeof(unsigned));
+       for (i = 0; i < 256; i++)
+          vid_colorramps[0][i] = vid_colorramps[1][i] = vid_colorramps[2][i] = i;
+    }
+    VID_SurfaceCacheLimits(&minsize, &maxsize);
+    VID_AllocSurfaceCache(surfcache_adaptive ? minsize : maxsize);
+
+    VID_SelectConvertRow();
+    vid_fullupdate = true;
+    Cmd_AddCommand("vid_convertbench", VID_ConvertBench_f);
 }
 
 void VID_Shutdown(void)
@@ -1302,32 +1606,80 @@ void VID_Shutdown(void)
       free(finalimage);
    if (surfcache)
       free(surfcache);
+   if (vid.colorbuffer)
+      free(vid.colorbuffer);
    vid_buffer = NULL;
    zbuffer    = NULL;
    finalimage = NULL;
    surfcache  = NULL;
+   surfcache_size = 0;
+   vid.colorbuffer = NULL;
+   d_colorview = NULL;
 }
 
 void VID_Update(vrect_t *rects)
 {
-   unsigned x, y;
+   int y;
    unsigned pitch              = width;
-   uint8_t *ilineptr           = (uint8_t*)vid.buffer;
-   uint16_t *olineptr          = (uint16_t*)finalimage;
-   uint16_t *pal               = (uint16_t*)&d_8to16table;
-   uint16_t *ptr               = (uint16_t*)finalimage;
+   const byte *ilineptr;
+   uint16_t *olineptr;
+   const uint32_t *clineptr;
+   uint32_t *olineptr32;
+   vrect_t full;
+   /* set until a warped frame draws its view in 8 bits only */
+   const uint32_t *colors = d_colorview;
 
    if (!video_cb || !rects || did_flip)
       return;
 
-   for (y = 0; y < rects->height; ++y)
+   if (vid_fullupdate)
+   {
+      full.x      = 0;
+      full.y      = 0;
+      full.width  = vid.width;
+      full.height = vid.height;
+      full.pnext  = NULL;
+      rects       = &full;
+      vid_fullupdate = false;
+   }
+
+   if (r_truecolor)
+   {
+      for (; rects; rects = rects->pnext)
+      {
+         ilineptr   = vid.buffer + rects->y * vid.rowbytes + rects->x;
+         clineptr   = colors ? colors + rects->y * vid.rowbytes + rects->x : NULL;
+         olineptr32 = (uint32_t*)finalimage + rects->y * pitch + rects->x;
+
+         for (y = 0; y < rects->height; ++y)
+         {
+            VID_ConvertRow32(ilineptr, clineptr, olineptr32, rects->width);
+            ilineptr   += vid.rowbytes;
+            if (clineptr)
+               clineptr += vid.rowbytes;
+            olineptr32 += pitch;
+         }
+      }
+
+      video_cb(finalimage, width, height, pitch << 2);
+      did_flip = true;
+      return;
+   }
+
+   for (; rects; rects = rects->pnext)
    {
-      for (x = 0; x < rects->width; ++x)
-         *olineptr++ = pal[*ilineptr++];
-      olineptr += pitch - rects->width;
+      ilineptr = vid.buffer + rects->y * vid.rowbytes + rects->x;
+      olineptr = (uint16_t*)finalimage + rects->y * pitch + rects->x;
+
+      for (y = 0; y < rects->height; ++y)
+      {
+         VID_ConvertRow(ilineptr, olineptr, rects->width);
+         ilineptr += vid.rowbytes;
+         olineptr += pitch;
+      }
    }
 
-   video_cb(ptr, width, height, pitch << 1);
+   video_cb(finalimage, width, height, pitch << 1);
    did_flip = true;
 }
 
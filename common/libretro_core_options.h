@@ -125,6 +125,64 @@ struct retro_core_option_definition option_defs_us[] = {
       },
       "disabled"
    },
+   {
+      "tyrquake_true_color",
+      "True color lighting (restart)",
+      "With colored lighting, keep lit world and model colors at full precision and output XRGB8888 instead of reducing them to the 256 color palette. Uses four times the surface cache memory. Requires a restart.",
+      {
+         { "disabled",              "Disabled"},
+         { "enabled",               "Enabled"},
+         { NULL, NULL },
+      },
+      "disabled"
+   },
+   {
+      "tyrquake_threads",
+      "Worker threads",
+      "Number of threads shared by the parallel parts of the core: drawing the screen in horizontal bands, building lit surfaces, loading map lumps, expanding the visibility data and building the color lookup tables. Map loading uses the new count from the next map. Output is identical to the single-threaded core.",
+      {
+         { "1", "Disabled" },
+         { "2", NULL },
+         { "3", NULL },
+         { "4", NULL },
+         { "6", NULL },
+         { "8", NULL },
+         { "12", NULL },
+         { "16", NULL },
+         { NULL, NULL },
+      },
+      "1"
+   },
+   {
+      "tyrquake_surfcache_size",
+      "Surface cache size",
+      "Memory for lit world textures. With the adaptive surface cache this is the most it may use. True color lighting uses four times as much.",
+      {
+         { "2",  "2MB" },
+         { "4",  "4MB" },
+         { "6",  "6MB" },
+         { "8",  "8MB" },
+         { "10", "10MB" },
+         { "16", "16MB" },
+         { "24", "24MB" },
+         { "32", "32MB" },
+         { "48", "48MB" },
+         { "64", "64MB" },
+         { NULL, NULL },
+      },
+      "10"
+   },
+   {
+      "tyrquake_surfcache_adaptive",
+      "Adaptive surface cache",
+      "Start the surface cache at the minimum for the resolution, grow it while it thrashes and shrink it when mostly unused, up to the surface cache size.",
+      {
+         { "disabled", "Disabled" },
+         { "enabled",  "Enabled" },
+         { NULL, NULL },
+      },
+      "disabled"
+   },
    {
       "tyrquake_rumble",
       "Rumble",
@@ -28,7 +28,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "cmd.h"
 #include "common.h"
 #include "console.h"
+#include "cvar.h"
 #include "model.h"
+#include "tasks.h"
 
 #ifdef SERVERONLY
 #include "qwsvdef.h"
@@ -58,6 +60,7 @@ static int mod_numknown;
 static const model_loader_t *mod_loader;
 
 static void PVSCache_f(void);
+static cvar_t mod_pvscache = { "mod_pvscache", "16", true };
 
 // leilei HACK
 
@@ -73,6 +76,7 @@ void
 Mod_Init(const model_loader_t *loader)
 {
     Cmd_AddCommand("pvscache", PVSCache_f);
+    Cvar_RegisterVariable(&mod_pvscache);
     mod_loader = loader;
 }
 
@@ -107,54 +111,33 @@ mleaf_t * Mod_PointInLeaf(const model_t *model, const vec3_t point)
    return NULL;		// never reached
 }
 
-void
-Mod_AddLeafBits(leafbits_t *dst, const leafbits_t *src)
-{
-    int i, leafblocks;
-    const leafblock_t *srcblock;
-    leafblock_t *dstblock;
-
-    if (src->numleafs != dst->numleafs)
-	SV_Error("%s: src->numleafs (%d) != dst->numleafs (%d)",
-		 __func__, src->numleafs, dst->numleafs);
-
-    srcblock = src->bits;
-    dstblock = dst->bits;
-    leafblocks = (src->numleafs + LEAFMASK) >> LEAFSHIFT;
-    for (i = 0; i < leafblocks; i++)
-	*dstblock++ |= *srcblock++;
-}
-
-#ifdef SERVERONLY
-int
-Mod_CountLeafBits(const leafbits_t *leafbits)
-{
-    int i, leafblocks, count;
-    leafblock_t block;
-
-    count = 0;
-    leafblocks = (leafbits->numleafs + LEAFMASK) >> LEAFSHIFT;
-    for (i = 0; i < leafblocks; i++) {
-	block = leafbits->bits[i];
-	while (block) {
-	    count++;
-	    block &= (block - 1); /* remove least significant bit */
-	}
-    }
-
-    return count;
-};
-#endif
-
 /*
- * Simple LRU cache for decompressed vis data
+ * Cache for decompressed vis data. When the mod_pvscache budget (in
+ * megabytes) can hold a row for every leaf of the world, every row is
+ * decompressed once at load time into a bit matrix. Otherwise rows are
+ * kept in a hashed LRU of as many slots as the budget allows, with a
+ * minimum of PVSCACHE_MINSLOTS. A budget of zero gives just the minimum.
  */
-typedef struct {
+typedef struct pvscache_s {
     const model_t *model;
     const mleaf_t *leaf;
     leafbits_t *leafbits;
+    struct pvscache_s *hashnext;
+    struct pvscache_s *prev, *next;	/* LRU order, most recent first */
 } pvscache_t;
-static pvscache_t pvscache[2];
+
+#define PVSCACHE_MINSLOTS 2
+
+static pvscache_t *pvscache;
+static int pvscache_numslots;
+static pvscache_t **pvscache_hash;
+static unsigned pvscache_hashmask;
+static pvscache_t pvscache_lru;		/* list head */
+static byte *pvscache_mem;		/* LRU rows or the matrix */
+
+static const model_t *pvsmatrix_model;
+static int pvsmatrix_rowsize;
+
 static leafbits_t *fatpvs;
 static int pvscache_numleafs;
 static int pvscache_bytes;
@@ -162,14 +145,31 @@ static int pvscache_blocks;
 
 static int c_cachehit, c_cachemiss;
 
-#define PVSCACHE_SIZE ARRAY_SIZE(pvscache)
-
 static void
+Mod_FreePVSCache(void)
+{
+    free(pvscache);
+    free(pvscache_hash);
+    free(pvscache_mem);
+    pvscache = NULL;
+    pvscache_hash = NULL;
+    pvscache_mem = NULL;
+    pvscache_numslots = 0;
+    pvsmatrix_model = NULL;
+}
+
+/*
+ * Sets up the cache for models of up to numleafs leafs. Returns true if
+ * the budget allows for a full matrix, to be filled in by
+ * Mod_BuildPVSMatrix once the model is complete.
+ */
+static qboolean
 Mod_InitPVSCache(int numleafs)
 {
-    int i;
-    int memsize;
-    byte *leafmem;
+    int i, memsize, numslots;
+    unsigned hashsize;
+    double budget;
+    qboolean matrix;
 
     pvscache_numleafs = numleafs;
     pvscache_bytes = ((numleafs + LEAFMASK) & ~LEAFMASK) >> 3;
@@ -177,10 +177,49 @@ Mod_InitPVSCache(int numleafs)
     memsize = Mod_LeafbitsSize(numleafs);
     fatpvs = (leafbits_t*)Hunk_AllocName(memsize, "fatpvs");
 
-    memset(pvscache, 0, sizeof(pvscache));
-    leafmem = (byte*)Hunk_AllocName(PVSCACHE_SIZE * memsize, "pvscache");
-    for (i = 0; i < PVSCACHE_SIZE; i++)
-	pvscache[i].leafbits = (leafbits_t *)(leafmem + i * memsize);
+    Mod_FreePVSCache();
+    budget = qmax(mod_pvscache.value, 0.0f) * 1024 * 1024;
+    matrix = budget >= (double)numleafs * memsize;
+    pvsmatrix_rowsize = memsize;
+
+    if (matrix) {
+	numslots = PVSCACHE_MINSLOTS;
+	pvscache_mem = (byte *)malloc((size_t)numleafs * memsize);
+	if (!pvscache_mem)
+	    matrix = false;
+    }
+    if (!matrix) {
+	numslots = qmax((int)(budget / memsize), PVSCACHE_MINSLOTS);
+	pvscache_mem = (byte *)malloc((size_t)numslots * memsize);
+	if (!pvscache_mem) {
+	    numslots = PVSCACHE_MINSLOTS;
+	    pvscache_mem = (byte *)malloc((size_t)numslots * memsize);
+	}
+    }
+
+    /* the LRU still serves other models when there is a matrix */
+    for (hashsize = 1; hashsize < (unsigned)numslots; hashsize <<= 1)
+	;
+    pvscache = (pvscache_t *)calloc(numslots, sizeof(*pvscache));
+    pvscache_hash = (pvscache_t **)calloc(hashsize, sizeof(*pvscache_hash));
+    if (!pvscache_mem || !pvscache || !pvscache_hash)
+	Sys_Error("%s: out of memory for %d leafs", __func__, numleafs);
+    pvscache_numslots = numslots;
+    pvscache_hashmask = hashsize - 1;
+
+    pvscache_lru.next = pvscache_lru.prev = &pvscache_lru;
+    for (i = 0; i < numslots; i++) {
+	if (matrix)
+	    pvscache[i].leafbits = (leafbits_t *)Hunk_AllocName(memsize, "pvscache");
+	else
+	    pvscache[i].leafbits = (leafbits_t *)(pvscache_mem + i * memsize);
+	pvscache[i].next = pvscache_lru.next;
+	pvscache[i].prev = &pvscache_lru;
+	pvscache_lru.next->prev = &pvscache[i];
+	pvscache_lru.next = &pvscache[i];
+    }
+
+    return matrix;
 }
 
 /*
@@ -234,45 +273,111 @@ Mod_DecompressVis(const byte *in, const model_t *model, leafbits_t *dest)
     } while (num_out < dest->numleafs);
 }
 
+static void
+Mod_LeafPVSBits(const model_t *model, const mleaf_t *leaf, leafbits_t *dest)
+{
+    if (leaf == model->leafs) {
+	/* return set with everything visible */
+	dest->numleafs = model->numleafs;
+	memset(dest->bits, 0xff, pvscache_bytes);
+    } else {
+	Mod_DecompressVis(leaf->compressed_vis, model, dest);
+    }
+}
+
+#define PVSMATRIX_BATCH 64
+
+static void
+Mod_BuildPVSRows(void *data, int index)
+{
+    const model_t *model = (const model_t *)data;
+    int leafnum = index * PVSMATRIX_BATCH;
+    int end = qmin(leafnum + PVSMATRIX_BATCH, pvscache_numleafs);
+    byte *row = pvscache_mem + leafnum * pvsmatrix_rowsize;
+
+    for (; leafnum < end; leafnum++, row += pvsmatrix_rowsize)
+	Mod_LeafPVSBits(model, model->leafs + leafnum, (leafbits_t *)row);
+}
+
+/*
+ * Decompress every leaf's row of the matrix set up by Mod_InitPVSCache
+ */
+static void
+Mod_BuildPVSMatrix(const model_t *model)
+{
+    int batches = (pvscache_numleafs + PVSMATRIX_BATCH - 1) / PVSMATRIX_BATCH;
+
+    Tasks_Run(Mod_BuildPVSRows, (void *)model, batches);
+    pvsmatrix_model = model;
+}
+
+static INLINE unsigned
+Mod_PVSCacheHash(const model_t *model, const mleaf_t *leaf)
+{
+    uintptr_t key = (uintptr_t)model ^ (uintptr_t)(leaf - model->leafs);
+
+    return (unsigned)(key ^ (key >> 12)) & pvscache_hashmask;
+}
+
 const leafbits_t *
 Mod_LeafPVS(const model_t *model, const mleaf_t *leaf)
 {
-    int slot;
-    pvscache_t tmp;
+    pvscache_t *entry, **link;
+
+    if (model == pvsmatrix_model) {
+	c_cachehit++;
+	return (const leafbits_t *)(pvscache_mem +
+				    (leaf - model->leafs) * pvsmatrix_rowsize);
+    }
 
-    for (slot = 0; slot < PVSCACHE_SIZE; slot++)
-	if (pvscache[slot].model == model && pvscache[slot].leaf == leaf) {
-	    c_cachehit++;
+    link = &pvscache_hash[Mod_PVSCacheHash(model, leaf)];
+    for (entry = *link; entry; entry = entry->hashnext)
+	if (entry->model == model && entry->leaf == leaf)
 	    break;
-	}
 
-    if (slot) {
-	if (slot == PVSCACHE_SIZE) {
-	    slot--;
-	    tmp.model = model;
-	    tmp.leaf = leaf;
-	    tmp.leafbits = pvscache[slot].leafbits;
-	    if (leaf == model->leafs) {
-		/* return set with everything visible */
-		tmp.leafbits->numleafs = model->numleafs;
-		memset(tmp.leafbits->bits, 0xff, pvscache_bytes);
-	    } else {
-		Mod_DecompressVis(leaf->compressed_vis, model, tmp.leafbits);
-	    }
-	    c_cachemiss++;
-	} else {
-	    tmp = pvscache[slot];
+    if (entry) {
+	c_cachehit++;
+    } else {
+	/* take over the least recently used slot */
+	entry = pvscache_lru.prev;
+	if (entry->model) {
+	    pvscache_t **prev;
+
+	    prev = &pvscache_hash[Mod_PVSCacheHash(entry->model, entry->leaf)];
+	    while (*prev != entry)
+		prev = &(*prev)->hashnext;
+	    *prev = entry->hashnext;
 	}
-	memmove(pvscache + 1, pvscache, slot * sizeof(pvscache_t));
-	pvscache[0] = tmp;
+	entry->model = model;
+	entry->leaf = leaf;
+	entry->hashnext = *link;
+	*link = entry;
+	Mod_LeafPVSBits(model, leaf, entry->leafbits);
+	c_cachemiss++;
     }
 
-    return pvscache[0].leafbits;
+    if (pvscache_lru.next != entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	entry->next = pvscache_lru.next;
+	entry->prev = &pvscache_lru;
+	pvscache_lru.next->prev = entry;
+	pvscache_lru.next = entry;
+    }
+
+    return entry->leafbits;
 }
 
 static void
 PVSCache_f(void)
 {
+    if (pvsmatrix_model)
+	Con_Printf("PVSCache: %d leafs decompressed at load (%d KB)\n",
+		   pvscache_numleafs,
+		   pvscache_numleafs * pvsmatrix_rowsize / 1024);
+    else if (pvscache)
+	Con_Printf("PVSCache: %d slot LRU (%d KB)\n", pvscache_numslots,
+		   pvscache_numslots * pvsmatrix_rowsize / 1024);
     Con_Printf("PVSCache: %7d hits %7d misses\n", c_cachehit, c_cachemiss);
 }
 
@@ -355,7 +460,7 @@ Mod_ClearAll(void)
     }
 
     fatpvs = NULL;
-    memset(pvscache, 0, sizeof(pvscache));
+    Mod_FreePVSCache();
     pvscache_numleafs = 0;
     pvscache_bytes = pvscache_blocks = 0;
     c_cachehit = c_cachemiss = 0;
@@ -408,6 +513,7 @@ Mod_LoadModel(model_t *mod, qboolean crash)
     unsigned *buf;
     byte stackbuf[1024];	// avoid dirtying the cache heap
     unsigned long size;
+    const unsigned *mapped;
 
     if (!mod->needload) {
 	if (mod->type == mod_alias) {
@@ -419,7 +525,16 @@ Mod_LoadModel(model_t *mod, qboolean crash)
 //
 // load the file
 //
-    buf = (unsigned int*)COM_LoadStackFile(mod->name, stackbuf, sizeof(stackbuf), &size);
+    buf = NULL;
+    mapped = (const unsigned *)COM_MapFile(mod->name, &size);
+    if (mapped && size >= sizeof(dheader_t)
+	    && LittleLong(*mapped) != IDPOLYHEADER
+	    && LittleLong(*mapped) != IDSPRITEHEADER) {
+	/* brush models only read their input, skip the copy */
+	buf = (unsigned *)mapped;
+    }
+    if (!buf)
+	buf = (unsigned int*)COM_LoadStackFile(mod->name, stackbuf, sizeof(stackbuf), &size);
     if (!buf) {
 	if (crash)
 	    SV_Error("%s: %s not found", __func__, mod->name);
@@ -486,6 +601,25 @@ Mod_ForName(const char *name, qboolean crash)
 
 static byte *mod_base;
 
+/*
+ * Hunk space set aside for the brush model loading stage running on this
+ * thread (see Mod_LoadBrushStages)
+ */
+static THREAD_LOCAL byte *mod_stagebuf;
+static THREAD_LOCAL int mod_stagesize;
+
+static void *
+Mod_StageAlloc(int size)
+{
+   if (!mod_stagebuf)
+      return Hunk_AllocName(size, loadname);
+   if (size > mod_stagesize)
+      Sys_Error("%s: %d bytes needed, %d reserved", __func__, size,
+            mod_stagesize);
+
+   return mod_stagebuf;
+}
+
 
 /*
 =================
@@ -718,7 +852,7 @@ Mod_LoadVisibility(lump_t *l)
 	loadmodel->visdata = NULL;
 	return;
     }
-    loadmodel->visdata = (byte*)Hunk_AllocName(l->filelen, loadname);
+    loadmodel->visdata = (byte*)Mod_StageAlloc(l->filelen);
     memcpy(loadmodel->visdata, mod_base + l->fileofs, l->filelen);
 }
 
@@ -756,7 +890,7 @@ Mod_LoadVertexes(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mvertex_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mvertex_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->vertexes = out;
    loadmodel->numvertexes = count;
@@ -847,7 +981,7 @@ Mod_LoadEdges_BSP29(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (medge_t*)Hunk_AllocName((count + 1) * sizeof(*out), loadname);
+   out = (medge_t*)Mod_StageAlloc((count + 1) * sizeof(*out));
 
    loadmodel->edges = out;
    loadmodel->numedges = count;
@@ -875,7 +1009,7 @@ Mod_LoadEdges_BSP2(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (medge_t*)Hunk_AllocName((count + 1) * sizeof(*out), loadname);
+   out = (medge_t*)Mod_StageAlloc((count + 1) * sizeof(*out));
 
    loadmodel->edges = out;
    loadmodel->numedges = count;
@@ -908,7 +1042,7 @@ static void Mod_LoadTexinfo(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mtexinfo_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mtexinfo_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->texinfo = out;
    loadmodel->numtexinfo = count;
@@ -1064,6 +1198,23 @@ CalcSurfaceBounds(msurface_t *surf)
     }
 }
 
+/*
+ * The animatable light styles a surface's lightmaps are scaled by; the
+ * surface cache only needs to look at those (see D_CacheSurface)
+ */
+static uint64_t
+Mod_SurfaceStyleMask(const byte *styles)
+{
+    uint64_t mask = 0;
+    int i;
+
+    for (i = 0; i < MAXLIGHTMAPS; i++)
+	if (styles[i] < MAX_LIGHTSTYLES)
+	    mask |= (uint64_t)1 << styles[i];
+
+    return mask;
+}
+
 /*
 =================
 Mod_LoadFaces
@@ -1082,7 +1233,7 @@ Mod_LoadFaces_BSP29(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (msurface_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (msurface_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->surfaces = out;
    loadmodel->numsurfaces = count;
@@ -1127,6 +1278,7 @@ Mod_LoadFaces_BSP29(lump_t *l)
 
       for (i = 0; i < MAXLIGHTMAPS; i++)
          out->styles[i] = in->styles[i];
+      out->stylemask = Mod_SurfaceStyleMask(out->styles);
 #ifdef MSB_FIRST
       i = LittleLong(in->lightofs);
 #else
@@ -1170,7 +1322,7 @@ static void Mod_LoadFaces_BSP2(lump_t *l)
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
 
    count = l->filelen / sizeof(*in);
-   out = (msurface_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (msurface_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->surfaces = out;
    loadmodel->numsurfaces = count;
@@ -1210,6 +1362,7 @@ static void Mod_LoadFaces_BSP2(lump_t *l)
 
       for (i = 0; i < MAXLIGHTMAPS; i++)
          out->styles[i] = in->styles[i];
+      out->stylemask = Mod_SurfaceStyleMask(out->styles);
 #ifdef MSB_FIRST
       i = LittleLong(in->lightofs);
 #else
@@ -1267,7 +1420,7 @@ Mod_LoadNodes_BSP29(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mnode_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mnode_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->nodes = out;
    loadmodel->numnodes = count;
@@ -1325,7 +1478,7 @@ static void Mod_LoadNodes_BSP2(lump_t *l)
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
 
    count = l->filelen / sizeof(*in);
-   out   = (mnode_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out   = (mnode_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->nodes    = out;
    loadmodel->numnodes = count;
@@ -1394,7 +1547,7 @@ Mod_LoadLeafs_BSP29(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mleaf_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mleaf_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->leafs = out;
    loadmodel->numleafs = count;
@@ -1453,7 +1606,7 @@ Mod_LoadLeafs_BSP2(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mleaf_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mleaf_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->leafs = out;
    loadmodel->numleafs = count;
@@ -1518,7 +1671,7 @@ Mod_LoadClipnodes_BSP29(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mclipnode_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mclipnode_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->clipnodes = out;
    loadmodel->numclipnodes = count;
@@ -1580,7 +1733,7 @@ Mod_LoadClipnodes_BSP2(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (mclipnode_t*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (mclipnode_t*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->clipnodes = out;
    loadmodel->numclipnodes = count;
@@ -1682,7 +1835,7 @@ Mod_LoadMarksurfaces_BSP29(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (msurface_t**)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (msurface_t**)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->marksurfaces = out;
    loadmodel->nummarksurfaces = count;
@@ -1711,7 +1864,7 @@ Mod_LoadMarksurfaces_BSP2(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (msurface_t**)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (msurface_t**)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->marksurfaces = out;
    loadmodel->nummarksurfaces = count;
@@ -1743,7 +1896,7 @@ Mod_LoadSurfedges(lump_t *l)
    if (l->filelen % sizeof(*in))
       SV_Error("%s: funny lump size in %s", __func__, loadmodel->name);
    count = l->filelen / sizeof(*in);
-   out = (int*)Hunk_AllocName(count * sizeof(*out), loadname);
+   out = (int*)Mod_StageAlloc(count * sizeof(*out));
 
    loadmodel->surfedges = out;
    loadmodel->numsurfedges = count;
@@ -1772,7 +1925,7 @@ static void Mod_LoadPlanes(lump_t *l)
 
    count = l->filelen / sizeof(*in);
    out   = (mplane_t*)
-      Hunk_AllocName(count * 2 * sizeof(*out), loadname);
+      Mod_StageAlloc(count * 2 * sizeof(*out));
 
    loadmodel->planes    = out;
    loadmodel->numplanes = count;
@@ -1818,6 +1971,144 @@ static float RadiusFromBounds(vec3_t mins, vec3_t maxs)
    return Length(corner);
 }
 
+/*
+ * The lumps that need just one hunk allocation each are loaded as a small
+ * dependency graph of stages. The hunk space for every stage is reserved
+ * up front in a fixed order, so the hunk layout is the same whichever
+ * thread runs a stage. Stages whose dependencies have completed then run
+ * together on the task pool.
+ */
+enum {
+    STAGE_VERTEXES,
+    STAGE_EDGES,
+    STAGE_SURFEDGES,
+    STAGE_PLANES,
+    STAGE_TEXINFO,
+    STAGE_VISIBILITY,
+    STAGE_FACES,
+    STAGE_MARKSURFACES,
+    STAGE_LEAFS,
+    STAGE_NODES,
+    STAGE_CLIPNODES,
+    NUM_BRUSH_STAGES
+};
+
+#define STAGE_BIT(stage) (1U << (stage))
+
+typedef struct {
+    int lump;
+    void (*load[2])(lump_t *l);	/* BSP29, BSP2 */
+    int insize[2];		/* BSP29, BSP2 element size on disk */
+    int outsize;		/* element size in memory */
+    int extra;			/* elements allocated beyond the lump count */
+    int scale;
+    unsigned depends;		/* stages which must be loaded first */
+} brushstage_t;
+
+static const brushstage_t brushstages[NUM_BRUSH_STAGES] = {
+    /* STAGE_VERTEXES */
+    { LUMP_VERTEXES, { Mod_LoadVertexes, Mod_LoadVertexes },
+      { sizeof(dvertex_t), sizeof(dvertex_t) }, sizeof(mvertex_t), 0, 1, 0 },
+    /* STAGE_EDGES */
+    { LUMP_EDGES, { Mod_LoadEdges_BSP29, Mod_LoadEdges_BSP2 },
+      { sizeof(bsp29_dedge_t), sizeof(bsp2_dedge_t) }, sizeof(medge_t), 1, 1,
+      0 },
+    /* STAGE_SURFEDGES */
+    { LUMP_SURFEDGES, { Mod_LoadSurfedges, Mod_LoadSurfedges },
+      { sizeof(int), sizeof(int) }, sizeof(int), 0, 1, 0 },
+    /* STAGE_PLANES */
+    { LUMP_PLANES, { Mod_LoadPlanes, Mod_LoadPlanes },
+      { sizeof(dplane_t), sizeof(dplane_t) }, sizeof(mplane_t), 0, 2, 0 },
+    /* STAGE_TEXINFO (textures are loaded beforehand) */
+    { LUMP_TEXINFO, { Mod_LoadTexinfo, Mod_LoadTexinfo },
+      { sizeof(texinfo_t), sizeof(texinfo_t) }, sizeof(mtexinfo_t), 0, 1, 0 },
+    /* STAGE_VISIBILITY */
+    { LUMP_VISIBILITY, { Mod_LoadVisibility, Mod_LoadVisibility },
+      { 1, 1 }, 1, 0, 1, 0 },
+    /* STAGE_FACES (lighting is loaded beforehand) */
+    { LUMP_FACES, { Mod_LoadFaces_BSP29, Mod_LoadFaces_BSP2 },
+      { sizeof(bsp29_dface_t), sizeof(bsp2_dface_t) }, sizeof(msurface_t),
+      0, 1, STAGE_BIT(STAGE_VERTEXES) | STAGE_BIT(STAGE_EDGES) |
+      STAGE_BIT(STAGE_SURFEDGES) | STAGE_BIT(STAGE_PLANES) |
+      STAGE_BIT(STAGE_TEXINFO) },
+    /* STAGE_MARKSURFACES */
+    { LUMP_MARKSURFACES,
+      { Mod_LoadMarksurfaces_BSP29, Mod_LoadMarksurfaces_BSP2 },
+      { sizeof(uint16_t), sizeof(uint32_t) }, sizeof(msurface_t *), 0, 1,
+      STAGE_BIT(STAGE_FACES) },
+    /* STAGE_LEAFS */
+    { LUMP_LEAFS, { Mod_LoadLeafs_BSP29, Mod_LoadLeafs_BSP2 },
+      { sizeof(bsp29_dleaf_t), sizeof(bsp2_dleaf_t) }, sizeof(mleaf_t), 0, 1,
+      STAGE_BIT(STAGE_MARKSURFACES) | STAGE_BIT(STAGE_VISIBILITY) },
+    /* STAGE_NODES */
+    { LUMP_NODES, { Mod_LoadNodes_BSP29, Mod_LoadNodes_BSP2 },
+      { sizeof(bsp29_dnode_t), sizeof(bsp2_dnode_t) }, sizeof(mnode_t), 0, 1,
+      STAGE_BIT(STAGE_PLANES) | STAGE_BIT(STAGE_LEAFS) },
+    /* STAGE_CLIPNODES */
+    { LUMP_CLIPNODES, { Mod_LoadClipnodes_BSP29, Mod_LoadClipnodes_BSP2 },
+      { sizeof(bsp29_dclipnode_t), sizeof(bsp2_dclipnode_t) },
+      sizeof(mclipnode_t), 0, 1, STAGE_BIT(STAGE_PLANES) },
+};
+
+typedef struct {
+    lump_t *lumps;
+    int format;			/* 0 = BSP29, 1 = BSP2 */
+    byte *reserved[NUM_BRUSH_STAGES];
+    int size[NUM_BRUSH_STAGES];
+    int ready[NUM_BRUSH_STAGES];	/* stages to run in this pass */
+} brushload_t;
+
+static void
+Mod_LoadBrushStage(void *data, int index)
+{
+   const brushload_t *load = (const brushload_t *)data;
+   int stage = load->ready[index];
+   const brushstage_t *def = &brushstages[stage];
+
+   mod_stagebuf = load->reserved[stage];
+   mod_stagesize = load->size[stage];
+   def->load[load->format](&load->lumps[def->lump]);
+   mod_stagebuf = NULL;
+}
+
+/*
+=================
+Mod_LoadBrushStages
+=================
+*/
+static void
+Mod_LoadBrushStages(dheader_t *header)
+{
+   const brushstage_t *def;
+   brushload_t load;
+   unsigned done, all;
+   int i, count;
+
+   load.lumps = header->lumps;
+   load.format = (header->version == BSPVERSION) ? 0 : 1;
+
+   for (i = 0, def = brushstages; i < NUM_BRUSH_STAGES; i++, def++) {
+      count = header->lumps[def->lump].filelen / def->insize[load.format];
+      load.size[i] = (count + def->extra) * def->scale * def->outsize;
+      load.reserved[i] = (byte *)Hunk_AllocName(load.size[i], loadname);
+   }
+
+   done = 0;
+   all = STAGE_BIT(NUM_BRUSH_STAGES) - 1;
+   while (done != all) {
+      count = 0;
+      for (i = 0, def = brushstages; i < NUM_BRUSH_STAGES; i++, def++) {
+         if (done & STAGE_BIT(i))
+            continue;
+         if ((def->depends & done) == def->depends)
+            load.ready[count++] = i;
+      }
+      Tasks_Run(Mod_LoadBrushStage, &load, count);
+      for (i = 0; i < count; i++)
+         done |= STAGE_BIT(load.ready[i]);
+   }
+}
+
 /*
 =================
 Mod_LoadBrushModel
@@ -1828,6 +2119,7 @@ static void Mod_LoadBrushModel(model_t *mod, void *buffer, unsigned long size)
    int i, j;
    dheader_t *header;
    dmodel_t *bm;
+   model_t *world = NULL;	/* gets a precomputed PVS matrix */
 
    loadmodel->type = mod_brush;
    header = (dheader_t *)buffer;
@@ -1902,33 +2194,9 @@ static void Mod_LoadBrushModel(model_t *mod, void *buffer, unsigned long size)
 #endif
 
    /* load into heap */
-   Mod_LoadVertexes(&header->lumps[LUMP_VERTEXES]);
-   if (header->version == BSPVERSION)
-      Mod_LoadEdges_BSP29(&header->lumps[LUMP_EDGES]);
-   else
-      Mod_LoadEdges_BSP2(&header->lumps[LUMP_EDGES]);
-   Mod_LoadSurfedges(&header->lumps[LUMP_SURFEDGES]);
    Mod_LoadTextures(&header->lumps[LUMP_TEXTURES]);
    Mod_LoadLighting(&header->lumps[LUMP_LIGHTING]);
-   Mod_LoadPlanes(&header->lumps[LUMP_PLANES]);
-   Mod_LoadTexinfo(&header->lumps[LUMP_TEXINFO]);
-   if (header->version == BSPVERSION) {
-      Mod_LoadFaces_BSP29(&header->lumps[LUMP_FACES]);
-      Mod_LoadMarksurfaces_BSP29(&header->lumps[LUMP_MARKSURFACES]);
-   } else {
-      Mod_LoadFaces_BSP2(&header->lumps[LUMP_FACES]);
-      Mod_LoadMarksurfaces_BSP2(&header->lumps[LUMP_MARKSURFACES]);
-   }
-   Mod_LoadVisibility(&header->lumps[LUMP_VISIBILITY]);
-   if (header->version == BSPVERSION) {
-      Mod_LoadLeafs_BSP29(&header->lumps[LUMP_LEAFS]);
-      Mod_LoadNodes_BSP29(&header->lumps[LUMP_NODES]);
-      Mod_LoadClipnodes_BSP29(&header->lumps[LUMP_CLIPNODES]);
-   } else {
-      Mod_LoadLeafs_BSP2(&header->lumps[LUMP_LEAFS]);
-      Mod_LoadNodes_BSP2(&header->lumps[LUMP_NODES]);
-      Mod_LoadClipnodes_BSP2(&header->lumps[LUMP_CLIPNODES]);
-   }
+   Mod_LoadBrushStages(header);
    Mod_LoadEntities(&header->lumps[LUMP_ENTITIES]);
    Mod_LoadSubmodels(&header->lumps[LUMP_MODELS]);
 
@@ -1943,10 +2211,11 @@ static void Mod_LoadBrushModel(model_t *mod, void *buffer, unsigned long size)
     * - If any other model has more leafs, then we may be in trouble...
     */
          if (mod->numleafs > pvscache_numleafs) {
-            if (pvscache[0].leafbits)
+            if (pvscache)
                SV_Error("%s: %d allocated for visdata, but model %s has %d leafs",
                      __func__, pvscache_numleafs, loadmodel->name, mod->numleafs);
-            Mod_InitPVSCache(mod->numleafs);
+            if (Mod_InitPVSCache(mod->numleafs))
+               world = mod;
          }
 
          //
@@ -1981,6 +2250,10 @@ static void Mod_LoadBrushModel(model_t *mod, void *buffer, unsigned long size)
                mod = loadmodel;
             }
          }
+
+         /* leaf counts are final now, see mod->numleafs above */
+         if (world)
+            Mod_BuildPVSMatrix(world);
 }
 
 /*
@@ -171,6 +171,7 @@ typedef struct msurface_s {
     unsigned dlightbits[(MAX_DLIGHTS + 31) >> 5]; /* qbism from MH - increase max_dlights */
 
     byte styles[MAXLIGHTMAPS];
+    uint64_t stylemask;		// bit n set if styles has n < MAX_LIGHTSTYLES
     byte *samples;		// [numstyles*surfsize]
 } msurface_t;
 
@@ -523,13 +524,16 @@ Mod_NextLeafBit(const leafbits_t *leafbits, int leafnum, leafblock_t *check)
 		leafnum < leafbits->numleafs;				    \
 		leafnum = Mod_NextLeafBit(leafbits, leafnum, &check) )
 
+/*
+ * Whole set operations (leafbits.c), done a vector at a time where the
+ * target has SSE2 or NEON
+ */
 /* 'OR' the bits of src into dst */
 void Mod_AddLeafBits(leafbits_t *dst, const leafbits_t *src);
-
-#ifdef SERVERONLY
-/* Slightly faster counting of sparse sets for QWSV */
 int Mod_CountLeafBits(const leafbits_t *leafbits);
-#endif
+/* true if any of the count leafs listed in leafnums is in the set */
+qboolean Mod_TestLeafBits(const leafbits_t *leafbits, const int *leafnums,
+			  int count);
 
 // FIXME - surely this doesn't belong here?
 texture_t *R_TextureAnimation(const struct entity_s *e, texture_t *base);
@@ -269,3 +269,74 @@ Loop_GetDefaultMTU(void)
      */
     return MAX_MSGLEN;
 }
+
+/*
+ * Messages queued between the local client and server are part of a
+ * snapshot; without them a restored game would replay or lose a frame.
+ */
+static void
+Loop_SaveSocket(savebuf_t *buf, const qsocket_t *sock)
+{
+    if (!sock) {
+	SaveBuf_WriteInt(buf, -1);
+	return;
+    }
+    SaveBuf_WriteInt(buf, sock->receiveMessageLength);
+    SaveBuf_Write(buf, sock->receiveMessage, sock->receiveMessageLength);
+    SaveBuf_WriteInt(buf, sock->canSend);
+}
+
+static void
+Loop_LoadSocket(savebuf_t *buf, qsocket_t *sock)
+{
+    int length;
+
+    length = SaveBuf_ReadInt(buf);
+    if (length < 0 || !sock) {
+	if ((length >= 0) != (sock != NULL))
+	    buf->overflowed = true;
+	return;
+    }
+    if (length > NET_MAXMESSAGE) {
+	buf->overflowed = true;
+	return;
+    }
+    SaveBuf_Read(buf, sock->receiveMessage, length);
+    sock->receiveMessageLength = length;
+    sock->canSend = SaveBuf_ReadInt(buf);
+}
+
+static void
+Loop_CheckSocket(savebuf_t *buf, const qsocket_t *sock)
+{
+    int length;
+
+    length = SaveBuf_ReadInt(buf);
+    if ((length >= 0) != (sock != NULL) || length > NET_MAXMESSAGE) {
+	buf->overflowed = true;
+	return;
+    }
+    if (sock)
+	SaveBuf_Skip(buf, length + 4);
+}
+
+void
+Loop_SaveState(savebuf_t *buf)
+{
+    Loop_SaveSocket(buf, loop_client);
+    Loop_SaveSocket(buf, loop_server);
+}
+
+void
+Loop_LoadState(savebuf_t *buf)
+{
+    Loop_LoadSocket(buf, loop_client);
+    Loop_LoadSocket(buf, loop_server);
+}
+
+void
+Loop_CheckState(savebuf_t *buf)
+{
+    Loop_CheckSocket(buf, loop_client);
+    Loop_CheckSocket(buf, loop_server);
+}
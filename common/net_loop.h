@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #define NET_LOOP_H
 
 #include "net.h"
+#include "savestate.h"
 
 // net_loop.h
 
@@ -39,4 +40,8 @@ void Loop_Close(qsocket_t *sock);
 void Loop_Shutdown(void);
 int Loop_GetDefaultMTU(void);
 
+void Loop_SaveState(savebuf_t *buf);
+void Loop_LoadState(savebuf_t *buf);
+void Loop_CheckState(savebuf_t *buf);
+
 #endif /* NET_LOOP_H */
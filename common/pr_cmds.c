@@ -40,7 +40,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #endif
 
 #define	RETURN_EDICT(e) (((int *)pr_globals)[OFS_RETURN] = EDICT_TO_PROG(e))
-#define	RETURN_STRING(s) (((int *)pr_globals)[OFS_RETURN] = PR_SetString(s))
+#define	RETURN_STRING(s) (((int *)pr_globals)[OFS_RETURN] = PR_SetTempString(s))
 
 /*
 ===============================================================================
@@ -297,6 +297,7 @@ PF_setmodel(void)
 
     e->v.model = PR_SetString(m);
     e->v.modelindex = i;
+    ED_Changed(e);
 
 #ifdef NQ_HACK
     mod = sv.models[(int)e->v.modelindex];
@@ -564,12 +565,16 @@ Returns a number from 0<= num < 1
 random()
 =================
 */
+unsigned pr_randseed;
+
 static void
 PF_random(void)
 {
     float num;
 
-    num = (rand() & 0x7fff) / ((float)0x7fff);
+    /* not rand(), so the sequence can be saved along with the game */
+    pr_randseed = pr_randseed * 214013 + 2531011;
+    num = ((pr_randseed >> 16) & 0x7fff) / ((float)0x7fff);
 
     G_FLOAT(OFS_RETURN) = num;
 }
@@ -986,19 +991,38 @@ findradius (origin, radius)
 static void
 PF_findradius(void)
 {
+    static int list[MAX_EDICTS];
     edict_t *ent, *chain;
     float rad;
     float *org;
-    vec3_t eorg;
-    int i, j;
+    vec3_t eorg, mins, maxs;
+    int i, j, count;
 
     chain = (edict_t *)sv.edicts;
 
     org = G_VECTOR(OFS_PARM0);
     rad = G_FLOAT(OFS_PARM1);
 
-    ent = NEXT_EDICT(sv.edicts);
-    for (i = 1; i < sv.num_edicts; i++, ent = NEXT_EDICT(ent)) {
+    /*
+     * Only the edicts near the area tree nodes the sphere touches need
+     * testing. A NaN in the query would make every edict pass the test,
+     * which the tree can't answer, so those calls check them all.
+     */
+    if (rad == rad && org[0] == org[0] && org[1] == org[1] && org[2] == org[2]) {
+	for (j = 0; j < 3; j++) {
+	    mins[j] = org[j] - rad;
+	    maxs[j] = org[j] + rad;
+	}
+	count = SV_AreaEdicts(mins, maxs, list);
+    } else {
+	count = 0;
+	for (i = 1; i < sv.num_edicts; i++)
+	    list[count++] = i;
+    }
+
+    /* list is in ascending order, so the chain comes out as it always has */
+    for (i = 0; i < count; i++) {
+	ent = EDICT_NUM(list[i]);
 	if (ent->free)
 	    continue;
 	if (ent->v.solid == SOLID_NOT)
@@ -1042,7 +1066,7 @@ PF_ftos(void)
 	sprintf(pr_string_temp, "%d", (int)v);
     else
 	sprintf(pr_string_temp, "%5.1f", v);
-    G_INT(OFS_RETURN) = PR_SetString(pr_string_temp);
+    G_INT(OFS_RETURN) = PR_SetTempString(pr_string_temp);
 }
 
 static void
@@ -1059,7 +1083,7 @@ PF_vtos(void)
 {
     sprintf(pr_string_temp, "'%5.1f %5.1f %5.1f'", G_VECTOR(OFS_PARM0)[0],
 	    G_VECTOR(OFS_PARM0)[1], G_VECTOR(OFS_PARM0)[2]);
-    G_INT(OFS_RETURN) = PR_SetString(pr_string_temp);
+    G_INT(OFS_RETURN) = PR_SetTempString(pr_string_temp);
 }
 
 static void
@@ -1096,6 +1120,12 @@ PF_Find(void)
     if (!s)
 	PR_RunError("%s: bad search string", __func__);
 
+    if (f >= 0 && f < progs->entityfields) {
+	e = ED_FindString(e, f, s);
+	RETURN_EDICT(EDICT_NUM(e));
+	return;
+    }
+
     for (e++; e < sv.num_edicts; e++) {
 	ed = EDICT_NUM(e);
 	if (ed->free)
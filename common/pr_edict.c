@@ -19,6 +19,9 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // sv_edict.c -- entity dictionary
 
+#include <stddef.h>
+#include <stdlib.h>
+
 #include "cmd.h"
 #include "console.h"
 #include "crc.h"
@@ -67,7 +70,8 @@ static int type_size[8] = {
     1				// ev_pointer
 };
 
-static qboolean ED_ParseEpair(void *base, ddef_t *key, const char *s);
+static qboolean ED_ParseEpair(void *base, ddef_t *key, const char *s,
+			      int length);
 
 #define	MAX_FIELD_LEN	64
 #define GEFV_CACHESIZE	2
@@ -99,6 +103,214 @@ func_t SpectatorThink;
 func_t SpectatorDisconnect;
 #endif
 
+/*
+ * Free edicts that can be handed out again are kept in a bitmap, so
+ * ED_Alloc takes the lowest numbered one just as the old linear scan did.
+ * Edicts freed after the first couple of seconds wait in a queue, ordered
+ * by free time, until they are old enough to be reused. Anything other
+ * than ED_Alloc/ED_Free that rewrites the free flags marks the lists
+ * stale and they are rebuilt from the edicts on the next allocation.
+ */
+#define FREE_WORDS	((MAX_EDICTS + 63) / 64)
+
+typedef struct {
+    int num;
+    float freetime;
+} freequeue_t;
+
+static uint64_t ed_freebits[FREE_WORDS];
+static uint64_t ed_freewords[(FREE_WORDS + 63) / 64];	// non-empty words
+static freequeue_t ed_freequeue[MAX_EDICTS];
+static int ed_freehead;
+static int ed_freecount;
+static int ed_firstfree;	// lowest edict number ED_Alloc may use
+static qboolean ed_freestale = true;
+
+static struct {
+    int allocs;
+    int reused;
+    int frees;
+    int refrees;		// ED_Free on an edict that was already free
+    int active;
+    int peak_active;
+    int peak_edicts;
+    int peak_waiting;
+} ed_allocstats;
+
+static inline int
+ED_LowestBit(uint64_t bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int i = 0;
+
+    while (!(bits & 1)) {
+	bits >>= 1;
+	i++;
+    }
+    return i;
+#endif
+}
+
+static void
+ED_SetFreeBit(int num)
+{
+    ed_freebits[num >> 6] |= 1ULL << (num & 63);
+    ed_freewords[num >> 12] |= 1ULL << ((num >> 6) & 63);
+}
+
+static void
+ED_ClearFreeBit(int num)
+{
+    int word = num >> 6;
+
+    ed_freebits[word] &= ~(1ULL << (num & 63));
+    if (!ed_freebits[word])
+	ed_freewords[word >> 6] &= ~(1ULL << (word & 63));
+}
+
+static int
+ED_LowestFreeBit(void)
+{
+    int i, word;
+
+    for (i = 0; i < ARRAY_SIZE(ed_freewords); i++) {
+	if (ed_freewords[i]) {
+	    word = (i << 6) + ED_LowestBit(ed_freewords[i]);
+	    return (word << 6) + ED_LowestBit(ed_freebits[word]);
+	}
+    }
+    return -1;
+}
+
+static qboolean
+ED_CanReuse(const edict_t *e)
+{
+    // the first couple seconds of server time can involve a lot of
+    // freeing and allocating, so relax the replacement policy
+    return e->free && (e->freetime < 2 || sv.time - e->freetime > 0.5);
+}
+
+static void
+ED_QueueFree(int num, float freetime)
+{
+    freequeue_t *item;
+
+    /* the queue relies on free times never going backwards */
+    if (ed_freecount == MAX_EDICTS) {
+	ed_freestale = true;
+	return;
+    }
+    if (ed_freecount) {
+	item = &ed_freequeue[(ed_freehead + ed_freecount - 1) % MAX_EDICTS];
+	if (freetime < item->freetime) {
+	    ed_freestale = true;
+	    return;
+	}
+    }
+
+    item = &ed_freequeue[(ed_freehead + ed_freecount) % MAX_EDICTS];
+    item->num = num;
+    item->freetime = freetime;
+    ed_freecount++;
+    ed_allocstats.peak_waiting =
+	qmax(ed_allocstats.peak_waiting, ed_freecount);
+}
+
+/*
+ * Move the edicts that have waited long enough from the queue to the
+ * bitmap. Entries for edicts that were freed again since are dropped; the
+ * later free queued another one.
+ */
+static void
+ED_ReleaseFrees(void)
+{
+    const freequeue_t *item;
+    const edict_t *e;
+
+    while (ed_freecount) {
+	item = &ed_freequeue[ed_freehead];
+	e = EDICT_NUM(item->num);
+	if (e->free && e->freetime == item->freetime) {
+	    if (!ED_CanReuse(e))
+		break;
+	    ED_SetFreeBit(item->num);
+	}
+	ed_freehead = (ed_freehead + 1) % MAX_EDICTS;
+	ed_freecount--;
+    }
+}
+
+static int
+ED_FreeTimeCompare(const void *a, const void *b)
+{
+    const freequeue_t *item1 = a;
+    const freequeue_t *item2 = b;
+
+    if (item1->freetime != item2->freetime)
+	return item1->freetime < item2->freetime ? -1 : 1;
+    return item1->num - item2->num;
+}
+
+static void
+ED_RebuildFreeLists(void)
+{
+    int i;
+    edict_t *e;
+
+    memset(ed_freebits, 0, sizeof(ed_freebits));
+    memset(ed_freewords, 0, sizeof(ed_freewords));
+    ed_freehead = ed_freecount = 0;
+#ifdef NQ_HACK
+    ed_firstfree = svs.maxclients + 1;
+#endif
+#if defined(QW_HACK) && defined(SERVERONLY)
+    ed_firstfree = MAX_CLIENTS + 1;
+#endif
+
+    ed_allocstats.active = 0;
+    for (i = 0; i < sv.num_edicts; i++) {
+	e = EDICT_NUM(i);
+	if (!e->free) {
+	    ed_allocstats.active++;
+	    continue;
+	}
+	if (i < ed_firstfree)
+	    continue;
+	if (ED_CanReuse(e)) {
+	    ED_SetFreeBit(i);
+	} else {
+	    ed_freequeue[ed_freecount].num = i;
+	    ed_freequeue[ed_freecount].freetime = e->freetime;
+	    ed_freecount++;
+	}
+    }
+    qsort(ed_freequeue, ed_freecount, sizeof(ed_freequeue[0]),
+	  ED_FreeTimeCompare);
+
+    ed_allocstats.peak_active =
+	qmax(ed_allocstats.peak_active, ed_allocstats.active);
+    ed_allocstats.peak_edicts =
+	qmax(ed_allocstats.peak_edicts, sv.num_edicts);
+    ed_allocstats.peak_waiting =
+	qmax(ed_allocstats.peak_waiting, ed_freecount);
+    ed_freestale = false;
+}
+
+/*
+=================
+ED_ResetFreeList
+
+The free flags of the edicts were rewritten wholesale
+=================
+*/
+void
+ED_ResetFreeList(void)
+{
+    ed_freestale = true;
+}
+
 /*
 =================
 ED_ClearEdict
@@ -111,6 +323,7 @@ ED_ClearEdict(edict_t *e)
 {
     memset(&e->v, 0, progs->entityfields * 4);
     e->free = false;
+    ED_Changed(e);
 }
 
 /*
@@ -130,20 +343,24 @@ ED_Alloc(void)
     int i;
     edict_t *e;
 
-#ifdef NQ_HACK
-    for (i = svs.maxclients + 1; i < sv.num_edicts; i++) {
-#endif
-#if defined(QW_HACK) && defined(SERVERONLY)
-    for (i = MAX_CLIENTS + 1; i < sv.num_edicts; i++) {
-#endif
+    if (ed_freestale)
+	ED_RebuildFreeLists();
+    ED_ReleaseFrees();
+
+    ed_allocstats.allocs++;
+    while ((i = ED_LowestFreeBit()) >= 0) {
+	ED_ClearFreeBit(i);
 	e = EDICT_NUM(i);
-	// the first couple seconds of server time can involve a lot of
-	// freeing and allocating, so relax the replacement policy
-	if (e->free && (e->freetime < 2 || sv.time - e->freetime > 0.5)) {
+	if (i < sv.num_edicts && ED_CanReuse(e)) {
 	    ED_ClearEdict(e);
+	    ed_allocstats.reused++;
+	    ed_allocstats.active++;
+	    ed_allocstats.peak_active =
+		qmax(ed_allocstats.peak_active, ed_allocstats.active);
 	    return e;
 	}
     }
+    i = sv.num_edicts;
 
 #ifdef NQ_HACK
     if (i == MAX_EDICTS)
@@ -156,6 +373,7 @@ ED_Alloc(void)
 	i--;			// step on whatever is the last edict
 	e = EDICT_NUM(i);
 	SV_UnlinkEdict(e);
+	ed_allocstats.active--;
     } else
 	sv.num_edicts++;
 #endif
@@ -163,6 +381,12 @@ ED_Alloc(void)
     e = EDICT_NUM(i);
     ED_ClearEdict(e);
 
+    ed_allocstats.active++;
+    ed_allocstats.peak_active =
+	qmax(ed_allocstats.peak_active, ed_allocstats.active);
+    ed_allocstats.peak_edicts =
+	qmax(ed_allocstats.peak_edicts, sv.num_edicts);
+
     return e;
 }
 
@@ -177,6 +401,14 @@ FIXME: walk all entities and NULL out references to this entity
 void
 ED_Free(edict_t *ed)
 {
+    int num = NUM_FOR_EDICT(ed);
+
+    ed_allocstats.frees++;
+    if (ed->free)
+	ed_allocstats.refrees++;
+    else
+	ed_allocstats.active--;
+
     SV_UnlinkEdict(ed);		// unlink from world bsp
 
     ed->free = true;
@@ -192,6 +424,244 @@ ED_Free(edict_t *ed)
     ed->v.solid = 0;
 
     ed->freetime = sv.time;
+
+    if (ed_freestale || num < ed_firstfree)
+	return;
+    if (ed->freetime < 2)
+	ED_SetFreeBit(num);
+    else
+	ED_QueueFree(num, ed->freetime);
+}
+
+/*
+ * find() lookups go through a hash of the string values of the few fields
+ * mods search on, built the first time each field is searched. The
+ * buckets keep their edicts in ascending order, so the first match is the
+ * edict a linear search would have returned. A store to an indexed field
+ * only marks the edict, because progs take the field's address before the
+ * new value is written; marked edicts are rehashed before the next lookup.
+ * Values that aren't valid strings, or that point at buffers the engine
+ * rewrites in place, are kept aside and checked in full.
+ */
+#define MAX_FIND_INDEXES	8
+#define FIND_HASH_SIZE		1024	// power of two
+
+#define FIND_UNHASHED	(-1)	// not in the index at all
+#define FIND_INVALID	(-2)	// on the invalid list
+
+typedef struct {
+    int field;
+    int head[FIND_HASH_SIZE];	// first edict in each bucket, 0 for none
+    int next[MAX_EDICTS];
+    int bucket[MAX_EDICTS];	// or FIND_UNHASHED / FIND_INVALID
+    byte dirty[MAX_EDICTS];
+    int dirtylist[MAX_EDICTS];
+    int numdirty;
+    int invalid[MAX_EDICTS];
+    int numinvalid;
+} findindex_t;
+
+byte *pr_fieldflags;
+
+#define ED_FIELD(f) ((int)(offsetof(entvars_t, f) / 4))
+
+static findindex_t *ed_findindex[MAX_FIND_INDEXES];
+static int ed_numfindindexes;
+
+static void
+ED_MarkFindIndex(findindex_t *index, int num)
+{
+    if (index->dirty[num])
+	return;
+    index->dirty[num] = true;
+    index->dirtylist[index->numdirty++] = num;
+}
+
+/*
+============
+ED_FieldWritten
+
+Progs stored to field ofs of ed
+============
+*/
+void
+ED_FieldWritten(edict_t *ed, int ofs)
+{
+    int i;
+
+    if (pr_fieldflags[ofs] & FIELD_AREA)
+	SV_MarkMoved(ed);
+    if (pr_fieldflags[ofs] & FIELD_FIND) {
+	for (i = 0; i < ed_numfindindexes; i++)
+	    if (ed_findindex[i]->field == ofs)
+		ED_MarkFindIndex(ed_findindex[i], NUM_FOR_EDICT(ed));
+    }
+}
+
+/*
+============
+ED_Changed
+
+The engine rewrote fields of ed directly
+============
+*/
+void
+ED_Changed(edict_t *ed)
+{
+    int i, num;
+
+    SV_MarkMoved(ed);
+    num = NUM_FOR_EDICT(ed);
+    for (i = 0; i < ed_numfindindexes; i++)
+	ED_MarkFindIndex(ed_findindex[i], num);
+}
+
+void
+ED_ClearFindIndex(void)
+{
+    int i;
+
+    for (i = 0; i < ed_numfindindexes; i++) {
+	if (pr_fieldflags)
+	    pr_fieldflags[ed_findindex[i]->field] &= ~FIELD_FIND;
+	free(ed_findindex[i]);
+	ed_findindex[i] = NULL;
+    }
+    ed_numfindindexes = 0;
+}
+
+static findindex_t *
+ED_GetFindIndex(int field)
+{
+    findindex_t *index;
+    int i;
+
+    for (i = 0; i < ed_numfindindexes; i++)
+	if (ed_findindex[i]->field == field)
+	    return ed_findindex[i];
+    if (ed_numfindindexes == MAX_FIND_INDEXES)
+	return NULL;
+
+    index = (findindex_t *)calloc(1, sizeof(*index));
+    if (!index)
+	return NULL;
+    index->field = field;
+    for (i = 0; i < MAX_EDICTS; i++)
+	index->bucket[i] = FIND_UNHASHED;
+    for (i = 1; i < sv.num_edicts; i++)
+	ED_MarkFindIndex(index, i);
+
+    ed_findindex[ed_numfindindexes++] = index;
+    pr_fieldflags[field] |= FIELD_FIND;
+
+    return index;
+}
+
+static void
+ED_UpdateFindIndex(findindex_t *index)
+{
+    string_t value;
+    int i, num, bucket;
+    int *link;
+
+    for (i = 0; i < index->numdirty; i++) {
+	num = index->dirtylist[i];
+	index->dirty[num] = false;
+
+	/* take it out of wherever it was */
+	bucket = index->bucket[num];
+	if (bucket >= 0) {
+	    for (link = &index->head[bucket]; *link != num; link = &index->next[*link])
+		;
+	    *link = index->next[num];
+	} else if (bucket == FIND_INVALID) {
+	    for (bucket = 0; index->invalid[bucket] != num; bucket++)
+		;
+	    index->invalid[bucket] = index->invalid[--index->numinvalid];
+	}
+	index->bucket[num] = FIND_UNHASHED;
+	if (!num || num >= sv.num_edicts)
+	    continue;		// the world is never searched
+
+	value = ((string_t *)&EDICT_NUM(num)->v)[index->field];
+	if (!PR_ValidString(value) || PR_TempString(value)) {
+	    index->bucket[num] = FIND_INVALID;
+	    index->invalid[index->numinvalid++] = num;
+	    continue;
+	}
+
+	/* insert it in order */
+	bucket = COM_HashString(PR_GetString(value)) & (FIND_HASH_SIZE - 1);
+	for (link = &index->head[bucket]; *link && *link < num; link = &index->next[*link])
+	    ;
+	index->next[num] = *link;
+	*link = num;
+	index->bucket[num] = bucket;
+    }
+    index->numdirty = 0;
+}
+
+/*
+============
+ED_FindString
+
+Returns the number of the first edict after start whose string field
+matches s, or zero if there is none
+============
+*/
+int
+ED_FindString(int start, int field, const char *s)
+{
+    findindex_t *index;
+    const edict_t *ed;
+    const char *t;
+    int num, found, i;
+
+    index = ED_GetFindIndex(field);
+    if (!index) {
+	for (num = start + 1; num < sv.num_edicts; num++) {
+	    ed = EDICT_NUM(num);
+	    if (ed->free)
+		continue;
+	    t = E_STRING(ed, field);
+	    if (t && !strcmp(t, s))
+		return num;
+	}
+	return 0;
+    }
+
+    ED_UpdateFindIndex(index);
+
+    found = 0;
+    num = index->head[COM_HashString(s) & (FIND_HASH_SIZE - 1)];
+    for (; num; num = index->next[num]) {
+	if (num <= start)
+	    continue;
+	if (num >= sv.num_edicts)
+	    break;
+	ed = EDICT_NUM(num);
+	if (ed->free)
+	    continue;
+	if (!strcmp(E_STRING(ed, field), s)) {
+	    found = num;
+	    break;
+	}
+    }
+
+    /* a linear search would hit the invalid values on the way */
+    for (i = 0; i < index->numinvalid; i++) {
+	num = index->invalid[i];
+	if (num <= start || (found && num > found) || num >= sv.num_edicts)
+	    continue;
+	ed = EDICT_NUM(num);
+	if (ed->free)
+	    continue;
+	t = E_STRING(ed, field);
+	if (t && !strcmp(t, s))
+	    found = num;
+    }
+
+    return found;
 }
 
 //===========================================================================
@@ -220,7 +690,7 @@ ED_GlobalAtOfs(int ofs)
 ED_FieldAtOfs
 ============
 */
-static ddef_t *
+ddef_t *
 ED_FieldAtOfs(int ofs)
 {
     ddef_t *def;
@@ -234,6 +704,97 @@ ED_FieldAtOfs(int ofs)
     return NULL;
 }
 
+/*
+ * The field, global and function definitions are looked up by name through
+ * open addressed hashes built when the progs are loaded. Where a name is
+ * defined more than once the first definition is kept, as the linear
+ * searches these replace returned it.
+ */
+typedef struct {
+    int32_t s_name;
+    int num;			// -1 for an empty slot
+} prnameslot_t;
+
+typedef struct {
+    prnameslot_t *slots;
+    unsigned mask;
+} prnameindex_t;
+
+static prnameindex_t pr_fieldindex;
+static prnameindex_t pr_globalindex;
+static prnameindex_t pr_functionindex;
+
+static void
+PR_InitNameIndex(prnameindex_t *index, int count, const char *hunkname)
+{
+    unsigned i, size = 16;
+
+    while (size <= count * 2U)
+	size <<= 1;
+    index->slots = Hunk_AllocName(size * sizeof(prnameslot_t), hunkname);
+    index->mask = size - 1;
+    for (i = 0; i < size; i++)
+	index->slots[i].num = -1;
+}
+
+static prnameslot_t *
+PR_NameIndexSlot(const prnameindex_t *index, const char *name, int length)
+{
+    prnameslot_t *slot;
+    const char *s_name;
+    unsigned hash = COM_HashBytes(name, length);
+
+    for (;;) {
+	slot = &index->slots[hash & index->mask];
+	if (slot->num < 0)
+	    return slot;
+	s_name = PR_GetString(slot->s_name);
+	if (!strncmp(s_name, name, length) && !s_name[length])
+	    return slot;
+	hash++;
+    }
+}
+
+static void
+PR_AddToNameIndex(prnameindex_t *index, int32_t s_name, int num)
+{
+    prnameslot_t *slot;
+    const char *name;
+
+    if (!PR_ValidString(s_name))
+	return;
+    name = PR_GetString(s_name);
+    slot = PR_NameIndexSlot(index, name, strlen(name));
+    if (slot->num < 0) {
+	slot->s_name = s_name;
+	slot->num = num;
+    }
+}
+
+static int
+PR_FindName(const prnameindex_t *index, const char *name, int length)
+{
+    return PR_NameIndexSlot(index, name, length)->num;
+}
+
+static void
+PR_BuildNameIndexes(void)
+{
+    int i;
+
+    PR_InitNameIndex(&pr_fieldindex, progs->numfielddefs, "fieldidx");
+    for (i = 0; i < progs->numfielddefs; i++)
+	PR_AddToNameIndex(&pr_fieldindex, pr_fielddefs[i].s_name, i);
+
+    PR_InitNameIndex(&pr_globalindex, progs->numglobaldefs, "globlidx");
+    for (i = 0; i < progs->numglobaldefs; i++)
+	PR_AddToNameIndex(&pr_globalindex, pr_globaldefs[i].s_name, i);
+
+    PR_InitNameIndex(&pr_functionindex, progs->numfunctions, "funcidx");
+    for (i = 0; i < progs->numfunctions; i++)
+	PR_AddToNameIndex(&pr_functionindex, pr_functions[i].s_name, i);
+}
+
 /*
 ============
 ED_FindField
@@ -242,15 +803,9 @@ ED_FindField
 static ddef_t *
 ED_FindField(const char *name)
 {
-    ddef_t *def;
-    int i;
+    int num = PR_FindName(&pr_fieldindex, name, strlen(name));
 
-    for (i = 0; i < progs->numfielddefs; i++) {
-	def = &pr_fielddefs[i];
-	if (!strcmp(PR_GetString(def->s_name), name))
-	    return def;
-    }
-    return NULL;
+    return num < 0 ? NULL : &pr_fielddefs[num];
 }
 
 
@@ -262,15 +817,9 @@ ED_FindGlobal
 static ddef_t *
 ED_FindGlobal(const char *name)
 {
-    ddef_t *def;
-    int i;
+    int num = PR_FindName(&pr_globalindex, name, strlen(name));
 
-    for (i = 0; i < progs->numglobaldefs; i++) {
-	def = &pr_globaldefs[i];
-	if (!strcmp(PR_GetString(def->s_name), name))
-	    return def;
-    }
-    return NULL;
+    return num < 0 ? NULL : &pr_globaldefs[num];
 }
 
 
@@ -282,15 +831,9 @@ ED_FindFunction
 static dfunction_t *
 ED_FindFunction(const char *name)
 {
-    dfunction_t *func;
-    int i;
+    int num = PR_FindName(&pr_functionindex, name, strlen(name));
 
-    for (i = 0; i < progs->numfunctions; i++) {
-	func = &pr_functions[i];
-	if (!strcmp(PR_GetString(func->s_name), name))
-	    return func;
-    }
-    return NULL;
+    return num < 0 ? NULL : &pr_functions[num];
 }
 
 eval_t *
@@ -641,6 +1184,12 @@ static void ED_Count(void)
    Con_Printf("view      :%3i\n", models);
    Con_Printf("touch     :%3i\n", solid);
    Con_Printf("step      :%3i\n", step);
+   Con_Printf("allocs %i (%i reused), frees %i (%i already free)\n",
+              ed_allocstats.allocs, ed_allocstats.reused,
+              ed_allocstats.frees, ed_allocstats.refrees);
+   Con_Printf("high water: %i edicts, %i active, %i waiting for reuse\n",
+              ed_allocstats.peak_edicts, ed_allocstats.peak_active,
+              ed_allocstats.peak_waiting);
 
 }
 
@@ -720,7 +1269,8 @@ ED_ParseGlobals(const char *data)
 	    continue;
 	}
 
-	if (!ED_ParseEpair((void *)pr_globals, key, com_token))
+	if (!ED_ParseEpair((void *)pr_globals, key, com_token,
+			   strlen(com_token)))
 #ifdef NQ_HACK
 	    Host_Error("%s: parse error", __func__);
 #endif
@@ -733,35 +1283,121 @@ ED_ParseGlobals(const char *data)
 //============================================================================
 
 
+/*
+ * Strings from the entity lump are carved out of larger hunk blocks rather
+ * than given a hunk allocation (and its header) each. The block belongs to
+ * the current progs; it is dropped when they are reloaded or if the hunk
+ * has since been freed back past it.
+ */
+#define ED_STRING_BLOCK	8192
+
+static char *ed_strblock;
+static int ed_strblock_used;
+static int ed_strblock_mark;	// hunk low mark just after the block
+
+static char *
+ED_AllocString(int size)
+{
+    char *string;
+
+    if (size > ED_STRING_BLOCK / 4)
+	return (char *)Hunk_Alloc(size);
+
+    if (!ed_strblock || Hunk_LowMark() < ed_strblock_mark
+	|| ed_strblock_used + size > ED_STRING_BLOCK) {
+	ed_strblock = (char *)Hunk_AllocName(ED_STRING_BLOCK, "edstring");
+	ed_strblock_used = 0;
+	ed_strblock_mark = Hunk_LowMark();
+    }
+    string = ed_strblock + ed_strblock_used;
+    ed_strblock_used += size;
+
+    return string;
+}
+
 /*
 =============
 ED_NewString
 =============
 */
 static char *
-ED_NewString(const char *string)
+ED_NewString(const char *string, int length)
 {
     char *newobj, *new_p;
-    int i, l;
+    int i;
 
-    l = strlen(string) + 1;
-    newobj = (char*)Hunk_Alloc(l);
+    newobj = ED_AllocString(length + 1);
     new_p = newobj;
 
-    for (i = 0; i < l; i++) {
-	if (string[i] == '\\' && i < l - 1) {
+    for (i = 0; i < length; i++) {
+	if (string[i] == '\\') {
 	    i++;
-	    if (string[i] == 'n')
+	    if (i < length && string[i] == 'n')
 		*new_p++ = '\n';
 	    else
 		*new_p++ = '\\';
 	} else
 	    *new_p++ = string[i];
     }
+    *new_p = 0;
 
     return newobj;
 }
 
+/*
+=============
+ED_ParseFloat
+
+atof() of a string that need not be nul terminated. Plain decimals of up
+to 15 significant digits are converted here: the digits and the power of
+ten are both exact as doubles, so the one divide rounds just as strtod
+does. Anything else is handed to atof.
+=============
+*/
+static double
+ED_ParseFloat(const char *s, int length)
+{
+    static const double powers_of_ten[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *p = s, *end = s + length;
+    uint64_t mantissa = 0;
+    int digits = 0, scale = 0;
+    qboolean negative = false, fraction = false, any = false;
+    double value;
+    char string[64];
+
+    if (p < end && (*p == '-' || *p == '+'))
+	negative = *p++ == '-';
+    for (; p < end; p++) {
+	if (*p >= '0' && *p <= '9') {
+	    mantissa = mantissa * 10 + (*p - '0');
+	    if (mantissa)
+		digits++;
+	    if (fraction)
+		scale++;
+	    any = true;
+	} else if (*p == '.' && !fraction) {
+	    fraction = true;
+	} else {
+	    break;
+	}
+    }
+
+    if (!any || digits > 15 || scale >= ARRAY_SIZE(powers_of_ten)
+	|| (p < end && strchr("eExX", *p))) {
+	snprintf(string, sizeof(string), "%.*s", length, s);
+	return atof(string);
+    }
+
+    value = (double)mantissa;
+    if (scale)
+	value /= powers_of_ten[scale];
+
+    return negative ? -value : value;
+}
+
 
 /*
 =============
@@ -772,12 +1408,12 @@ returns false if error
 =============
 */
 static qboolean
-ED_ParseEpair(void *base, ddef_t *key, const char *s)
+ED_ParseEpair(void *base, ddef_t *key, const char *s, int length)
 {
     int i;
-    char string[128];
+    char string[1024];
     ddef_t *def;
-    char *v, *w;
+    const char *w, *end;
     void *d;
     dfunction_t *func;
 
@@ -785,43 +1421,45 @@ ED_ParseEpair(void *base, ddef_t *key, const char *s)
 
     switch (key->type & ~DEF_SAVEGLOBAL) {
     case ev_string:
-	*(string_t *)d = PR_SetString(ED_NewString(s));
+	*(string_t *)d = PR_SetString(ED_NewString(s, length));
 	break;
 
     case ev_float:
-	*(float *)d = atof(s);
+	*(float *)d = ED_ParseFloat(s, length);
 	break;
 
     case ev_vector:
-	strcpy(string, s);
-	v = string;
-	w = string;
+	end = s + length;
 	for (i = 0; i < 3; i++) {
-	    while (*v && *v != ' ')
-		v++;
-	    *v = 0;
-	    ((float *)d)[i] = atof(w);
-	    w = v = v + 1;
+	    w = s;
+	    while (s < end && *s != ' ')
+		s++;
+	    ((float *)d)[i] = ED_ParseFloat(w, s - w);
+	    if (s < end)
+		s++;
 	}
 	break;
 
     case ev_entity:
-	*(int *)d = EDICT_TO_PROG(EDICT_NUM(atoi(s)));
+	snprintf(string, sizeof(string), "%.*s", length, s);
+	*(int *)d = EDICT_TO_PROG(EDICT_NUM(atoi(string)));
 	break;
 
     case ev_field:
-	def = ED_FindField(s);
+	snprintf(string, sizeof(string), "%.*s", length, s);
+	def = ED_FindField(string);
 	if (!def) {
-	    Con_Printf("Can't find field %s\n", s);
+	    Con_Printf("Can't find field %s\n", string);
 	    return false;
 	}
 	*(int *)d = G_INT(def->ofs);
 	break;
 
     case ev_function:
-	func = ED_FindFunction(s);
+	snprintf(string, sizeof(string), "%.*s", length, s);
+	func = ED_FindFunction(string);
 	if (!func) {
-	    Con_Printf("Can't find function %s\n", s);
+	    Con_Printf("Can't find function %s\n", string);
 	    return false;
 	}
 	*(func_t *)d = func - pr_functions;
@@ -833,6 +1471,87 @@ ED_ParseEpair(void *base, ddef_t *key, const char *s)
     return true;
 }
 
+/*
+ * A token of the entity string, left where it is rather than copied into
+ * com_token. Empty tokens point at an empty string.
+ */
+typedef struct {
+    const char *start;
+    int length;
+} edtoken_t;
+
+#ifdef NQ_HACK
+#define ED_SINGLE_CHAR(c) ((c) && strchr("{})(':", (c)))
+#else
+#define ED_SINGLE_CHAR(c) false
+#endif
+
+/*
+==============
+ED_ParseToken
+
+COM_Parse, without the copy
+==============
+*/
+static const char *
+ED_ParseToken(const char *data, edtoken_t *token)
+{
+    int c;
+
+    token->start = "";
+    token->length = 0;
+
+    if (!data)
+	return NULL;
+
+  skipwhite:
+    while ((c = *data) <= ' ') {
+	if (c == 0)
+	    return NULL;	// end of file
+	data++;
+    }
+
+    // skip // comments
+    if (c == '/' && data[1] == '/') {
+	while (*data && *data != '\n')
+	    data++;
+	goto skipwhite;
+    }
+
+    // handle quoted strings specially
+    if (c == '\"') {
+	token->start = ++data;
+	while (*data && *data != '\"')
+	    data++;
+	token->length = data - token->start;
+	return *data ? data + 1 : data;
+    }
+
+    // parse single characters
+    token->start = data;
+    if (ED_SINGLE_CHAR(c)) {
+	token->length = 1;
+	return data + 1;
+    }
+
+    // parse a regular word
+    do {
+	data++;
+	c = *data;
+	if (ED_SINGLE_CHAR(c))
+	    break;
+    } while (c > 32);
+    token->length = data - token->start;
+
+    return data;
+}
+
+static qboolean
+ED_TokenIs(const edtoken_t *token, const char *s)
+{
+    return token->length == strlen(s) && !strncmp(token->start, s, token->length);
+}
+
 /*
 ====================
 ED_ParseEdict
@@ -848,8 +1567,9 @@ ED_ParseEdict(const char *data, edict_t *ent)
     ddef_t *key;
     qboolean anglehack;
     qboolean init;
-    char keyname[256];
-    int n;
+    edtoken_t keyname, value;
+    char angles[64];
+    int num;
 
     init = false;
 
@@ -860,62 +1580,62 @@ ED_ParseEdict(const char *data, edict_t *ent)
 // go through all the dictionary pairs
     while (1) {
 	// parse key
-	data = COM_Parse(data);
-	if (com_token[0] == '}')
+	data = ED_ParseToken(data, &keyname);
+	if (keyname.start[0] == '}')
 	    break;
 	if (!data)
 	    SV_Error("%s: EOF without closing brace", __func__);
 
 // anglehack is to allow QuakeEd to write single scalar angles
 // and allow them to be turned into vectors. (FIXME...)
-	if (!strcmp(com_token, "angle")) {
-	    strcpy(com_token, "angles");
+	if (ED_TokenIs(&keyname, "angle")) {
+	    keyname.start = "angles";
+	    keyname.length = 6;
 	    anglehack = true;
 	} else
 	    anglehack = false;
 
 // FIXME: change light to _light to get rid of this hack
-	if (!strcmp(com_token, "light"))
-	    strcpy(com_token, "light_lev");	// hack for single light def
-
-	strcpy(keyname, com_token);
+	if (ED_TokenIs(&keyname, "light")) {
+	    keyname.start = "light_lev";	// hack for single light def
+	    keyname.length = 9;
+	}
 
 	// another hack to fix keynames with trailing spaces
-	n = strlen(keyname);
-	while (n && keyname[n - 1] == ' ') {
-	    keyname[n - 1] = 0;
-	    n--;
-	}
+	while (keyname.length && keyname.start[keyname.length - 1] == ' ')
+	    keyname.length--;
 
 	// parse value
-	data = COM_Parse(data);
+	data = ED_ParseToken(data, &value);
 	if (!data)
 	    SV_Error("%s: EOF without closing brace", __func__);
 
-	if (com_token[0] == '}')
+	if (value.start[0] == '}')
 	    SV_Error("%s: closing brace without data", __func__);
 
 	init = true;
 
 // keynames with a leading underscore are used for utility comments,
 // and are immediately discarded by quake
-	if (keyname[0] == '_')
+	if (keyname.length && keyname.start[0] == '_')
 	    continue;
 
-	key = ED_FindField(keyname);
-	if (!key) {
-	    Con_Printf("'%s' is not a field\n", keyname);
+	num = PR_FindName(&pr_fieldindex, keyname.start, keyname.length);
+	if (num < 0) {
+	    Con_Printf("'%.*s' is not a field\n", keyname.length,
+		       keyname.start);
 	    continue;
 	}
+	key = &pr_fielddefs[num];
 
 	if (anglehack) {
-	    char temp[32];
-
-	    strcpy(temp, com_token);
-	    sprintf(com_token, "0 %s 0", temp);
+	    value.length = snprintf(angles, sizeof(angles), "0 %.*s 0",
+				    value.length, value.start);
+	    value.length = qmin(value.length, (int)sizeof(angles) - 1);
+	    value.start = angles;
 	}
 
-	if (!ED_ParseEpair((void *)&ent->v, key, com_token))
+	if (!ED_ParseEpair((void *)&ent->v, key, value.start, value.length))
 #ifdef NQ_HACK
 	    Host_Error("%s: parse error", __func__);
 #endif
@@ -924,8 +1644,12 @@ ED_ParseEdict(const char *data, edict_t *ent)
 #endif
     }
 
-    if (!init)
+    /* only an empty edict changes its free flag behind ED_Alloc's back */
+    if (!init) {
 	ent->free = true;
+	ed_freestale = true;
+    }
+    ED_Changed(ent);
 
     return data;
 }
@@ -950,27 +1674,34 @@ void
 ED_LoadFromFile(const char *data)
 {
     edict_t *ent;
-    int inhibit;
+    int inhibit, count;
     dfunction_t *func;
+    edtoken_t token;
+    double start, parsetime, spawntime;
 
     ent = NULL;
-    inhibit = 0;
+    inhibit = count = 0;
+    parsetime = spawntime = 0;
     pr_global_struct->time = sv.time;
 
 // parse ents
     while (1) {
 // parse the opening brace
-	data = COM_Parse(data);
+	start = Sys_DoubleTime();
+	data = ED_ParseToken(data, &token);
 	if (!data)
 	    break;
-	if (com_token[0] != '{')
-	    SV_Error("%s: found %s when expecting {", __func__, com_token);
+	if (token.start[0] != '{')
+	    SV_Error("%s: found %.*s when expecting {", __func__,
+		     token.length, token.start);
 
 	if (!ent)
 	    ent = EDICT_NUM(0);
 	else
 	    ent = ED_Alloc();
 	data = ED_ParseEdict(data, ent);
+	count++;
+	parsetime += Sys_DoubleTime() - start;
 
 // remove things from different skill levels or deathmatch
 #ifdef NQ_HACK
@@ -1014,14 +1745,18 @@ ED_LoadFromFile(const char *data)
 	    continue;
 	}
 
+	start = Sys_DoubleTime();
 	pr_global_struct->self = EDICT_TO_PROG(ent);
 	PR_ExecuteProgram(func - pr_functions);
 #if defined(QW_HACK) && defined(SERVERONLY)
 	SV_FlushSignon();
 #endif
+	spawntime += Sys_DoubleTime() - start;
     }
 
     Con_DPrintf("%i entities inhibited\n", inhibit);
+    Con_DPrintf("%i entities parsed in %.1f ms, spawned in %.1f ms\n",
+		count, parsetime * 1000, spawntime * 1000);
 }
 
 
@@ -1093,6 +1828,7 @@ PR_LoadProgs(void)
    SV_Error("progs.dat strings extend past end of file\n");
 #endif
    PR_InitStringTable();
+   pr_randseed = rand();
 
    pr_globaldefs = (ddef_t *)((byte *)progs + progs->ofs_globaldefs);
    pr_fielddefs = (ddef_t *)((byte *)progs + progs->ofs_fielddefs);
@@ -1148,6 +1884,23 @@ PR_LoadProgs(void)
       ((int *)pr_globals)[i] = LittleLong(((int *)pr_globals)[i]);
 #endif
 
+   PR_BuildNameIndexes();
+   ed_strblock = NULL;
+
+   pr_fieldflags = (byte *)Hunk_AllocName(progs->entityfields, "fieldflg");
+   for (i = 0; i < 3; i++) {
+      pr_fieldflags[ED_FIELD(origin) + i] |= FIELD_AREA;
+      pr_fieldflags[ED_FIELD(mins) + i] |= FIELD_AREA;
+      pr_fieldflags[ED_FIELD(maxs) + i] |= FIELD_AREA;
+   }
+   pr_fieldflags[ED_FIELD(solid)] |= FIELD_AREA;
+   ED_ClearFindIndex();
+   ED_ResetFreeList();
+   memset(&ed_allocstats, 0, sizeof(ed_allocstats));
+
+   PR_DecodeProgram();
+   PR_InitProfile();
+
 #if defined(QW_HACK) && defined(SERVERONLY)
    // Zoid, find the spectator functions
    SpectatorConnect = SpectatorThink = SpectatorDisconnect = 0;
@@ -1174,6 +1927,9 @@ PR_Init(void)
     Cmd_AddCommand("edicts", ED_PrintEdicts);
     Cmd_AddCommand("edictcount", ED_Count);
     Cmd_AddCommand("profile", PR_Profile_f);
+    Cmd_AddCommand("pr_strings", PR_Strings_f);
+    Cvar_RegisterVariable(&pr_instrument);
+    Cvar_RegisterVariable(&pr_profile);
 #ifdef NQ_HACK
     Cvar_RegisterVariable(&nomonsters);
     Cvar_RegisterVariable(&gamecfg);
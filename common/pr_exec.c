@@ -18,7 +18,16 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 */
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "common.h"
 #include "console.h"
+#include "cvar.h"
+#include "mathlib.h"
 #include "pr_comp.h"
 #include "progs.h"
 #include "server.h"
@@ -139,6 +148,8 @@ const char *pr_opnames[] = {
     "BITOR"
 };
 
+#define OP_BAD (OP_BITOR + 1)	/* not a valid opcode */
+
 char *PR_GlobalString(int ofs);
 char *PR_GlobalStringNoContents(int ofs);
 
@@ -208,43 +219,353 @@ PR_StackTrace(void)
 }
 
 
+/*
+ * The progs profiler. While pr_profile is set each top level call runs
+ * through the instrumented loop, which counts the opcodes executed, and
+ * every QuakeC function and builtin is timed from entry to exit. A
+ * function's exclusive time leaves out the functions and builtins it
+ * called. A recursive function adds the full time of every level to its
+ * inclusive time.
+ */
+typedef struct {
+    unsigned calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+} prprofile_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t child;		// inclusive time of the calls made so far
+} prprofframe_t;
+
+cvar_t pr_profile = { "pr_profile", "0" };
+
+static qboolean pr_profiling;
+static prprofile_t *pr_funcprofile;	// one per function, builtins included
+static uint64_t pr_opcount[OP_BAD + 1];
+
+/* builtins get a frame too, so allow one between each QuakeC frame */
+static prprofframe_t pr_profstack[MAX_STACK_DEPTH * 2 + 1];
+static int pr_profdepth;
+
+static uint64_t pr_profile_ticks0;
+static double pr_profile_time0;
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define PR_ProfileTicks() ((uint64_t)__rdtsc())
+#else
+#define PR_ProfileTicks() ((uint64_t)(Sys_DoubleTime() * 1e9))
+#endif
+
+static void
+PR_ProfilePush(const dfunction_t *f)
+{
+    prprofframe_t *frame;
+
+    pr_funcprofile[f - pr_functions].calls++;
+    if (pr_profdepth < (int)ARRAY_SIZE(pr_profstack)) {
+	frame = &pr_profstack[pr_profdepth];
+	frame->child = 0;
+	frame->start = PR_ProfileTicks();
+    }
+    pr_profdepth++;
+}
+
+static void
+PR_ProfilePop(const dfunction_t *f)
+{
+    prprofile_t *profile;
+    prprofframe_t *frame;
+    uint64_t elapsed;
+
+    if (pr_profdepth <= 0)
+	return;
+    pr_profdepth--;
+    if (pr_profdepth >= (int)ARRAY_SIZE(pr_profstack))
+	return;
+
+    frame = &pr_profstack[pr_profdepth];
+    elapsed = PR_ProfileTicks() - frame->start;
+    profile = &pr_funcprofile[f - pr_functions];
+    profile->inclusive += elapsed;
+    if (elapsed > frame->child)
+	profile->exclusive += elapsed - frame->child;
+    if (pr_profdepth > 0)
+	pr_profstack[pr_profdepth - 1].child += elapsed;
+}
+
+/*
+============
+PR_InitProfile
+
+Called when new progs are loaded; the old numbers no longer apply
+============
+*/
+void
+PR_InitProfile(void)
+{
+    pr_funcprofile = (prprofile_t *)
+	Hunk_AllocName(progs->numfunctions * sizeof(*pr_funcprofile), "progprof");
+    memset(pr_opcount, 0, sizeof(pr_opcount));
+    pr_profdepth = 0;
+    pr_profile_ticks0 = PR_ProfileTicks();
+    pr_profile_time0 = Sys_DoubleTime();
+}
+
+static double
+PR_ProfileTicksPerMS(void)
+{
+    double seconds = Sys_DoubleTime() - pr_profile_time0;
+    uint64_t ticks = PR_ProfileTicks() - pr_profile_ticks0;
+
+    if (seconds <= 0 || !ticks)
+	return 1e6;
+    return ticks / seconds / 1000.0;
+}
+
+typedef enum {
+    PROFILE_EXCLUSIVE,
+    PROFILE_INCLUSIVE,
+    PROFILE_CALLS,
+    PROFILE_STATEMENTS
+} profilesort_t;
+
+static profilesort_t pr_profilesort;
+
+static int
+PR_ProfileCompare(const void *a, const void *b)
+{
+    const dfunction_t *fa = &pr_functions[*(const int *)a];
+    const dfunction_t *fb = &pr_functions[*(const int *)b];
+    const prprofile_t *pa = &pr_funcprofile[*(const int *)a];
+    const prprofile_t *pb = &pr_funcprofile[*(const int *)b];
+
+    switch (pr_profilesort) {
+    case PROFILE_INCLUSIVE:
+	return (pa->inclusive < pb->inclusive) - (pa->inclusive > pb->inclusive);
+    case PROFILE_CALLS:
+	return (pa->calls < pb->calls) - (pa->calls > pb->calls);
+    case PROFILE_STATEMENTS:
+	return (fa->profile < fb->profile) - (fa->profile > fb->profile);
+    default:
+	return (pa->exclusive < pb->exclusive) - (pa->exclusive > pb->exclusive);
+    }
+}
+
+/*
+ * Fills in the numbers of the functions with anything recorded against
+ * them, sorted by the given key. The caller frees the list.
+ */
+static int *
+PR_ProfileSorted(profilesort_t sort, int *count)
+{
+    const prprofile_t *profile;
+    int *list;
+    int i;
+
+    *count = 0;
+    list = (int *)malloc(progs->numfunctions * sizeof(*list));
+    if (!list)
+	return NULL;
+    for (i = 0; i < progs->numfunctions; i++) {
+	profile = &pr_funcprofile[i];
+	if (profile->calls || pr_functions[i].profile)
+	    list[(*count)++] = i;
+    }
+    pr_profilesort = sort;
+    qsort(list, *count, sizeof(*list), PR_ProfileCompare);
+
+    return list;
+}
+
+static void
+PR_ProfileReset(void)
+{
+    int i;
+
+    for (i = 0; i < progs->numfunctions; i++)
+	pr_functions[i].profile = 0;
+    memset(pr_funcprofile, 0, progs->numfunctions * sizeof(*pr_funcprofile));
+    memset(pr_opcount, 0, sizeof(pr_opcount));
+    pr_profile_ticks0 = PR_ProfileTicks();
+    pr_profile_time0 = Sys_DoubleTime();
+}
+
+static void
+PR_ProfileOpcodes(void)
+{
+    uint64_t total, count;
+    int order[OP_BAD + 1];
+    int i, j, op;
+
+    total = 0;
+    for (i = 0; i <= OP_BAD; i++) {
+	total += pr_opcount[i];
+	order[i] = i;
+    }
+    if (!total) {
+	Con_Printf("No opcodes counted, set pr_profile 1\n");
+	return;
+    }
+
+    /* insertion sort, the table is tiny */
+    for (i = 1; i <= OP_BAD; i++) {
+	op = order[i];
+	for (j = i; j > 0 && pr_opcount[order[j - 1]] < pr_opcount[op]; j--)
+	    order[j] = order[j - 1];
+	order[j] = op;
+    }
+
+    Con_Printf("       count      %%  opcode\n");
+    for (i = 0; i <= OP_BAD; i++) {
+	op = order[i];
+	count = pr_opcount[op];
+	if (!count)
+	    break;
+	Con_Printf("%12llu %5.1f%%  %s\n", (unsigned long long)count,
+		   count * 100.0 / total, op < OP_BAD ? pr_opnames[op] : "(bad)");
+    }
+}
+
+static void
+PR_ProfileDump(const char *filename)
+{
+    char path[MAX_OSPATH];
+    const dfunction_t *f;
+    const prprofile_t *profile;
+    double ticksperms;
+    int *list;
+    int count, i;
+    FILE *file;
+
+    if (strstr(filename, "..")) {
+	Con_Printf("Relative pathnames are not allowed.\n");
+	return;
+    }
+    if (snprintf(path, sizeof(path) - 4, "%s/%s", com_gamedir, filename)
+	>= (int)sizeof(path) - 4) {
+	Con_Printf("Filename too long.\n");
+	return;
+    }
+    COM_DefaultExtension(path, ".tsv");
+
+    list = PR_ProfileSorted(PROFILE_EXCLUSIVE, &count);
+    if (!list)
+	return;
+    file = fopen(path, "w");
+    if (!file) {
+	Con_Printf("ERROR: couldn't open %s\n", path);
+	free(list);
+	return;
+    }
+
+    ticksperms = PR_ProfileTicksPerMS();
+    fprintf(file, "function\tfile\tbuiltin\tcalls\tstatements\tinclusive_ms\texclusive_ms\n");
+    for (i = 0; i < count; i++) {
+	f = &pr_functions[list[i]];
+	profile = &pr_funcprofile[list[i]];
+	fprintf(file, "%s\t%s\t%d\t%u\t%d\t%.4f\t%.4f\n",
+		PR_GetString(f->s_name), PR_GetString(f->s_file),
+		f->first_statement < 0, profile->calls, f->profile,
+		profile->inclusive / ticksperms,
+		profile->exclusive / ticksperms);
+    }
+    fprintf(file, "\nopcode\tcount\n");
+    for (i = 0; i <= OP_BAD; i++) {
+	if (pr_opcount[i])
+	    fprintf(file, "%s\t%llu\n", i < OP_BAD ? pr_opnames[i] : "(bad)",
+		    (unsigned long long)pr_opcount[i]);
+    }
+    fclose(file);
+    free(list);
+
+    Con_Printf("Wrote profile of %d functions to %s\n", count, path);
+}
+
 /*
 ============
 PR_Profile_f
 
+profile [excl|incl|calls|stmts [count]] : list the busiest functions
+profile ops : list the opcode mix
+profile dump <file> : write everything out as tab separated values
+profile reset : clear the numbers
 ============
 */
 void
 PR_Profile_f(void)
 {
-    dfunction_t *f, *best;
-    int max;
-    int num;
-    int i;
+    static const char *const sortnames[] = {
+	"excl", "incl", "calls", "stmts"
+    };
+    const dfunction_t *f;
+    const prprofile_t *profile;
+    profilesort_t sort;
+    uint64_t total;
+    double ticksperms;
+    const char *arg;
+    int *list;
+    int count, max, i;
 
     // FIXME - progs get unloaded? if so, check that progs gets zero'd
     if (!progs)
 	return;
 
-    num = 0;
-    do {
-	max = 0;
-	best = NULL;
-	for (i = 0; i < progs->numfunctions; i++) {
-	    f = &pr_functions[i];
-	    if (f->profile > max) {
-		max = f->profile;
-		best = f;
-	    }
+    arg = Cmd_Argc() > 1 ? Cmd_Argv(1) : "";
+    if (!strcmp(arg, "reset")) {
+	PR_ProfileReset();
+	return;
+    }
+    if (!strcmp(arg, "ops")) {
+	PR_ProfileOpcodes();
+	return;
+    }
+    if (!strcmp(arg, "dump")) {
+	if (Cmd_Argc() != 3) {
+	    Con_Printf("profile dump <file> : write the profile to a file\n");
+	    return;
 	}
-	if (best) {
-	    if (num < 10)
-		Con_Printf("%7i %s\n", best->profile,
-			   PR_GetString(best->s_name));
-	    num++;
-	    best->profile = 0;
+	PR_ProfileDump(Cmd_Argv(2));
+	return;
+    }
+
+    /* without timings, fall back to the statement counts */
+    total = 0;
+    for (i = 0; i < progs->numfunctions; i++)
+	total += pr_funcprofile[i].exclusive;
+    sort = total ? PROFILE_EXCLUSIVE : PROFILE_STATEMENTS;
+    if (*arg) {
+	for (i = 0; i < (int)ARRAY_SIZE(sortnames); i++)
+	    if (!strcmp(arg, sortnames[i]))
+		break;
+	if (i == (int)ARRAY_SIZE(sortnames)) {
+	    Con_Printf("usage: profile [excl|incl|calls|stmts [count]]\n"
+		       "       profile ops | reset | dump <file>\n");
+	    return;
 	}
-    } while (best);
+	sort = (profilesort_t)i;
+    }
+    max = Cmd_Argc() > 2 ? Q_atoi(Cmd_Argv(2)) : 10;
+
+    list = PR_ProfileSorted(sort, &count);
+    if (!list)
+	return;
+
+    ticksperms = PR_ProfileTicksPerMS();
+    Con_Printf("  calls   incl ms   excl ms  excl%%      stmts  function\n");
+    for (i = 0; i < count && i < max; i++) {
+	f = &pr_functions[list[i]];
+	profile = &pr_funcprofile[list[i]];
+	Con_Printf("%7u %9.2f %9.2f %5.1f%% %10i  %s%s\n", profile->calls,
+		   profile->inclusive / ticksperms,
+		   profile->exclusive / ticksperms,
+		   total ? profile->exclusive * 100.0 / total : 0.0,
+		   f->profile, PR_GetString(f->s_name),
+		   f->first_statement < 0 ? " (builtin)" : "");
+    }
+    Con_Printf("%d functions, %.2f ms total\n", count, total / ticksperms);
+    free(list);
 }
 
 
@@ -327,6 +648,8 @@ PR_EnterFunction(dfunction_t *f)
     }
 
     pr_xfunction = f;
+    if (pr_profiling)
+	PR_ProfilePush(f);
     return f->first_statement - 1;	// offset the s++
 }
 
@@ -348,6 +671,9 @@ PR_LeaveFunction(void)
 	SV_Error("prog stack underflow");
 #endif
 
+    if (pr_profiling)
+	PR_ProfilePop(pr_xfunction);
+
 // restore locals from the stack
     c = pr_xfunction->locals;
     localstack_used -= c;
@@ -365,44 +691,110 @@ PR_LeaveFunction(void)
 }
 
 
+/*
+ * Progs run through one of two copies of the interpreter loop. The plain
+ * one (PR_ExecuteInstrumented) works straight from pr_statements, and keeps
+ * the per-function statement counts and the traceon output. The default
+ * one (PR_ExecuteDecoded) works from pr_code, a copy of the statements
+ * decoded once at load with the operand pointers already resolved. It
+ * dispatches through a table of labels where the compiler allows, and
+ * charges the runaway limit with a whole run of statements at a time, on
+ * taken branches, calls and returns. Both count every statement, so a
+ * progs hits the limit at the same point either way. It hands over to the
+ * instrumented loop as soon as a traceon builtin is called.
+ */
+typedef struct {
+    int op;
+    int jump;			/* branch offset for IF, IFNOT and GOTO */
+    eval_t *a, *b, *c;
+} prinstr_t;
+
+#if defined(__GNUC__)
+#define PR_THREADED_DISPATCH
+#endif
+
+cvar_t pr_instrument = { "pr_instrument", "0" };
+
+static prinstr_t *pr_code;
+
+#define PR_RUNAWAY 1000000
+
+/*
+ * Take count statements off the runaway limit; returns what is left.
+ * Warns at every 5000 statements within the last 50000.
+ */
+static int
+PR_ChargeRunaway(int runaway, int count, int statement)
+{
+    int left = runaway - count;
+    int mark = qmin(runaway - 1, 50000) / 5000 * 5000;
+
+    if (left <= 0) {
+	pr_xstatement = statement;
+	PR_RunError("runaway loop error");
+    }
+    if (mark > 0 && mark >= left)
+	Con_DPrintf("progs execution running away (%i left)\n", left);
+
+    return left;
+}
+
 /*
 ====================
-PR_ExecuteProgram
+PR_DecodeProgram
+
+Translates the loaded statements into pr_code
 ====================
 */
 void
-PR_ExecuteProgram(func_t fnum)
+PR_DecodeProgram(void)
 {
-    eval_t *a, *b, *c;
-    int s;
-    dstatement_t *st;
-    dfunction_t *f, *newf;
-    int runaway;
+    const dstatement_t *st;
+    prinstr_t *in;
     int i;
-    edict_t *ed;
-    int exitdepth;
-    eval_t *ptr;
 
-    if (!fnum || fnum >= progs->numfunctions) {
-	if (pr_global_struct->self)
-	    ED_Print(PROG_TO_EDICT(pr_global_struct->self));
-#ifdef NQ_HACK
-	Host_Error("PR_ExecuteProgram: NULL function");
-#endif
-#ifdef QW_HACK
-	SV_Error("PR_ExecuteProgram: NULL function");
-#endif
+    pr_code = (prinstr_t *)Hunk_AllocName(progs->numstatements * sizeof(*pr_code),
+					  "progcode");
+    st = pr_statements;
+    in = pr_code;
+    for (i = 0; i < progs->numstatements; i++, st++, in++) {
+	in->op = (st->op < OP_BAD) ? st->op : OP_BAD;
+	in->a = (eval_t *)&pr_globals[st->a];
+	in->b = (eval_t *)&pr_globals[st->b];
+	in->c = (eval_t *)&pr_globals[st->c];
+	if (st->op == OP_IF || st->op == OP_IFNOT)
+	    in->jump = st->b;
+	else if (st->op == OP_GOTO)
+	    in->jump = st->a;
     }
+}
 
-    f = &pr_functions[fnum];
-
-    runaway = 1000000;
-    pr_trace = false;
+/*
+ * A field store through a pointer from OP_ADDRESS. The edict is marked
+ * once the value has landed; marking it when the address is taken would
+ * let the right hand side (a find() or a relink, say) consume the mark
+ * before the store.
+ */
+static inline void
+PR_FieldStored(int ptrofs)
+{
+    int num = ptrofs / pr_edict_size;
+    int field = (ptrofs - num * pr_edict_size - (int)offsetof(edict_t, v)) >> 2;
 
-// make a stack frame
-    exitdepth = pr_depth;
+    if ((unsigned)field < (unsigned)progs->entityfields && pr_fieldflags[field])
+	ED_FieldWritten((edict_t *)((byte *)sv.edicts + num * pr_edict_size),
+			field);
+}
 
-    s = PR_EnterFunction(f);
+static void
+PR_ExecuteInstrumented(int s, int exitdepth, int runaway)
+{
+    eval_t *a, *b, *c;
+    dstatement_t *st;
+    dfunction_t *newf;
+    int i;
+    edict_t *ed;
+    eval_t *ptr;
 
     while (1) {
 	s++;			// next statement
@@ -412,14 +804,12 @@ PR_ExecuteProgram(func_t fnum)
 	b = (eval_t *)&pr_globals[st->b];
 	c = (eval_t *)&pr_globals[st->c];
 
-	if (!--runaway)
-	    PR_RunError("runaway loop error");
-	if (runaway <= 50000 && !(runaway % 5000))
-	    Con_DPrintf("%s: progs execution running away (%i left)\n",
-			__func__, runaway);
+	runaway = PR_ChargeRunaway(runaway, 1, s);
 
 	pr_xfunction->profile++;
 	pr_xstatement = s;
+	if (pr_profiling)
+	    pr_opcount[st->op < OP_BAD ? st->op : OP_BAD]++;
 
 	if (pr_trace)
 	    PR_PrintStatement(st);
@@ -569,12 +959,14 @@ PR_ExecuteProgram(func_t fnum)
 	case OP_STOREP_FNC:	// pointers
 	    ptr = (eval_t *)((byte *)sv.edicts + b->_int);
 	    ptr->_int = a->_int;
+	    PR_FieldStored(b->_int);
 	    break;
 	case OP_STOREP_V:
 	    ptr = (eval_t *)((byte *)sv.edicts + b->_int);
 	    ptr->vector[0] = a->vector[0];
 	    ptr->vector[1] = a->vector[1];
 	    ptr->vector[2] = a->vector[2];
+	    PR_FieldStored(b->_int);
 	    break;
 
 	case OP_ADDRESS:
@@ -647,7 +1039,13 @@ PR_ExecuteProgram(func_t fnum)
 		i = -newf->first_statement;
 		if (i >= pr_numbuiltins)
 		    PR_RunError("Bad builtin call number");
-		pr_builtins[i] ();
+		if (pr_profiling) {
+		    PR_ProfilePush(newf);
+		    pr_builtins[i] ();
+		    PR_ProfilePop(newf);
+		} else {
+		    pr_builtins[i] ();
+		}
 		break;
 	    }
 
@@ -680,22 +1078,463 @@ PR_ExecuteProgram(func_t fnum)
     }
 }
 
+static void
+PR_ExecuteDecoded(int s, int exitdepth)
+{
+    const prinstr_t *ip, *blockstart;
+    eval_t *a, *b, *c, *ptr;
+    dfunction_t *newf;
+    edict_t *ed;
+    int i;
+    int runaway = PR_RUNAWAY;
+
+#ifdef PR_THREADED_DISPATCH
+    static const void *const dispatch[OP_BAD + 1] = {
+	&&op_DONE,
+	&&op_MUL_F, &&op_MUL_V, &&op_MUL_FV, &&op_MUL_VF,
+	&&op_DIV_F,
+	&&op_ADD_F, &&op_ADD_V,
+	&&op_SUB_F, &&op_SUB_V,
+	&&op_EQ_F, &&op_EQ_V, &&op_EQ_S, &&op_EQ_E, &&op_EQ_FNC,
+	&&op_NE_F, &&op_NE_V, &&op_NE_S, &&op_NE_E, &&op_NE_FNC,
+	&&op_LE, &&op_GE, &&op_LT, &&op_GT,
+	&&op_LOAD_F, &&op_LOAD_V, &&op_LOAD_S, &&op_LOAD_ENT, &&op_LOAD_FLD,
+	&&op_LOAD_FNC,
+	&&op_ADDRESS,
+	&&op_STORE_F, &&op_STORE_V, &&op_STORE_S, &&op_STORE_ENT,
+	&&op_STORE_FLD, &&op_STORE_FNC,
+	&&op_STOREP_F, &&op_STOREP_V, &&op_STOREP_S, &&op_STOREP_ENT,
+	&&op_STOREP_FLD, &&op_STOREP_FNC,
+	&&op_RETURN,
+	&&op_NOT_F, &&op_NOT_V, &&op_NOT_S, &&op_NOT_ENT, &&op_NOT_FNC,
+	&&op_IF, &&op_IFNOT,
+	&&op_CALL0, &&op_CALL1, &&op_CALL2, &&op_CALL3, &&op_CALL4,
+	&&op_CALL5, &&op_CALL6, &&op_CALL7, &&op_CALL8,
+	&&op_STATE,
+	&&op_GOTO,
+	&&op_AND, &&op_OR,
+	&&op_BITAND, &&op_BITOR,
+	&&op_BAD
+    };
+#define PR_OP(name) op_##name:
+#define PR_NEXT() \
+    do { ip++; a = ip->a; b = ip->b; c = ip->c; goto *dispatch[ip->op]; } while (0)
+#else
+#define PR_OP(name) case OP_##name:
+#define PR_NEXT() continue
+#endif
+
+/* statements run since the last charge, up to and including ip */
+#define PR_CHARGE() \
+    runaway = PR_ChargeRunaway(runaway, ip - blockstart + 1, ip - pr_code)
+
+    ip = pr_code + s;
+    blockstart = ip + 1;
+
+#ifdef PR_THREADED_DISPATCH
+    PR_NEXT();
+    {
+#else
+    while (1) {
+	ip++;
+	a = ip->a;
+	b = ip->b;
+	c = ip->c;
+
+	switch (ip->op) {
+#endif
+	PR_OP(ADD_F)
+	    c->_float = a->_float + b->_float;
+	    PR_NEXT();
+	PR_OP(ADD_V)
+	    c->vector[0] = a->vector[0] + b->vector[0];
+	    c->vector[1] = a->vector[1] + b->vector[1];
+	    c->vector[2] = a->vector[2] + b->vector[2];
+	    PR_NEXT();
+
+	PR_OP(SUB_F)
+	    c->_float = a->_float - b->_float;
+	    PR_NEXT();
+	PR_OP(SUB_V)
+	    c->vector[0] = a->vector[0] - b->vector[0];
+	    c->vector[1] = a->vector[1] - b->vector[1];
+	    c->vector[2] = a->vector[2] - b->vector[2];
+	    PR_NEXT();
+
+	PR_OP(MUL_F)
+	    c->_float = a->_float * b->_float;
+	    PR_NEXT();
+	PR_OP(MUL_V)
+	    c->_float = a->vector[0] * b->vector[0]
+		+ a->vector[1] * b->vector[1]
+		+ a->vector[2] * b->vector[2];
+	    PR_NEXT();
+	PR_OP(MUL_FV)
+	    c->vector[0] = a->_float * b->vector[0];
+	    c->vector[1] = a->_float * b->vector[1];
+	    c->vector[2] = a->_float * b->vector[2];
+	    PR_NEXT();
+	PR_OP(MUL_VF)
+	    c->vector[0] = b->_float * a->vector[0];
+	    c->vector[1] = b->_float * a->vector[1];
+	    c->vector[2] = b->_float * a->vector[2];
+	    PR_NEXT();
+
+	PR_OP(DIV_F)
+	    c->_float = a->_float / b->_float;
+	    PR_NEXT();
+
+	PR_OP(BITAND)
+	    c->_float = (int)a->_float & (int)b->_float;
+	    PR_NEXT();
+	PR_OP(BITOR)
+	    c->_float = (int)a->_float | (int)b->_float;
+	    PR_NEXT();
+
+	PR_OP(GE)
+	    c->_float = a->_float >= b->_float;
+	    PR_NEXT();
+	PR_OP(LE)
+	    c->_float = a->_float <= b->_float;
+	    PR_NEXT();
+	PR_OP(GT)
+	    c->_float = a->_float > b->_float;
+	    PR_NEXT();
+	PR_OP(LT)
+	    c->_float = a->_float < b->_float;
+	    PR_NEXT();
+	PR_OP(AND)
+	    c->_float = a->_float && b->_float;
+	    PR_NEXT();
+	PR_OP(OR)
+	    c->_float = a->_float || b->_float;
+	    PR_NEXT();
+
+	PR_OP(NOT_F)
+	    c->_float = !a->_float;
+	    PR_NEXT();
+	PR_OP(NOT_V)
+	    c->_float = !a->vector[0] && !a->vector[1] && !a->vector[2];
+	    PR_NEXT();
+	PR_OP(NOT_S)
+	    c->_float = !a->string || !*PR_GetString(a->string);
+	    PR_NEXT();
+	PR_OP(NOT_FNC)
+	    c->_float = !a->function;
+	    PR_NEXT();
+	PR_OP(NOT_ENT)
+	    c->_float = (PROG_TO_EDICT(a->edict) == sv.edicts);
+	    PR_NEXT();
+
+	PR_OP(EQ_F)
+	    c->_float = a->_float == b->_float;
+	    PR_NEXT();
+	PR_OP(EQ_V)
+	    c->_float = (a->vector[0] == b->vector[0]) &&
+		(a->vector[1] == b->vector[1]) &&
+		(a->vector[2] == b->vector[2]);
+	    PR_NEXT();
+	PR_OP(EQ_S)
+	    c->_float =
+		!strcmp(PR_GetString(a->string), PR_GetString(b->string));
+	    PR_NEXT();
+	PR_OP(EQ_E)
+	    c->_float = a->_int == b->_int;
+	    PR_NEXT();
+	PR_OP(EQ_FNC)
+	    c->_float = a->function == b->function;
+	    PR_NEXT();
+
+	PR_OP(NE_F)
+	    c->_float = a->_float != b->_float;
+	    PR_NEXT();
+	PR_OP(NE_V)
+	    c->_float = (a->vector[0] != b->vector[0]) ||
+		(a->vector[1] != b->vector[1]) ||
+		(a->vector[2] != b->vector[2]);
+	    PR_NEXT();
+	PR_OP(NE_S)
+	    c->_float =
+		strcmp(PR_GetString(a->string), PR_GetString(b->string));
+	    PR_NEXT();
+	PR_OP(NE_E)
+	    c->_float = a->_int != b->_int;
+	    PR_NEXT();
+	PR_OP(NE_FNC)
+	    c->_float = a->function != b->function;
+	    PR_NEXT();
+
+//==================
+	PR_OP(STORE_F)
+	PR_OP(STORE_ENT)
+	PR_OP(STORE_FLD)	// integers
+	PR_OP(STORE_S)
+	PR_OP(STORE_FNC)	// pointers
+	    b->_int = a->_int;
+	    PR_NEXT();
+	PR_OP(STORE_V)
+	    b->vector[0] = a->vector[0];
+	    b->vector[1] = a->vector[1];
+	    b->vector[2] = a->vector[2];
+	    PR_NEXT();
+
+	PR_OP(STOREP_F)
+	PR_OP(STOREP_ENT)
+	PR_OP(STOREP_FLD)	// integers
+	PR_OP(STOREP_S)
+	PR_OP(STOREP_FNC)	// pointers
+	    ptr = (eval_t *)((byte *)sv.edicts + b->_int);
+	    ptr->_int = a->_int;
+	    PR_FieldStored(b->_int);
+	    PR_NEXT();
+	PR_OP(STOREP_V)
+	    ptr = (eval_t *)((byte *)sv.edicts + b->_int);
+	    ptr->vector[0] = a->vector[0];
+	    ptr->vector[1] = a->vector[1];
+	    ptr->vector[2] = a->vector[2];
+	    PR_FieldStored(b->_int);
+	    PR_NEXT();
+
+	PR_OP(ADDRESS)
+	    ed = PROG_TO_EDICT(a->edict);
+#ifdef PARANOID
+	    NUM_FOR_EDICT(ed);	// make sure it's in range
+#endif
+	    if (ed == (edict_t *)sv.edicts && sv.state == ss_active) {
+		pr_xstatement = ip - pr_code;
+		PR_RunError("assignment to world entity");
+	    }
+	    c->_int = (byte *)((int *)&ed->v + b->_int) - (byte *)sv.edicts;
+	    PR_NEXT();
+
+	PR_OP(LOAD_F)
+	PR_OP(LOAD_FLD)
+	PR_OP(LOAD_ENT)
+	PR_OP(LOAD_S)
+	PR_OP(LOAD_FNC)
+	    ed = PROG_TO_EDICT(a->edict);
+#ifdef PARANOID
+	    NUM_FOR_EDICT(ed);	// make sure it's in range
+#endif
+	    a = (eval_t *)((int *)&ed->v + b->_int);
+	    c->_int = a->_int;
+	    PR_NEXT();
+
+	PR_OP(LOAD_V)
+	    ed = PROG_TO_EDICT(a->edict);
+#ifdef PARANOID
+	    NUM_FOR_EDICT(ed);	// make sure it's in range
+#endif
+	    a = (eval_t *)((int *)&ed->v + b->_int);
+	    c->vector[0] = a->vector[0];
+	    c->vector[1] = a->vector[1];
+	    c->vector[2] = a->vector[2];
+	    PR_NEXT();
+
+//==================
+
+	PR_OP(IFNOT)
+	    if (!a->_int)
+		goto branch;
+	    PR_NEXT();
+
+	PR_OP(IF)
+	    if (a->_int)
+		goto branch;
+	    PR_NEXT();
+
+	PR_OP(GOTO)
+	branch:
+	    PR_CHARGE();
+	    ip += ip->jump - 1;	// offset the ip++
+	    blockstart = ip + 1;
+	    PR_NEXT();
+
+	PR_OP(CALL0)
+	PR_OP(CALL1)
+	PR_OP(CALL2)
+	PR_OP(CALL3)
+	PR_OP(CALL4)
+	PR_OP(CALL5)
+	PR_OP(CALL6)
+	PR_OP(CALL7)
+	PR_OP(CALL8)
+	    pr_argc = ip->op - OP_CALL0;
+	    pr_xstatement = ip - pr_code;
+	    if (!a->function)
+		PR_RunError("NULL function");
+
+	    newf = &pr_functions[a->function];
+
+	    /* negative statements are built in functions */
+	    if (newf->first_statement < 0) {
+		i = -newf->first_statement;
+		if (i >= pr_numbuiltins)
+		    PR_RunError("Bad builtin call number");
+		pr_builtins[i] ();
+		if (pr_trace) {
+		    PR_CHARGE();
+		    PR_ExecuteInstrumented(ip - pr_code, exitdepth, runaway);
+		    return;
+		}
+		PR_NEXT();
+	    }
+
+	    PR_CHARGE();
+	    ip = pr_code + PR_EnterFunction(newf);
+	    blockstart = ip + 1;
+	    PR_NEXT();
+
+	PR_OP(DONE)
+	PR_OP(RETURN)
+	    pr_globals[OFS_RETURN] = a->vector[0];
+	    pr_globals[OFS_RETURN + 1] = a->vector[1];
+	    pr_globals[OFS_RETURN + 2] = a->vector[2];
+
+	    PR_CHARGE();
+	    ip = pr_code + PR_LeaveFunction();
+	    if (pr_depth == exitdepth)
+		return;		// all done
+	    blockstart = ip + 1;
+	    PR_NEXT();
+
+	PR_OP(STATE)
+	    ed = PROG_TO_EDICT(pr_global_struct->self);
+	    ed->v.nextthink = pr_global_struct->time + 0.1;
+	    if (a->_float != ed->v.frame) {
+		ed->v.frame = a->_float;
+	    }
+	    ed->v.think = b->function;
+	    PR_NEXT();
+
+	PR_OP(BAD)
+#ifndef PR_THREADED_DISPATCH
+	default:
+#endif
+	    pr_xstatement = ip - pr_code;
+	    PR_RunError("Bad opcode %i", pr_statements[pr_xstatement].op);
+	    return;
+#ifndef PR_THREADED_DISPATCH
+	}
+#endif
+    }
+
+#undef PR_OP
+#undef PR_NEXT
+#undef PR_CHARGE
+}
+
+/*
+====================
+PR_ExecuteProgram
+====================
+*/
+void
+PR_ExecuteProgram(func_t fnum)
+{
+    dfunction_t *f;
+    int exitdepth;
+    int s;
+
+    if (!fnum || fnum >= progs->numfunctions) {
+	if (pr_global_struct->self)
+	    ED_Print(PROG_TO_EDICT(pr_global_struct->self));
+#ifdef NQ_HACK
+	Host_Error("PR_ExecuteProgram: NULL function");
+#endif
+#ifdef QW_HACK
+	SV_Error("PR_ExecuteProgram: NULL function");
+#endif
+    }
+
+    f = &pr_functions[fnum];
+
+    pr_trace = false;
+
+    /* only start or stop profiling between top level calls */
+    if (!pr_depth) {
+	pr_profiling = pr_profile.value && pr_funcprofile;
+	pr_profdepth = 0;
+    }
+
+// make a stack frame
+    exitdepth = pr_depth;
+
+    s = PR_EnterFunction(f);
+
+    if (pr_instrument.value || pr_profiling || !pr_code)
+	PR_ExecuteInstrumented(s, exitdepth, PR_RUNAWAY);
+    else
+	PR_ExecuteDecoded(s, exitdepth);
+}
+
 /*----------------------*/
 
-#define PR_STRTBL_CHUNK 256
-static const char **pr_strtbl = NULL;
-static int pr_strtbl_size;
+/*
+ * Strings the engine hands to progs are numbered from -1 downwards. The
+ * table is kept in fixed size chunks which never move once allocated, and
+ * an open addressed hash keyed on the string's address finds the number
+ * already given to a string. If the table holds the same pointer more than
+ * once (see PR_LoadStrings), the hash gives the lowest number, as the
+ * linear search it replaces did.
+ */
+#define PR_STRTBL_CHUNK		256	// entries per chunk, power of two
+#define PR_STRTBL_MAXCHUNKS	4096
+#define PR_STRHASH_MINSIZE	1024	// power of two
+
+static const char **pr_strtbl[PR_STRTBL_MAXCHUNKS];
+static int pr_strtbl_chunks;
 static int num_prstr;
 
+static int *pr_strhash;		// table index + 1, or 0 for an empty slot
+static int pr_strhash_size;
+
+static struct {
+    uint64_t lookups;
+    uint64_t found;
+    uint64_t collisions;	// hash slots passed over by lookups
+} pr_strstats;
+
+#define PR_STRTBL(i) \
+    (pr_strtbl[(i) / PR_STRTBL_CHUNK][(i) & (PR_STRTBL_CHUNK - 1)])
+
+/*
+ * Private copies of strings restored from snapshots, shared by content.
+ * A hash on the contents finds the copy already made for a string.
+ */
+static char **pr_strpool;
+static int pr_strpool_size;
+static int num_prstrpool;
+
+static int *pr_strpoolhash;	// pool index + 1, or 0 for an empty slot
+static int pr_strpoolhash_size;
+
 void
 PR_InitStringTable(void)
 {
-    if (pr_strtbl) {
-	Z_Free(pr_strtbl);
-	pr_strtbl = NULL;
+    int i;
+
+    for (i = 0; i < pr_strtbl_chunks; i++) {
+	free(pr_strtbl[i]);
+	pr_strtbl[i] = NULL;
     }
-    pr_strtbl_size = 0;
+    pr_strtbl_chunks = 0;
     num_prstr = 0;
+
+    free(pr_strhash);
+    pr_strhash = NULL;
+    pr_strhash_size = 0;
+
+    for (i = 0; i < num_prstrpool; i++)
+	free(pr_strpool[i]);
+    free(pr_strpool);
+    pr_strpool = NULL;
+    pr_strpool_size = 0;
+    num_prstrpool = 0;
+
+    free(pr_strpoolhash);
+    pr_strpoolhash = NULL;
+    pr_strpoolhash_size = 0;
 }
 
 const char *
@@ -706,7 +1545,7 @@ PR_GetString(int num)
     if (num >= 0 && num < pr_strings_size - 1)
 	s = pr_strings + num;
     else if (num < 0 && num >= -num_prstr)
-	s = pr_strtbl[-num - 1];
+	s = PR_STRTBL(-num - 1);
     else
 #ifdef NQ_HACK
 	Host_Error("%s: invalid string offset %d (%d to %d valid)\n",
@@ -720,24 +1559,352 @@ PR_GetString(int num)
     return s;
 }
 
+qboolean
+PR_ValidString(int num)
+{
+    return (num >= 0 && num < pr_strings_size - 1)
+	|| (num < 0 && num >= -num_prstr);
+}
+
+/*
+ * Make sure the table has room for count entries. Sys_Error may return
+ * (as it does in the libretro core), so failures are returned as well.
+ */
+static qboolean
+PR_ReserveStrings(int count)
+{
+    while (count > pr_strtbl_chunks * PR_STRTBL_CHUNK) {
+	if (pr_strtbl_chunks == PR_STRTBL_MAXCHUNKS) {
+	    Sys_Error("%s: string table full (%d entries)", __func__,
+		      PR_STRTBL_MAXCHUNKS * PR_STRTBL_CHUNK);
+	    return false;
+	}
+	pr_strtbl[pr_strtbl_chunks] =
+	    malloc(PR_STRTBL_CHUNK * sizeof(pr_strtbl[0][0]));
+	if (!pr_strtbl[pr_strtbl_chunks]) {
+	    Sys_Error("%s: out of memory", __func__);
+	    return false;
+	}
+	pr_strtbl_chunks++;
+    }
+
+    return true;
+}
+
+static inline unsigned
+PR_StringHash(const char *s)
+{
+    return (unsigned)(((uint64_t)(uintptr_t)s * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+/*
+ * Returns the hash slot holding s, or the empty slot where it belongs
+ */
+static int *
+PR_StringSlot(const char *s)
+{
+    unsigned mask = pr_strhash_size - 1;
+    unsigned slot = PR_StringHash(s) & mask;
+
+    while (pr_strhash[slot] && PR_STRTBL(pr_strhash[slot] - 1) != s) {
+	pr_strstats.collisions++;
+	slot = (slot + 1) & mask;
+    }
+
+    return &pr_strhash[slot];
+}
+
+/*
+ * Rebuild the hash with enough room for the table to grow to count
+ * entries while staying at most half full. If that fails the old hash
+ * is left as it was.
+ */
+static qboolean
+PR_RehashStrings(int count)
+{
+    uint64_t collisions = pr_strstats.collisions;
+    int i, size, *slot, *hash;
+
+    size = qmax(pr_strhash_size, PR_STRHASH_MINSIZE);
+    while (size <= count * 2)
+	size *= 2;
+
+    hash = calloc(size, sizeof(pr_strhash[0]));
+    if (!hash) {
+	Sys_Error("%s: out of memory", __func__);
+	return false;
+    }
+    free(pr_strhash);
+    pr_strhash = hash;
+    pr_strhash_size = size;
+
+    for (i = 0; i < num_prstr; i++) {
+	slot = PR_StringSlot(PR_STRTBL(i));
+	if (!*slot)
+	    *slot = i + 1;
+    }
+    pr_strstats.collisions = collisions;
+
+    return true;
+}
+
+/*
+ * Engine buffers which are rewritten in place, like the result of ftos or
+ * a player's name. What their string_t reads changes without a store to
+ * any field, so find() can't index them (see ED_UpdateFindIndex).
+ */
+#define PR_MAX_TEMPSTRINGS	64
+
+static const char *pr_tempstrings[PR_MAX_TEMPSTRINGS];
+static int num_prtempstrings;
+
+qboolean
+PR_TempString(int num)
+{
+    const char *s;
+    int i;
+
+    if (num >= 0 || num < -num_prstr)
+	return false;
+    s = PR_STRTBL(-num - 1);
+    for (i = 0; i < num_prtempstrings; i++)
+	if (pr_tempstrings[i] == s)
+	    return true;
+    return false;
+}
+
+/*
+============
+PR_SetTempString
+
+PR_SetString for a buffer the engine will reuse
+============
+*/
 int
-PR_SetString(const char *s)
+PR_SetTempString(const char *s)
 {
     int i;
 
+    for (i = 0; i < num_prtempstrings; i++)
+	if (pr_tempstrings[i] == s)
+	    break;
+    if (i == num_prtempstrings) {
+	if (num_prtempstrings == PR_MAX_TEMPSTRINGS)
+	    Sys_Error("%s: too many buffers", __func__);
+	else
+	    pr_tempstrings[num_prtempstrings++] = s;
+    }
+
+    return PR_SetString(s);
+}
+
+/*
+ * Strings that don't fit in the table any more come out as the empty
+ * string, once the error has been reported.
+ */
+int
+PR_SetString(const char *s)
+{
+    int *slot;
+
     if (s - pr_strings < 0 || s - pr_strings > pr_strings_size - 2) {
-	for (i = 0; i < num_prstr; i++)
-	    if (pr_strtbl[i] == s)
-		break;
-	if (i < num_prstr)
-	    return -i - 1;
-	if (num_prstr == pr_strtbl_size) {
-	    pr_strtbl_size += PR_STRTBL_CHUNK;
-	    pr_strtbl = (const char**)Z_Realloc(pr_strtbl, pr_strtbl_size * sizeof(char *));
+	pr_strstats.lookups++;
+	if ((num_prstr + 1) * 2 > pr_strhash_size
+	    && !PR_RehashStrings(num_prstr + 1))
+	    return 0;
+	slot = PR_StringSlot(s);
+	if (*slot) {
+	    pr_strstats.found++;
+	    return -*slot;
 	}
-	pr_strtbl[num_prstr] = s;
+	if (!PR_ReserveStrings(num_prstr + 1))
+	    return 0;
+	PR_STRTBL(num_prstr) = s;
 	num_prstr++;
+	*slot = num_prstr;
 	return -num_prstr;
     }
     return (int)(s - pr_strings);
 }
+
+/*
+ * Returns the pool hash slot holding a copy of s, or the empty slot where
+ * it belongs
+ */
+static int *
+PR_PoolSlot(const char *s)
+{
+    unsigned mask = pr_strpoolhash_size - 1;
+    unsigned slot = COM_HashString(s) & mask;
+
+    while (pr_strpoolhash[slot]
+	   && strcmp(pr_strpool[pr_strpoolhash[slot] - 1], s))
+	slot = (slot + 1) & mask;
+
+    return &pr_strpoolhash[slot];
+}
+
+/*
+ * Rebuild the pool hash with room for count copies while staying at most
+ * half full. If that fails the old hash is left as it was.
+ */
+static qboolean
+PR_RehashPool(int count)
+{
+    int i, size, *hash;
+
+    size = qmax(pr_strpoolhash_size, PR_STRHASH_MINSIZE);
+    while (size <= count * 2)
+	size *= 2;
+
+    hash = calloc(size, sizeof(pr_strpoolhash[0]));
+    if (!hash) {
+	Sys_Error("%s: out of memory", __func__);
+	return false;
+    }
+    free(pr_strpoolhash);
+    pr_strpoolhash = hash;
+    pr_strpoolhash_size = size;
+
+    for (i = 0; i < num_prstrpool; i++)
+	*PR_PoolSlot(pr_strpool[i]) = i + 1;
+
+    return true;
+}
+
+/*
+ * Return a copy of s which stays valid until the progs are reloaded, or
+ * NULL if it could not be made. The pool is left intact on failure.
+ */
+const char *
+PR_InternString(const char *s)
+{
+    char **pool, *copy;
+    int *slot;
+
+    if ((num_prstrpool + 1) * 2 > pr_strpoolhash_size
+	&& !PR_RehashPool(num_prstrpool + 1))
+	return NULL;
+
+    slot = PR_PoolSlot(s);
+    if (*slot)
+	return pr_strpool[*slot - 1];
+
+    if (num_prstrpool == pr_strpool_size) {
+	pool = realloc(pr_strpool,
+		       (pr_strpool_size + PR_STRTBL_CHUNK) * sizeof(char *));
+	if (!pool) {
+	    Sys_Error("%s: out of memory", __func__);
+	    return NULL;
+	}
+	pr_strpool = pool;
+	pr_strpool_size += PR_STRTBL_CHUNK;
+    }
+    copy = malloc(strlen(s) + 1);
+    if (!copy) {
+	Sys_Error("%s: out of memory", __func__);
+	return NULL;
+    }
+    strcpy(copy, s);
+
+    pr_strpool[num_prstrpool++] = copy;
+    *slot = num_prstrpool;
+
+    return copy;
+}
+
+/*
+ * The table is saved by content, since entries often point at buffers
+ * which are reused (e.g. the result of ftos) or which only exist in this
+ * process.
+ */
+void
+PR_SaveStrings(savebuf_t *buf)
+{
+    int i;
+
+    SaveBuf_WriteInt(buf, num_prstr);
+    for (i = 0; i < num_prstr; i++)
+	SaveBuf_WriteString(buf, PR_STRTBL(i));
+}
+
+/*
+ * Rebuild the table so that every string_t in the snapshot means the same
+ * string again. Entries whose current contents still match are kept.
+ */
+void
+PR_LoadStrings(savebuf_t *buf)
+{
+    const char *s;
+    int i, count;
+
+    count = SaveBuf_ReadInt(buf);
+    if (count < 0 || !PR_ReserveStrings(count)) {
+	buf->overflowed = true;
+	return;
+    }
+
+    for (i = 0; i < count; i++) {
+	s = SaveBuf_ReadString(buf);
+	if (!s)
+	    s = "";
+	if (i >= num_prstr || strcmp(PR_STRTBL(i), s)) {
+	    s = PR_InternString(s);
+	    if (!s) {
+		buf->overflowed = true;
+		break;
+	    }
+	    PR_STRTBL(i) = s;
+	}
+    }
+    /* after a failure, keep every entry which still points somewhere */
+    num_prstr = (i == count) ? count : qmax(num_prstr, i);
+
+    /* a hash left over from the old table would give wrong numbers */
+    if (!PR_RehashStrings(num_prstr)) {
+	free(pr_strhash);
+	pr_strhash = NULL;
+	pr_strhash_size = 0;
+    }
+}
+
+void
+PR_CheckStrings(savebuf_t *buf)
+{
+    int i, count;
+
+    count = SaveBuf_ReadInt(buf);
+    if (count < 0 || count > PR_STRTBL_MAXCHUNKS * PR_STRTBL_CHUNK) {
+	buf->overflowed = true;
+	return;
+    }
+    for (i = 0; i < count && !buf->overflowed; i++)
+	SaveBuf_SkipString(buf);
+}
+
+/*
+===============
+PR_Strings_f
+
+pr_strings       : show the engine string table
+pr_strings reset : clear the lookup counters
+===============
+*/
+void
+PR_Strings_f(void)
+{
+    double lookups = pr_strstats.lookups;
+
+    Con_Printf("string table: %d entries in %d chunks of %d\n",
+	       num_prstr, pr_strtbl_chunks, PR_STRTBL_CHUNK);
+    Con_Printf("hash: %d slots, %.1f%% full\n", pr_strhash_size,
+	       pr_strhash_size ? num_prstr * 100.0 / pr_strhash_size : 0.0);
+    Con_Printf("%.0f lookups: %.0f found, %.0f collisions "
+	       "(%.2f per lookup)\n", lookups, (double)pr_strstats.found,
+	       (double)pr_strstats.collisions,
+	       lookups ? pr_strstats.collisions / lookups : 0.0);
+    Con_Printf("%d strings restored from snapshots\n", num_prstrpool);
+
+    if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset"))
+	memset(&pr_strstats, 0, sizeof(pr_strstats));
+}
@@ -24,6 +24,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "pr_comp.h"		// defs shared with qcc
 #include "progdefs.h"		// generated by program cdefs
 #include "common.h"
+#include "cvar.h"
+#include "savestate.h"
 
 typedef union eval_s {
     string_t string;
@@ -38,6 +40,8 @@ typedef union eval_s {
 typedef struct edict_s {
     qboolean free;
     link_t area;		// linked to a division node or leaf
+    qboolean moved;		// area fields written since it was linked
+    int areastamp;		// last SV_AreaEdicts query that listed it
 
     int num_leafs;
     int leafnums[MAX_ENT_LEAFS];
@@ -68,12 +72,29 @@ extern int pr_edict_size;	// in bytes
 void PR_Init(void);
 
 void PR_ExecuteProgram(func_t fnum);
+void PR_DecodeProgram(void);
+void PR_InitProfile(void);
 void PR_LoadProgs(void);
 
 void PR_Profile_f(void);
 
+/*
+ * Fields the engine keeps indexes on. Stores to them from progs, and
+ * any rewrite of an edict's fields by the engine, must be reported so
+ * the indexes can catch up.
+ */
+#define FIELD_AREA	1	// origin, size or solid: where it links
+#define FIELD_FIND	2	// indexed for find()
+extern byte *pr_fieldflags;	// flags for each entity field offset
+
+void ED_FieldWritten(edict_t *ed, int ofs);
+void ED_Changed(edict_t *ed);
+int ED_FindString(int start, int field, const char *s);
+void ED_ClearFindIndex(void);
+
 edict_t *ED_Alloc(void);
 void ED_Free(edict_t *ed);
+void ED_ResetFreeList(void);
 
 // returns a copy of the string allocated from the server's string heap
 
@@ -119,12 +140,15 @@ extern int pr_numbuiltins;
 extern int pr_argc;
 
 extern qboolean pr_trace;
+extern cvar_t pr_instrument;	// run the slower loop that counts statements
+extern cvar_t pr_profile;	// time every function, see 'profile'
 extern dfunction_t *pr_xfunction;
 extern int pr_xstatement;
 
 #ifdef NQ_HACK
 extern unsigned short pr_crc;
 #endif
+extern unsigned pr_randseed;	// state of the random() builtin
 #if defined(QW_HACK) && defined(SERVERONLY)
 extern func_t SpectatorConnect;
 extern func_t SpectatorThink;
@@ -133,6 +157,7 @@ extern func_t SpectatorDisconnect;
 
 void PR_RunError(const char *error, ...);
 
+ddef_t *ED_FieldAtOfs(int ofs);
 void ED_PrintEdicts(void);
 void ED_PrintNum(int ent);
 
@@ -143,7 +168,15 @@ eval_t *GetEdictFieldValue(edict_t *ed, const char *field);
  */
 void PR_InitStringTable(void);
 const char *PR_GetString(int num);
+qboolean PR_ValidString(int num);
 int PR_SetString(const char *s);
+int PR_SetTempString(const char *s);
+qboolean PR_TempString(int num);
+const char *PR_InternString(const char *s);
+void PR_SaveStrings(savebuf_t *buf);
+void PR_LoadStrings(savebuf_t *buf);
+void PR_CheckStrings(savebuf_t *buf);
+void PR_Strings_f(void);
 
 /*
  * Somehow, I don't think this should be exposed - but better to have it here
@@ -54,4 +54,22 @@ typedef enum{ false, true, ENSURE_INT_QBOOL = 0x70000000 } qboolean;
  */
 # define container_of(p, c, m) ((c *)((char *)(p) - offsetof(c,m)))
 
+/*
+ * Storage class for renderer state that each worker thread needs its own
+ * copy of (see tasks.h). Without thread support it is an ordinary global.
+ *
+ * The span drawers read these in their inner loops, so where the loader
+ * allows it use the initial-exec model; the default model for a shared
+ * library turns every access into a call to __tls_get_addr.
+ */
+#if !defined(HAVE_THREADS)
+#define THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#elif defined(__linux__) && !defined(__ANDROID__)
+#define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 #endif /* QTYPES_H */
@@ -22,6 +22,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "quakedef.h"
 #include "r_local.h"
 #include "sound.h"
+#include "tasks.h"
 
 // FIXME - header hacks
 extern int screenwidth;
@@ -565,11 +566,13 @@ void R_ScanEdges(void)
    espan_t *basespans;
    espan_t *basespan_p;
    surf_t *s;
+   /* give banded drawing enough scanlines per flush to split up */
+   int maxspans = MAXSPANS * Tasks_NumThreads();
    
-   basespans = malloc(sizeof(espan_t)*CACHE_PAD_ARRAY(MAXSPANS, espan_t));
+   basespans = malloc(sizeof(espan_t)*CACHE_PAD_ARRAY(maxspans, espan_t));
    basespan_p = (espan_t *)
 			((long)(basespans + CACHE_SIZE - 1) & ~(CACHE_SIZE - 1));
-   max_span_p = &basespan_p[MAXSPANS - r_refdef.vrect.width];
+   max_span_p = &basespan_p[maxspans - r_refdef.vrect.width];
 
    span_p = basespan_p;
 
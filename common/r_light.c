@@ -37,6 +37,7 @@ void R_AnimateLight(void)
     * 'm' is normal light, 'a' is no light, 'z' is double bright */
    int i = (int)(cl.time * 10);
 
+   d_lightstyleanimated = 0;
    for (j = 0; j < MAX_LIGHTSTYLES; j++)
    {
       if (!cl_lightstyle[j].length)
@@ -44,6 +45,8 @@ void R_AnimateLight(void)
          d_lightstylevalue[j] = 256;
          continue;
       }
+      if (cl_lightstyle[j].length > 1)
+         d_lightstyleanimated |= (uint64_t)1 << j;
       k = i % cl_lightstyle[j].length;
       k = cl_lightstyle[j].map[k] - 'a';
       k = k * 22;
@@ -149,8 +149,8 @@ extern int r_polycount;
 
 extern int ubasestep, errorterm, erroradjustup, erroradjustdown;
 
-extern fixed16_t sadjust, tadjust;
-extern fixed16_t bbextents, bbextentt;
+extern THREAD_LOCAL fixed16_t sadjust, tadjust;
+extern THREAD_LOCAL fixed16_t bbextents, bbextentt;
 
 #define MAXBVERTINDEXES	1000	// new clipped vertices when clipping bmodels
 				// to the world BSP
@@ -241,6 +241,7 @@ extern int r_clipflags;
 
 void R_StoreEfrags(efrag_t **ppefrag);
 void R_TimeRefresh_f(void);
+void R_LightKernels_f(void);
 void R_TimeGraph(void);
 void R_PrintAliasStats(void);
 void R_PrintTimes(void);
@@ -37,6 +37,7 @@ int r_numallocatededges;
 qboolean r_recursiveaffinetriangles = true;
 
 int r_pixbytes = 1;
+int r_truecolor;
 float r_aliasuvscale = 1.0;
 int r_outofsurfaces;
 int r_outofedges;
@@ -102,6 +103,7 @@ texture_t *r_notexture_mip;
 float r_aliastransition, r_resfudge;
 
 int d_lightstylevalue[256];	// 8.8 fraction of base light value
+uint64_t d_lightstyleanimated;	// styles with more than one value
 
 cvar_t r_draworder = { "r_draworder", "0" };
 cvar_t r_speeds = { "r_speeds", "0" };
@@ -128,6 +130,7 @@ static cvar_t r_timegraph = { "r_timegraph", "0" };
 static cvar_t r_aliasstats = { "r_polymodelstats", "0" };
 static cvar_t r_dspeeds = { "r_dspeeds", "0" };
 static cvar_t r_reportsurfout = { "r_reportsurfout", "0" };
+static cvar_t r_reportsurfcache = { "r_reportsurfcache", "0" };
 static cvar_t r_maxsurfs = { "r_maxsurfs", "0" };
 static cvar_t r_reportedgeout = { "r_reportedgeout", "0" };
 static cvar_t r_maxedges = { "r_maxedges", "0" };
@@ -205,6 +208,7 @@ R_Init(void)
 
     Cmd_AddCommand("timerefresh", R_TimeRefresh_f);
     Cmd_AddCommand("pointfile", R_ReadPointFile_f);
+    Cmd_AddCommand("r_lightkernels", R_LightKernels_f);
 
     Cvar_RegisterVariable(&r_draworder);
     Cvar_RegisterVariable(&r_speeds);
@@ -229,6 +233,7 @@ R_Init(void)
     Cvar_RegisterVariable(&r_aliasstats);
     Cvar_RegisterVariable(&r_dspeeds);
     Cvar_RegisterVariable(&r_reportsurfout);
+    Cvar_RegisterVariable(&r_reportsurfcache);
     Cvar_RegisterVariable(&r_maxsurfs);
     Cvar_RegisterVariable(&r_reportedgeout);
     Cvar_RegisterVariable(&r_maxedges);
@@ -1085,6 +1090,13 @@ R_RenderView_(void)
     if (r_reportedgeout.value && r_outofedges)
 	Con_Printf("Short roughly %d edges\n", r_outofedges * 2 / 3);
 
+    if (r_reportsurfcache.value && c_surf)
+	Con_Printf("Surface cache: %d built (%d bytes), %d evicted%s\n",
+		   c_surf, r_cache_bytesbuilt * (r_truecolor ? 4 : r_pixbytes), r_cache_evictions,
+		   r_cache_thrash ? ", thrashing" : "");
+
+    D_EndCacheFrame();
+
     // back to high floating-point precision
     Sys_HighFPPrecision();
 }
@@ -116,6 +116,8 @@ R_LineGraph(int x, int y, int h)
     if (h > s)
 	h = s;
 
+    if (h > 0)
+	D_DropColor(x, y - (h - 1) * 2, 1, (h - 1) * 2 + 1);
     for (i = 0; i < h; i++, dest -= vid.rowbytes * 2)
 	dest[0] = color;
 }
@@ -455,6 +457,9 @@ R_SetupFrame(void)
     R_SetSkyFrame();
 
     r_cache_thrash = false;
+    r_cache_evictions = 0;
+    r_cache_bytesbuilt = 0;
+    c_surf = 0;
 
 // clear frame counts
     c_faceclip = 0;
@@ -44,8 +44,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 //===================================================================
 
-extern int cachewidth;
-extern pixel_t *cacheblock;
+extern THREAD_LOCAL int cachewidth;
+extern THREAD_LOCAL pixel_t *cacheblock;
 extern int screenwidth;
 
 extern float pixelAspect;
@@ -126,6 +126,7 @@ extern float xscaleinv, yscaleinv;
 extern float xscaleshrink, yscaleshrink;
 
 extern int d_lightstylevalue[256];	// 8.8 frac of base light value
+extern uint64_t d_lightstyleanimated;	// styles with more than one value
 
 extern void TransformVector(vec3_t in, vec3_t out);
 extern void SetUpForLineScan(fixed8_t startvertu, fixed8_t startvertv,
@@ -19,34 +19,46 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // r_surf.c: surface-related refresh code
 
+#include "console.h"
 #include "quakedef.h"
 #include "r_local.h"
 #include "sys.h"
 
-drawsurf_t r_drawsurf;
-
-int lightleft, sourcesstep, blocksize, sourcetstep;
-int lightdelta, lightdeltastep;
-int lightright, lightleftstep, lightrightstep, blockdivshift;
-
-int				lightlefta[3];
-int				sourcesstep, blocksize, sourcetstep;
-int				lightrighta[3];
-int				lightleftstepa[3], lightrightstepa[3], blockdivshift;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_LIGHTVEC_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_LIGHTVEC_NEON
+#endif
 
-unsigned blockdivmask;
-void *prowdestbase;
-unsigned char *pbasesource;
-int surfrowbytes;		// used by ASM files
+/*
+ * Everything below describes the surface being built; it is per-thread so
+ * that several cache blocks can be built at once (see D_BuildSurfaces).
+ */
+THREAD_LOCAL drawsurf_t r_drawsurf;
+
+THREAD_LOCAL int lightleft, sourcesstep, blocksize, sourcetstep;
+THREAD_LOCAL int lightdelta, lightdeltastep;
+THREAD_LOCAL int lightright, lightleftstep, lightrightstep, blockdivshift;
+
+THREAD_LOCAL int				lightlefta[3];
+THREAD_LOCAL int				lightrighta[3];
+THREAD_LOCAL int				lightleftstepa[3], lightrightstepa[3];
+
+THREAD_LOCAL unsigned blockdivmask;
+THREAD_LOCAL void *prowdestbase;
+THREAD_LOCAL unsigned char *pbasesource;
+THREAD_LOCAL int surfrowbytes;		// used by ASM files
 //unsigned *r_lightptr;
-int *r_lightptr;
+THREAD_LOCAL int *r_lightptr;
 
-int r_stepback;
-int r_lightwidth;
-unsigned char *r_source, *r_sourcemax;
+THREAD_LOCAL int r_stepback;
+THREAD_LOCAL int r_lightwidth;
+THREAD_LOCAL unsigned char *r_source, *r_sourcemax;
 
-static int r_numhblocks;
-int r_numvblocks;
+static THREAD_LOCAL int r_numhblocks;
+THREAD_LOCAL int r_numvblocks;
 
 void R_DrawSurfaceBlock8_mip0(void);
 void R_DrawSurfaceBlock8_mip1(void);
@@ -58,6 +70,8 @@ void R_DrawSurfaceBlockRGB_mip1(void);
 void R_DrawSurfaceBlockRGB_mip2(void);
 void R_DrawSurfaceBlockRGB_mip3(void);
 
+static void R_DrawSurfaceBlockRGB32(void);
+
 
 static void (*surfmiptable[4]) (void) = {
     R_DrawSurfaceBlock8_mip0,
@@ -75,7 +89,7 @@ static void	(*surfmiptableRGB[4])(void) =
 };
 
 //static unsigned blocklights[18 * 18 * 3];
-int		blocklights[18*18*3]; // LordHavoc: .lit support (*3 for RGB)
+THREAD_LOCAL int	blocklights[18*18*3]; // LordHavoc: .lit support (*3 for RGB)
 
 // Leilei - macros to make colored lighting code look a little more bearable to sanity
 // Macros for initiating the RGB light deltas.
@@ -83,6 +97,8 @@ int		blocklights[18*18*3]; // LordHavoc: .lit support (*3 for RGB)
 #define PushLightDelta() { light[0] += lightdelta[0];	light[1] += lightdelta[1];	light[2] += lightdelta[2]; };
 #define FinishLightDelta() { psource += sourcetstep; lightrighta[0] += lightrightstepa[0];lightlefta[0] += lightleftstepa[0];lightdelta[0] += lightdeltastep[0]; lightrighta[1] += lightrightstepa[1];lightlefta[1] += lightleftstepa[1];lightdelta[1] += lightdeltastep[1]; lightrighta[2] += lightrightstepa[2];lightlefta[2] += lightleftstepa[2];lightdelta[2] += lightdeltastep[2]; prowdest += surfrowbytes;}
 #define MIPRGB(i) {  	if (psource[i] < host_fullbrights){ 	pix = psource[i]; pix24 = (unsigned char *)&d_8to24table[pix]; trans[0] = (pix24[0] * (light[0])) >> 17; trans[1] = (pix24[1] * (light[1])) >> 17; trans[2] = (pix24[2] * (light[2])) >> 17; if (trans[0] & ~63) trans[0] = 63; if (trans[1] & ~63) trans[1] = 63; if (trans[2] & ~63) trans[2] = 63; prowdest[i] = palmap2[trans[0]][trans[1]][trans[2]]; }	else prowdest[i] = psource[i];}
+// true color: MIPRGB above with the lit color kept at 8 bits, no palette lookup
+#define MIPRGB32(i) { if (psource[i] < host_fullbrights) { pix = psource[i]; pix24 = (unsigned char *)&d_8to24table[pix]; trans[0] = (pix24[0] * (light[0])) >> 15; trans[1] = (pix24[1] * (light[1])) >> 15; trans[2] = (pix24[2] * (light[2])) >> 15; if (trans[0] & ~255) trans[0] = 255; if (trans[1] & ~255) trans[1] = 255; if (trans[2] & ~255) trans[2] = 255; prowdest[i] = D_COLOR_OWNED | (trans[0] << 16) | (trans[1] << 8) | trans[2]; } else prowdest[i] = D_PALETTE_TEXEL(psource[i]);}
 #define Mip0Stuff(i) { MakeLightDelta(); i(15); PushLightDelta(); i(14); PushLightDelta(); PushLightDelta(); i(13); PushLightDelta(); i(12); PushLightDelta(); i(11); PushLightDelta(); i(10); PushLightDelta(); i(9); PushLightDelta(); i(8); PushLightDelta(); i(7); PushLightDelta(); i(6); PushLightDelta(); i(5); PushLightDelta(); i(4); PushLightDelta(); i(3); PushLightDelta(); i(2); PushLightDelta(); i(1); PushLightDelta(); i(0);  FinishLightDelta();}
 #define Mip1Stuff(i) { MakeLightDelta(); i(7); PushLightDelta(); i(6); PushLightDelta(); i(5); PushLightDelta(); i(4); PushLightDelta(); i(3); PushLightDelta(); i(2); PushLightDelta(); i(1); PushLightDelta(); i(0); FinishLightDelta();}
 #define Mip2Stuff(i) { MakeLightDelta();i(3); PushLightDelta(); i(2); PushLightDelta(); i(1); PushLightDelta(); i(0); FinishLightDelta();}
@@ -90,6 +106,361 @@ int		blocklights[18*18*3]; // LordHavoc: .lit support (*3 for RGB)
 
 int			host_fullbrights;   // for preserving fullbrights in color operations
 
+/*
+==============================================================================
+
+LIGHTMAP KERNELS
+
+The passes over blocklights, with SSE2 or NEON versions where available.
+Each vector loop computes exactly what its scalar tail does, wrapping
+included, so the lightmaps come out the same either way.
+==============================================================================
+*/
+
+/*
+ * The scalar versions are the reference: the vector loops hand them the
+ * leftover tail, and r_lightkernels checks the two against each other.
+ */
+static void R_FillLights_C(int *dst, int value, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++)
+      dst[i] = value;
+}
+
+static void R_FillLights(int *dst, int value, int count)
+{
+   int i = 0;
+#if defined(HAVE_LIGHTVEC_SSE2)
+   const __m128i v = _mm_set1_epi32(value);
+
+   for (; i + 4 <= count; i += 4)
+      _mm_storeu_si128((__m128i *)(dst + i), v);
+#elif defined(HAVE_LIGHTVEC_NEON)
+   const int32x4_t v = vdupq_n_s32(value);
+
+   for (; i + 4 <= count; i += 4)
+      vst1q_s32(dst + i, v);
+#endif
+   R_FillLights_C(dst + i, value, count - i);
+}
+
+/* dst[i] += lightmap[i] * scale */
+static void R_AccumulateLights_C(int *dst, const byte *lightmap,
+      unsigned scale, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++)
+      dst[i] += lightmap[i] * scale;
+}
+
+static void R_AccumulateLights(int *dst, const byte *lightmap, unsigned scale,
+      int count)
+{
+   int i = 0;
+
+   /* the vector products are 8 x 16 bits; styles never get near that */
+   if (scale <= 0xffff)
+   {
+#if defined(HAVE_LIGHTVEC_SSE2)
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i s = _mm_set1_epi16((short)scale);
+
+      for (; i + 16 <= count; i += 16)
+      {
+         const __m128i l = _mm_loadu_si128((const __m128i *)(lightmap + i));
+         const __m128i half[2] = {
+            _mm_unpacklo_epi8(l, zero), _mm_unpackhi_epi8(l, zero)
+         };
+         int h;
+
+         for (h = 0; h < 2; h++)
+         {
+            __m128i *d = (__m128i *)(dst + i + h * 8);
+            const __m128i lo = _mm_mullo_epi16(half[h], s);
+            const __m128i hi = _mm_mulhi_epu16(half[h], s);
+
+            _mm_storeu_si128(d, _mm_add_epi32(_mm_loadu_si128(d),
+                     _mm_unpacklo_epi16(lo, hi)));
+            _mm_storeu_si128(d + 1, _mm_add_epi32(_mm_loadu_si128(d + 1),
+                     _mm_unpackhi_epi16(lo, hi)));
+         }
+      }
+#elif defined(HAVE_LIGHTVEC_NEON)
+      const uint16x4_t s = vdup_n_u16((uint16_t)scale);
+
+      for (; i + 16 <= count; i += 16)
+      {
+         const uint8x16_t l = vld1q_u8(lightmap + i);
+         const uint16x8_t lo = vmovl_u8(vget_low_u8(l));
+         const uint16x8_t hi = vmovl_u8(vget_high_u8(l));
+         int32_t *d = dst + i;
+
+         vst1q_s32(d, vreinterpretq_s32_u32(vmlal_u16(
+                     vreinterpretq_u32_s32(vld1q_s32(d)), vget_low_u16(lo), s)));
+         vst1q_s32(d + 4, vreinterpretq_s32_u32(vmlal_u16(
+                     vreinterpretq_u32_s32(vld1q_s32(d + 4)), vget_high_u16(lo), s)));
+         vst1q_s32(d + 8, vreinterpretq_s32_u32(vmlal_u16(
+                     vreinterpretq_u32_s32(vld1q_s32(d + 8)), vget_low_u16(hi), s)));
+         vst1q_s32(d + 12, vreinterpretq_s32_u32(vmlal_u16(
+                     vreinterpretq_u32_s32(vld1q_s32(d + 12)), vget_high_u16(hi), s)));
+      }
+#endif
+   }
+   R_AccumulateLights_C(dst + i, lightmap + i, scale, count - i);
+}
+
+/* bound, invert, and shift into the 8-bit light levels */
+static void R_BoundLights_C(int *dst, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      int t = (255 * 256 - dst[i]) >> (8 - VID_CBITS);
+
+      if (t < (1 << 6))
+         t = (1 << 6);
+
+      dst[i] = t;
+   }
+}
+
+static void R_BoundLights(int *dst, int count)
+{
+   int i = 0;
+#if defined(HAVE_LIGHTVEC_SSE2)
+   const __m128i base = _mm_set1_epi32(255 * 256);
+   const __m128i minlevel = _mm_set1_epi32(1 << 6);
+
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i *d = (__m128i *)(dst + i);
+      __m128i t = _mm_srai_epi32(_mm_sub_epi32(base, _mm_loadu_si128(d)),
+            8 - VID_CBITS);
+      const __m128i low = _mm_cmplt_epi32(t, minlevel);
+
+      t = _mm_or_si128(_mm_and_si128(low, minlevel), _mm_andnot_si128(low, t));
+      _mm_storeu_si128(d, t);
+   }
+#elif defined(HAVE_LIGHTVEC_NEON)
+   const int32x4_t base = vdupq_n_s32(255 * 256);
+   const int32x4_t minlevel = vdupq_n_s32(1 << 6);
+
+   for (; i + 4 <= count; i += 4)
+   {
+      const int32x4_t t = vshrq_n_s32(vsubq_s32(base, vld1q_s32(dst + i)),
+            8 - VID_CBITS);
+      vst1q_s32(dst + i, vmaxq_s32(t, minlevel));
+   }
+#endif
+   R_BoundLights_C(dst + i, count - i);
+}
+
+/* the colored light levels stay at 8.8, between 1 and 256 */
+static void R_ClampLightsRGB_C(int *dst, int count)
+{
+   int i;
+
+   for (i = 0; i < count; i++)
+   {
+      const int r = dst[i];
+      dst[i] = (r < 256) ? 256 : (r > 65536) ? 65536 : r;	// leilei - made min 256 to rid visual artifacts and gain speed
+   }
+}
+
+static void R_ClampLightsRGB(int *dst, int count)
+{
+   int i = 0;
+#if defined(HAVE_LIGHTVEC_SSE2)
+   const __m128i minlight = _mm_set1_epi32(256);
+   const __m128i maxlight = _mm_set1_epi32(65536);
+
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i *d = (__m128i *)(dst + i);
+      __m128i r = _mm_loadu_si128(d);
+      const __m128i low = _mm_cmplt_epi32(r, minlight);
+      const __m128i high = _mm_cmpgt_epi32(r, maxlight);
+
+      r = _mm_or_si128(_mm_and_si128(low, minlight), _mm_andnot_si128(low, r));
+      r = _mm_or_si128(_mm_and_si128(high, maxlight), _mm_andnot_si128(high, r));
+      _mm_storeu_si128(d, r);
+   }
+#elif defined(HAVE_LIGHTVEC_NEON)
+   const int32x4_t minlight = vdupq_n_s32(256);
+   const int32x4_t maxlight = vdupq_n_s32(65536);
+
+   for (; i + 4 <= count; i += 4)
+      vst1q_s32(dst + i, vminq_s32(vmaxq_s32(vld1q_s32(dst + i), minlight),
+               maxlight));
+#endif
+   R_ClampLightsRGB_C(dst + i, count - i);
+}
+
+/*
+ * The approximate distance from a dynamic light to each sample of a
+ * lightmap row, td being the row's distance along t
+ */
+static void R_DlightDistances_C(float local, int td, int s, int smax,
+      int *dist)
+{
+   for (; s < smax; s++)
+   {
+      int sd = local - s * 16;
+      if (sd < 0)
+         sd = -sd;
+      if (sd > td)
+         dist[s] = sd + (td >> 1);
+      else
+         dist[s] = td + (sd >> 1);
+   }
+}
+
+static void R_DlightDistances(float local, int td, int smax, int *dist)
+{
+   int s = 0;
+#if defined(HAVE_LIGHTVEC_SSE2)
+   const __m128i vtd = _mm_set1_epi32(td);
+   const __m128 vlocal = _mm_set1_ps(local);
+   __m128 soffset = _mm_setr_ps(0, 16, 32, 48);
+
+   for (; s + 4 <= smax; s += 4)
+   {
+      __m128i sd = _mm_cvttps_epi32(_mm_sub_ps(vlocal, soffset));
+      const __m128i sign = _mm_srai_epi32(sd, 31);
+      __m128i gt, big, small;
+
+      sd = _mm_sub_epi32(_mm_xor_si128(sd, sign), sign);
+      gt = _mm_cmpgt_epi32(sd, vtd);
+      big = _mm_or_si128(_mm_and_si128(gt, sd), _mm_andnot_si128(gt, vtd));
+      small = _mm_or_si128(_mm_and_si128(gt, vtd), _mm_andnot_si128(gt, sd));
+      _mm_storeu_si128((__m128i *)(dist + s),
+            _mm_add_epi32(big, _mm_srai_epi32(small, 1)));
+      soffset = _mm_add_ps(soffset, _mm_set1_ps(64));
+   }
+#elif defined(HAVE_LIGHTVEC_NEON)
+   const int32x4_t vtd = vdupq_n_s32(td);
+   const float32x4_t vlocal = vdupq_n_f32(local);
+   static const float offsets[4] = { 0, 16, 32, 48 };
+   float32x4_t soffset = vld1q_f32(offsets);
+
+   for (; s + 4 <= smax; s += 4)
+   {
+      const int32x4_t sd = vabsq_s32(vcvtq_s32_f32(vsubq_f32(vlocal, soffset)));
+      const int32x4_t big = vmaxq_s32(sd, vtd);
+      const int32x4_t small = vminq_s32(sd, vtd);
+
+      vst1q_s32(dist + s, vaddq_s32(big, vshrq_n_s32(small, 1)));
+      soffset = vaddq_f32(soffset, vdupq_n_f32(64));
+   }
+#endif
+   R_DlightDistances_C(local, td, s, smax, dist);
+}
+
+/*
+================
+R_LightKernels_f
+
+Run each lightmap kernel and its scalar reference on the same random
+input, and report how many results differ
+================
+*/
+#define LK_MAXCOUNT 64
+#define LK_TRIALS 20000
+
+static unsigned lk_seed = 1;
+
+static unsigned R_LightKernelsRandom(void)
+{
+   lk_seed = lk_seed * 1103515245 + 12345;
+   return (lk_seed >> 16) | (lk_seed << 16);
+}
+
+static int R_LightKernelsCompare(const int *a, const int *b, int count)
+{
+   return memcmp(a, b, count * sizeof(*a)) ? 1 : 0;
+}
+
+void R_LightKernels_f(void)
+{
+   int vec[LK_MAXCOUNT], ref[LK_MAXCOUNT], init[LK_MAXCOUNT];
+   byte lightmap[LK_MAXCOUNT];
+   int fill = 0, accumulate = 0, bound = 0, clamp = 0, distances = 0;
+   int i, j, count, value, td;
+   unsigned scale;
+   float local;
+
+   for (i = 0; i < LK_TRIALS; i++)
+   {
+      count = R_LightKernelsRandom() % (LK_MAXCOUNT + 1);
+      for (j = 0; j < LK_MAXCOUNT; j++)
+      {
+         /* mostly the realistic range, sometimes far outside it */
+         if (R_LightKernelsRandom() & 3)
+            init[j] = R_LightKernelsRandom() % (2 * 65536 + 1) - 256;
+         else
+            init[j] = (int)R_LightKernelsRandom() / 2;
+         lightmap[j] = R_LightKernelsRandom();
+      }
+
+      value = R_LightKernelsRandom();
+      memcpy(vec, init, sizeof(vec));
+      memcpy(ref, init, sizeof(ref));
+      R_FillLights(vec, value, count);
+      R_FillLights_C(ref, value, count);
+      fill += R_LightKernelsCompare(vec, ref, LK_MAXCOUNT);
+
+      /* scales past 16 bits take the scalar path, check they still agree */
+      scale = R_LightKernelsRandom();
+      if (R_LightKernelsRandom() & 7)
+         scale &= 0xffff;
+      memcpy(vec, init, sizeof(vec));
+      memcpy(ref, init, sizeof(ref));
+      R_AccumulateLights(vec, lightmap, scale, count);
+      R_AccumulateLights_C(ref, lightmap, scale, count);
+      accumulate += R_LightKernelsCompare(vec, ref, LK_MAXCOUNT);
+
+      memcpy(vec, init, sizeof(vec));
+      memcpy(ref, init, sizeof(ref));
+      R_BoundLights(vec, count);
+      R_BoundLights_C(ref, count);
+      bound += R_LightKernelsCompare(vec, ref, LK_MAXCOUNT);
+
+      memcpy(vec, init, sizeof(vec));
+      memcpy(ref, init, sizeof(ref));
+      R_ClampLightsRGB(vec, count);
+      R_ClampLightsRGB_C(ref, count);
+      clamp += R_LightKernelsCompare(vec, ref, LK_MAXCOUNT);
+
+      /* within the 18 samples and few thousand units of a real surface */
+      count = R_LightKernelsRandom() % 19;
+      local = (int)(R_LightKernelsRandom() % 8192) - 2048
+         + (R_LightKernelsRandom() % 256) / 256.0f;
+      td = R_LightKernelsRandom() % 4096;
+      memcpy(vec, init, sizeof(vec));
+      memcpy(ref, init, sizeof(ref));
+      R_DlightDistances(local, td, count, vec);
+      R_DlightDistances_C(local, td, 0, count, ref);
+      distances += R_LightKernelsCompare(vec, ref, LK_MAXCOUNT);
+   }
+
+#if defined(HAVE_LIGHTVEC_SSE2)
+   Con_Printf("lightmap kernels: SSE2, %i trials\n", LK_TRIALS);
+#elif defined(HAVE_LIGHTVEC_NEON)
+   Con_Printf("lightmap kernels: NEON, %i trials\n", LK_TRIALS);
+#else
+   Con_Printf("lightmap kernels: scalar only, %i trials\n", LK_TRIALS);
+#endif
+   Con_Printf("  fill        %i mismatches\n", fill);
+   Con_Printf("  accumulate  %i mismatches\n", accumulate);
+   Con_Printf("  bound       %i mismatches\n", bound);
+   Con_Printf("  clamp RGB   %i mismatches\n", clamp);
+   Con_Printf("  distances   %i mismatches\n", distances);
+}
+
 
 /*
 ===============
@@ -100,12 +471,13 @@ static void R_AddDynamicLights(void)
 {
    msurface_t *surf;
    int lnum;
-   int sd, td;
+   int td;
    float dist, rad, minlight;
    vec3_t impact, local;
    int s, t;
    int i;
    int smax, tmax;
+   int sdist[18];
    mtexinfo_t *tex;
 
    surf = r_drawsurf.surf;
@@ -140,14 +512,9 @@ static void R_AddDynamicLights(void)
          td = local[1] - t * 16;
          if (td < 0)
             td = -td;
+         R_DlightDistances(local[0], td, smax, sdist);
          for (s = 0; s < smax; s++) {
-            sd = local[0] - s * 16;
-            if (sd < 0)
-               sd = -sd;
-            if (sd > td)
-               dist = sd + (td >> 1);
-            else
-               dist = td + (sd >> 1);
+            dist = sdist[s];
             if (dist < minlight)
                blocklights[t * smax + s] += (rad - dist) * 256;
          }
@@ -159,12 +526,13 @@ static void R_AddDynamicLightsRGB(void)
 {
    msurface_t *surf;
    int lnum;
-   int sd, td;
+   int td;
    float dist, rad, minlight;
    vec3_t impact, local;
    int s, t;
    int i;
    int smax, tmax;
+   int sdist[18];
    mtexinfo_t *tex;
    float		cred, cgreen, cblue, brightness;
    unsigned	*bl;
@@ -208,15 +576,10 @@ static void R_AddDynamicLightsRGB(void)
 			td = local[1] - t*16;
 			if (td < 0)
 				td = -td;
+			R_DlightDistances(local[0], td, smax, sdist);
 			for (s=0 ; s<smax ; s++)
 			{
-				sd = local[0] - s*16;
-				if (sd < 0)
-					sd = -sd;
-				if (sd > td)
-					dist = sd + (td>>1);
-				else
-					dist = td + (sd>>1);
+				dist = sdist[s];
 				if (dist < minlight)
 				{
 					brightness = rad - dist;
@@ -240,7 +603,6 @@ Combine and scale multiple lightmaps into the 8.8 format in blocklights
 */
 static void R_BuildLightMap(void)
 {
-   int i;
    unsigned scale;
    int maps;
    msurface_t *surf = r_drawsurf.surf;
@@ -251,15 +613,12 @@ static void R_BuildLightMap(void)
 
    if (r_fullbright.value || !cl.worldmodel->lightdata)
    {
-      for (i = 0; i < size; i++)
-         blocklights[i] = 0;
+      R_FillLights(blocklights, 0, size);
       return;
    }
 
    /* clear to ambient */
-   for (i = 0; i < size; i++)
-      blocklights[i] = r_refdef.ambientlight << 8;
-
+   R_FillLights(blocklights, r_refdef.ambientlight << 8, size);
 
    // add all the lightmaps
    if (lightmap)
@@ -267,8 +626,7 @@ static void R_BuildLightMap(void)
             maps++)
       {
          scale = r_drawsurf.lightadj[maps];	// 8.8 fraction
-         for (i = 0; i < size; i++)
-            blocklights[i] += lightmap[i] * scale;
+         R_AccumulateLights(blocklights, lightmap, scale, size);
          lightmap += size;	// skip to next lightmap
       }
    // add all the dynamic lights
@@ -276,31 +634,18 @@ static void R_BuildLightMap(void)
       R_AddDynamicLights();
 
    // bound, invert, and shift
-   for (i = 0; i < size; i++)
-   {
-      int t = (255 * 256 - (int)blocklights[i]) >> (8 - VID_CBITS);
-
-      if (t < (1 << 6))
-         t = (1 << 6);
-
-      blocklights[i] = t;
-   }
+   R_BoundLights(blocklights, size);
 }
 
 
 void R_BuildLightMapRGB (void)
 {
 	int			smax, tmax;
-	int			i, size;
+	int			size;
 	byte		*lightmap;
 	unsigned	scale;
 	int			maps;
 	msurface_t	*surf;
-	int r;
-	int sample;
-	int	shifted;
-		shifted = 0;
-		sample = 65536;
 
 	surf = r_drawsurf.surf;
 
@@ -311,28 +656,21 @@ void R_BuildLightMapRGB (void)
 
 	if (/* r_fullbright.value || */ !cl.worldmodel->lightdata)
 	{
-		for (i=0 ; i<size ; i++)
-			blocklights[i] = 0;
+		R_FillLights(blocklights, 0, size);
 		return;
 	}
 
 // clear to ambient
-	for (i=0 ; i<size ; i++)
-		blocklights[i] = r_refdef.ambientlight<<8;
+	R_FillLights(blocklights, r_refdef.ambientlight<<8, size);
 
 
-// add all the lightmaps
+// add all the lightmaps (the channels are interleaved, so just size of them)
 	if (lightmap)
 		for (maps = 0 ; maps < MAXLIGHTMAPS && surf->styles[maps] != 255 ;
 			 maps++)
 		{
 			scale = r_drawsurf.lightadj[maps];	// 8.8 fraction		
-			for (i=0 ; i<size ; i+=3)
-			{
-				blocklights[i]		+= lightmap[i] * scale;
-				blocklights[i+1]	+= lightmap[i+1] * scale;
-				blocklights[i+2]	+= lightmap[i+2] * scale;
-			}
+			R_AccumulateLights(blocklights, lightmap, scale, size);
 			lightmap += size;	// skip to next lightmap
 		}
 
@@ -368,11 +706,7 @@ void R_BuildLightMapRGB (void)
 		}
 	}
 */
-		for (i=0 ; i<size ; i++)
-	{
-		r = blocklights[i] >> shifted;
-		blocklights[i] = (r < 256) ? 256 : (r > sample) ? sample : r;	// leilei - made min 256 to rid visual artifacts and gain speed
-	}
+	R_ClampLightsRGB(blocklights, size);
 
 	
 }
@@ -463,7 +797,10 @@ void R_DrawSurface(void)
 
    //==============================
 
-   if (r_pixbytes == 1) {
+   if (r_truecolor) {
+      pblockdrawer = R_DrawSurfaceBlockRGB32;
+      horzblockstep = blocksize * sizeof(unsigned);
+   } else if (r_pixbytes == 1) {
       if (coloredlights)
          pblockdrawer = surfmiptableRGB[r_drawsurf.surfmip]; // 18-bit lookups
       else
@@ -750,6 +1087,63 @@ void R_DrawSurfaceBlockRGB_mip3()
 
 
 
+/*
+================
+R_DrawSurfaceBlockRGB32
+
+The 18-bit block drawers above for every mip level, with 32-bit texels
+(see d_colorview)
+================
+*/
+static void R_DrawSurfaceBlockRGB32(void)
+{
+	unsigned int				v, i;
+	unsigned int light[3];
+	unsigned int lightdelta[3], lightdeltastep[3];
+	unsigned char	pix, *psource;
+	unsigned *prowdest;
+	unsigned char *pix24;
+	unsigned trans[3];
+	const int shift = blockdivshift;
+	int c;
+
+	psource = pbasesource;
+	prowdest = prowdestbase;
+
+	for (v=0 ; v<r_numvblocks ; v++)
+	{
+		for (c = 0; c < 3; c++)
+		{
+			lightlefta[c] = r_lightptr[c];
+			lightrighta[c] = r_lightptr[3 + c];
+			lightdelta[c] = (lightlefta[c] - lightrighta[c]) >> shift;
+		}
+
+		r_lightptr += r_lightwidth * 3;
+
+		for (c = 0; c < 3; c++)
+		{
+			lightleftstepa[c] = (r_lightptr[c] - lightlefta[c]) >> shift;
+			lightrightstepa[c] = (r_lightptr[3 + c] - lightrighta[c]) >> shift;
+			lightdeltastep[c] = (lightleftstepa[c] - lightrightstepa[c]) >> shift;
+		}
+
+		for (i=0 ; i<(unsigned)blocksize ; i++)
+		{
+			switch (shift)
+			{
+				case 4: Mip0Stuff(MIPRGB32); break;
+				case 3: Mip1Stuff(MIPRGB32); break;
+				case 2: Mip2Stuff(MIPRGB32); break;
+				default: Mip3Stuff(MIPRGB32); break;
+			}
+		}
+
+		if (psource >= r_sourcemax)
+			psource -= r_stepback;
+	}
+}
+
 /*
 ================
 R_DrawSurfaceBlock8_mip0
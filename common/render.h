@@ -200,11 +200,16 @@ const model_loader_t *R_ModelLoader(void);
 // surface cache related
 //
 extern qboolean r_cache_thrash;	// set if thrashing the surface cache
+extern int r_cache_evictions;	// surface cache blocks evicted this frame
+extern int r_cache_bytesbuilt;	// texels drawn into the cache this frame
 
 int D_SurfaceCacheForRes(int width, int height);
 void D_FlushCaches(void);
 void D_DeleteSurfaceCache(void);
 void D_InitCaches(void *buffer, int size);
+void D_InitCacheStats(void);
+void D_EndCacheFrame(void);
+int D_AdaptCacheSize(int minsize, int maxsize);
 void R_SetVrect(const vrect_t *pvrectin, vrect_t *pvrect, int lineadj);
 
 #endif /* RENDER_H */
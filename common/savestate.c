@@ -0,0 +1,815 @@
+/*
+Copyright (C) 1996-1997 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+// savestate.c -- binary snapshots of a running local game
+
+/*
+ * Unlike the text savegames in host_cmd.c, a snapshot does not restart the
+ * server. It only overwrites the simulation state of the map that is already
+ * loaded: edicts, progs globals and dynamic strings, lightstyles, the client
+ * side view of the game, the loopback messages in flight between the two and
+ * the sound channels. That makes it cheap enough for the frontend to take
+ * one every frame for rewind and run-ahead.
+ *
+ * Values are stored in host byte order.
+ */
+
+#include <stddef.h>
+
+#include "client.h"
+#include "cmd.h"
+#include "console.h"
+#include "net_loop.h"
+#include "progs.h"
+#include "quakedef.h"
+#include "savestate.h"
+#include "server.h"
+#include "sound.h"
+#include "sys.h"
+#include "world.h"
+
+#define SAVESTATE_MAGIC		(('S' << 24) | ('S' << 16) | ('Q' << 8) | 'T')
+#define SAVESTATE_VERSION	2
+
+/*
+ * The frontend sizes its buffers once, so SaveState_Size never shrinks and
+ * leaves room for the game to grow.
+ */
+#define SAVESTATE_MIN_SIZE	(1024 * 1024)
+
+/*
+ * The client state up to here holds plain values only; what follows is
+ * fixed for the whole connection or holds pointers.
+ */
+#define CL_STATE_SIZE		offsetof(client_state_t, model_precache)
+
+/*
+==============================================================================
+
+SNAPSHOT BUFFERS
+
+==============================================================================
+*/
+
+void
+SaveBuf_Write(savebuf_t *buf, const void *data, int length)
+{
+    if (buf->overflowed || buf->cursize + length > buf->maxsize) {
+	buf->overflowed = true;
+	return;
+    }
+    if (buf->data)
+	memcpy(buf->data + buf->cursize, data, length);
+    buf->cursize += length;
+}
+
+void
+SaveBuf_WriteInt(savebuf_t *buf, int value)
+{
+    SaveBuf_Write(buf, &value, sizeof(value));
+}
+
+/* strings are stored with their terminator; a length of zero means NULL */
+void
+SaveBuf_WriteString(savebuf_t *buf, const char *s)
+{
+    int length = s ? strlen(s) + 1 : 0;
+
+    SaveBuf_WriteInt(buf, length);
+    if (length)
+	SaveBuf_Write(buf, s, length);
+}
+
+qboolean
+SaveBuf_Read(savebuf_t *buf, void *data, int length)
+{
+    if (buf->overflowed || length < 0 || buf->cursize + length > buf->maxsize) {
+	buf->overflowed = true;
+	memset(data, 0, length > 0 ? length : 0);
+	return false;
+    }
+    memcpy(data, buf->data + buf->cursize, length);
+    buf->cursize += length;
+
+    return true;
+}
+
+int
+SaveBuf_ReadInt(savebuf_t *buf)
+{
+    int value;
+
+    SaveBuf_Read(buf, &value, sizeof(value));
+
+    return value;
+}
+
+const char *
+SaveBuf_ReadString(savebuf_t *buf)
+{
+    const char *s;
+    int length;
+
+    length = SaveBuf_ReadInt(buf);
+    if (length <= 0 || buf->overflowed)
+	return NULL;
+    if (buf->cursize + length > buf->maxsize
+	|| buf->data[buf->cursize + length - 1]) {
+	buf->overflowed = true;
+	return NULL;
+    }
+    s = (const char *)buf->data + buf->cursize;
+    buf->cursize += length;
+
+    return s;
+}
+
+qboolean
+SaveBuf_Skip(savebuf_t *buf, int length)
+{
+    if (buf->overflowed || length < 0 || buf->cursize + length > buf->maxsize) {
+	buf->overflowed = true;
+	return false;
+    }
+    buf->cursize += length;
+
+    return true;
+}
+
+void
+SaveBuf_SkipString(savebuf_t *buf)
+{
+    SaveBuf_ReadString(buf);
+}
+
+/*
+==============================================================================
+
+SERVER
+
+==============================================================================
+*/
+
+static void
+SV_SaveState(savebuf_t *buf)
+{
+    int leafnum;
+
+    SaveBuf_Write(buf, &sv.time, sizeof(sv.time));
+    SaveBuf_WriteInt(buf, sv.paused);
+    SaveBuf_WriteInt(buf, sv.lastcheck);
+    SaveBuf_Write(buf, &sv.lastchecktime, sizeof(sv.lastchecktime));
+    leafnum = sv.checkleaf ? sv.checkleaf - sv.worldmodel->leafs : -1;
+    SaveBuf_WriteInt(buf, leafnum);
+    SaveBuf_Write(buf, &pr_randseed, sizeof(pr_randseed));
+
+    SaveBuf_Write(buf, pr_globals, progs->numglobals * 4);
+
+    SaveBuf_Write(buf, &svs.clients->cmd, sizeof(svs.clients->cmd));
+    SaveBuf_Write(buf, svs.clients->spawn_parms,
+		  sizeof(svs.clients->spawn_parms));
+    SaveBuf_WriteInt(buf, svs.clients->old_frags);
+}
+
+static void
+SV_LoadState(savebuf_t *buf)
+{
+    int leafnum;
+
+    SaveBuf_Read(buf, &sv.time, sizeof(sv.time));
+    sv.paused = SaveBuf_ReadInt(buf);
+    sv.lastcheck = SaveBuf_ReadInt(buf);
+    SaveBuf_Read(buf, &sv.lastchecktime, sizeof(sv.lastchecktime));
+    leafnum = SaveBuf_ReadInt(buf);
+    if (leafnum >= 0 && leafnum < sv.worldmodel->numleafs)
+	sv.checkleaf = sv.worldmodel->leafs + leafnum;
+    else
+	sv.checkleaf = NULL;
+    SaveBuf_Read(buf, &pr_randseed, sizeof(pr_randseed));
+
+    SaveBuf_Read(buf, pr_globals, progs->numglobals * 4);
+
+    SaveBuf_Read(buf, &svs.clients->cmd, sizeof(svs.clients->cmd));
+    SaveBuf_Read(buf, svs.clients->spawn_parms,
+		 sizeof(svs.clients->spawn_parms));
+    svs.clients->old_frags = SaveBuf_ReadInt(buf);
+}
+
+static void
+SV_CheckState(savebuf_t *buf)
+{
+    SaveBuf_Skip(buf, sizeof(sv.time) + 4 + 4 + sizeof(sv.lastchecktime) + 4
+		 + sizeof(pr_randseed));
+    SaveBuf_Skip(buf, progs->numglobals * 4);
+    SaveBuf_Skip(buf, sizeof(svs.clients->cmd)
+		 + sizeof(svs.clients->spawn_parms) + 4);
+}
+
+/*
+ * The variable sized parts of the server state go after the edicts, so
+ * that they don't move the edicts around within the snapshot.
+ */
+static void
+SV_SaveStrings(savebuf_t *buf)
+{
+    const sizebuf_t *message = &svs.clients->message;
+    int i;
+
+    for (i = 0; i < MAX_LIGHTSTYLES; i++)
+	SaveBuf_WriteString(buf, sv.lightstyles[i]);
+
+    PR_SaveStrings(buf);
+
+    SaveBuf_WriteInt(buf, message->cursize);
+    SaveBuf_Write(buf, message->data, message->cursize);
+}
+
+static void
+SV_LoadStrings(savebuf_t *buf)
+{
+    sizebuf_t *message = &svs.clients->message;
+    const char *style;
+    int i, length;
+
+    for (i = 0; i < MAX_LIGHTSTYLES; i++) {
+	style = SaveBuf_ReadString(buf);
+	if (!style)
+	    sv.lightstyles[i] = NULL;
+	else if (!sv.lightstyles[i] || strcmp(sv.lightstyles[i], style)) {
+	    sv.lightstyles[i] = PR_InternString(style);
+	    if (!sv.lightstyles[i]) {
+		buf->overflowed = true;
+		return;
+	    }
+	}
+    }
+
+    PR_LoadStrings(buf);
+
+    length = SaveBuf_ReadInt(buf);
+    SZ_Clear(message);
+    if (length < 0 || length > message->maxsize) {
+	buf->overflowed = true;
+	return;
+    }
+    if (SaveBuf_Read(buf, message->data, length))
+	message->cursize = length;
+
+    SZ_Clear(&sv.datagram);
+    SZ_Clear(&sv.reliable_datagram);
+}
+
+static void
+SV_CheckStrings(savebuf_t *buf)
+{
+    int i, length;
+
+    for (i = 0; i < MAX_LIGHTSTYLES; i++)
+	SaveBuf_SkipString(buf);
+
+    PR_CheckStrings(buf);
+
+    length = SaveBuf_ReadInt(buf);
+    if (length > svs.clients->message.maxsize)
+	buf->overflowed = true;
+    SaveBuf_Skip(buf, length);
+}
+
+/*
+==============================================================================
+
+EDICTS
+
+Every edict is stored as a record of the same size, so one that did not
+change since the previous snapshot comes out as the same bytes at the same
+offset. Frontends keep their rewind buffers as XOR/RLE deltas between
+consecutive snapshots, which then only grow with what actually changed.
+
+With savestate_trackdirty set, the last record written for each edict is
+kept to find the dirty edicts and fields, which savestate_stats reports.
+==============================================================================
+*/
+
+static cvar_t savestate_trackdirty = { "savestate_trackdirty", "0" };
+
+typedef struct {
+    int free;
+    float freetime;
+    entity_state_t baseline;
+    int fields[1];		// progs->entityfields
+} edictrecord_t;
+
+#define EDICT_RECORD_SIZE (offsetof(edictrecord_t, fields) + progs->entityfields * 4)
+
+static struct {
+    byte *records;		// last record written for each edict
+    int maxrecords;		// edicts with a valid record
+    int recordsize;
+    edict_t *edicts;		// sv.edicts the records belong to
+    char mapname[sizeof(sv.name)];
+    unsigned short crc;		// progs the fields belong to
+    int numfields;		// entries in fieldchanges
+
+    /* totals since the last reset */
+    int snapshots;
+    double bytes;
+    double seconds;
+    double dirtyedicts;
+    double dirtyfields;
+    double deltabytes;		// XOR/RLE delta from the previous snapshot
+    int *fieldchanges;		// per field word
+} ss_dirty;
+
+static void
+SaveState_FreeDirty(void)
+{
+    free(ss_dirty.records);
+    free(ss_dirty.fieldchanges);
+    memset(&ss_dirty, 0, sizeof(ss_dirty));
+}
+
+static qboolean
+SaveState_ResetDirty(void)
+{
+    SaveState_FreeDirty();
+
+    ss_dirty.recordsize = EDICT_RECORD_SIZE;
+    ss_dirty.edicts = sv.edicts;
+    strcpy(ss_dirty.mapname, sv.name);
+    ss_dirty.crc = pr_crc;
+    ss_dirty.records = malloc(sv.max_edicts * ss_dirty.recordsize);
+    ss_dirty.fieldchanges = calloc(progs->entityfields, sizeof(int));
+    if (!ss_dirty.records || !ss_dirty.fieldchanges) {
+	SaveState_FreeDirty();
+	Sys_Error("%s: out of memory", __func__);
+	return false;
+    }
+    ss_dirty.numfields = progs->entityfields;
+
+    return true;
+}
+
+/* the records and counters are for the game that is running now */
+static qboolean
+SaveState_DirtyCurrent(void)
+{
+    return ss_dirty.records && ss_dirty.edicts == sv.edicts
+	&& ss_dirty.crc == pr_crc && ss_dirty.numfields == progs->entityfields
+	&& !strcmp(ss_dirty.mapname, sv.name);
+}
+
+/*
+ * Compare a record against the previous one for the same edict; returns
+ * the size of an XOR/RLE delta between them (runs of changed words, each
+ * with a skip and count word).
+ */
+static int
+SaveState_DiffRecord(const edictrecord_t *record, const edictrecord_t *prev)
+{
+    const int *cur = (const int *)record;
+    const int *old = (const int *)prev;
+    int i, numwords, fieldofs, run, size;
+
+    numwords = ss_dirty.recordsize / 4;
+    fieldofs = offsetof(edictrecord_t, fields) / 4;
+    run = 0;
+    size = 0;
+    for (i = 0; i < numwords; i++) {
+	if (cur[i] == old[i]) {
+	    run = 0;
+	    continue;
+	}
+	if (!run++)
+	    size += 8;
+	size += 4;
+	if (i >= fieldofs) {
+	    ss_dirty.fieldchanges[i - fieldofs]++;
+	    ss_dirty.dirtyfields++;
+	}
+    }
+
+    return size;
+}
+
+static void
+SV_SaveEdict(savebuf_t *buf, const edict_t *ent)
+{
+    SaveBuf_WriteInt(buf, ent->free);
+    SaveBuf_Write(buf, &ent->freetime, sizeof(ent->freetime));
+    SaveBuf_Write(buf, &ent->baseline, sizeof(ent->baseline));
+    SaveBuf_Write(buf, &ent->v, progs->entityfields * 4);
+}
+
+static void
+SV_SaveEdicts(savebuf_t *buf)
+{
+    edictrecord_t *record;
+    const edict_t *ent;
+    byte *prev;
+    int i, delta;
+    double start;
+
+    SaveBuf_WriteInt(buf, sv.num_edicts);
+    if (!buf->data) {
+	SaveBuf_Write(buf, NULL, sv.num_edicts * EDICT_RECORD_SIZE);
+	return;
+    }
+
+    start = Sys_DoubleTime();
+    if (!savestate_trackdirty.value
+	|| (!SaveState_DirtyCurrent() && !SaveState_ResetDirty())) {
+	if (ss_dirty.records)
+	    SaveState_FreeDirty();
+	for (i = 0; i < sv.num_edicts; i++)
+	    SV_SaveEdict(buf, EDICT_NUM(i));
+	return;
+    }
+
+    delta = 0;
+    for (i = 0; i < sv.num_edicts; i++) {
+	ent = EDICT_NUM(i);
+	record = (edictrecord_t *)(buf->data + buf->cursize);
+	SV_SaveEdict(buf, ent);
+	if (buf->overflowed)
+	    return;
+
+	prev = ss_dirty.records + i * ss_dirty.recordsize;
+	if (i >= ss_dirty.maxrecords) {
+	    delta += ss_dirty.recordsize;
+	    ss_dirty.dirtyedicts++;
+	} else if (memcmp(record, prev, ss_dirty.recordsize)) {
+	    delta += SaveState_DiffRecord(record, (edictrecord_t *)prev);
+	    ss_dirty.dirtyedicts++;
+	} else {
+	    continue;
+	}
+	memcpy(prev, record, ss_dirty.recordsize);
+    }
+    ss_dirty.maxrecords = qmax(ss_dirty.maxrecords, sv.num_edicts);
+
+    ss_dirty.snapshots++;
+    ss_dirty.deltabytes += delta;
+    ss_dirty.seconds += Sys_DoubleTime() - start;
+}
+
+static void
+SV_LoadEdicts(savebuf_t *buf)
+{
+    edict_t *ent;
+    int i, num_edicts;
+
+    num_edicts = SaveBuf_ReadInt(buf);
+    if (num_edicts < 1 || num_edicts > sv.max_edicts) {
+	buf->overflowed = true;
+	return;
+    }
+
+    /* the links and find() indexes are rebuilt from scratch below */
+    SV_ClearWorld();
+    ED_ClearFindIndex();
+    for (i = 0; i < qmax(num_edicts, sv.num_edicts); i++) {
+	ent = EDICT_NUM(i);
+	ent->area.prev = ent->area.next = NULL;
+    }
+
+    for (i = 0; i < num_edicts; i++) {
+	ent = EDICT_NUM(i);
+	ent->free = SaveBuf_ReadInt(buf);
+	SaveBuf_Read(buf, &ent->freetime, sizeof(ent->freetime));
+	SaveBuf_Read(buf, &ent->baseline, sizeof(ent->baseline));
+	SaveBuf_Read(buf, &ent->v, progs->entityfields * 4);
+    }
+    for (; i < sv.num_edicts; i++) {
+	ent = EDICT_NUM(i);
+	memset(&ent->v, 0, progs->entityfields * 4);
+	ent->free = true;
+	ent->freetime = 0;
+    }
+    sv.num_edicts = num_edicts;
+    ED_ResetFreeList();
+
+    for (i = 1; i < sv.num_edicts; i++) {
+	ent = EDICT_NUM(i);
+	if (!ent->free)
+	    SV_LinkEdict(ent, false);
+    }
+}
+
+static void
+SV_CheckEdicts(savebuf_t *buf)
+{
+    int num_edicts;
+
+    num_edicts = SaveBuf_ReadInt(buf);
+    if (num_edicts < 1 || num_edicts > sv.max_edicts) {
+	buf->overflowed = true;
+	return;
+    }
+    SaveBuf_Skip(buf, num_edicts * EDICT_RECORD_SIZE);
+}
+
+/*
+================
+SaveState_Stats_f
+================
+*/
+static void
+SaveState_Stats_f(void)
+{
+    int i, j, best, n;
+    ddef_t *def;
+
+    if (!savestate_trackdirty.value) {
+	Con_Printf("set savestate_trackdirty to collect snapshot stats\n");
+	return;
+    }
+    n = ss_dirty.snapshots;
+    if (!n || !SaveState_DirtyCurrent()) {
+	Con_Printf("no snapshots taken on this map\n");
+	return;
+    }
+
+    Con_Printf("%d snapshots, %.0f bytes each, %.1f us to encode the edicts\n",
+	       n, ss_dirty.bytes / n, ss_dirty.seconds * 1e6 / n);
+    Con_Printf("per snapshot: %.1f dirty edicts, %.1f dirty fields, "
+	       "%.0f byte delta\n", ss_dirty.dirtyedicts / n,
+	       ss_dirty.dirtyfields / n, ss_dirty.deltabytes / n);
+
+    /* the five fields changing most often */
+    for (i = 0; i < 5; i++) {
+	best = -1;
+	for (j = 0; j < ss_dirty.numfields; j++)
+	    if (ss_dirty.fieldchanges[j] > 0
+		&& (best < 0 || ss_dirty.fieldchanges[j] > ss_dirty.fieldchanges[best]))
+		best = j;
+	if (best < 0)
+	    break;
+	def = ED_FieldAtOfs(best);
+	Con_Printf("  %-16s %.1f\n", def ? PR_GetString(def->s_name) : "?",
+		   (double)ss_dirty.fieldchanges[best] / n);
+	ss_dirty.fieldchanges[best] = -ss_dirty.fieldchanges[best];
+    }
+    for (j = 0; j < ss_dirty.numfields; j++)
+	if (ss_dirty.fieldchanges[j] < 0)
+	    ss_dirty.fieldchanges[j] = -ss_dirty.fieldchanges[j];
+}
+
+void
+SaveState_Init(void)
+{
+    Cvar_RegisterVariable(&savestate_trackdirty);
+    Cmd_AddCommand("savestate_stats", SaveState_Stats_f);
+}
+
+/*
+==============================================================================
+
+CLIENT
+
+==============================================================================
+*/
+
+static void
+CL_SaveState(savebuf_t *buf)
+{
+    const dlight_t *dl;
+    int i, color;
+
+    SaveBuf_Write(buf, &cl, CL_STATE_SIZE);
+    SaveBuf_Write(buf, cl_lightstyle, sizeof(cl_lightstyle));
+
+    for (i = 0, dl = cl_dlights; i < MAX_DLIGHTS; i++, dl++) {
+	SaveBuf_WriteInt(buf, dl->key);
+	SaveBuf_Write(buf, dl->origin, sizeof(dl->origin));
+	SaveBuf_Write(buf, &dl->radius, sizeof(dl->radius));
+	SaveBuf_Write(buf, &dl->die, sizeof(dl->die));
+	SaveBuf_Write(buf, &dl->decay, sizeof(dl->decay));
+	SaveBuf_Write(buf, &dl->minlight, sizeof(dl->minlight));
+	color = dl->color ? (dl->color - dl_colors[0]) / 4 : -1;
+	SaveBuf_WriteInt(buf, color);
+    }
+
+    for (i = 0; i < cl.maxclients; i++)
+	SaveBuf_WriteInt(buf, cl.players[i].frags);
+}
+
+static void
+CL_LoadState(savebuf_t *buf)
+{
+    dlight_t *dl;
+    int i, color;
+
+    SaveBuf_Read(buf, &cl, CL_STATE_SIZE);
+    SaveBuf_Read(buf, cl_lightstyle, sizeof(cl_lightstyle));
+
+    for (i = 0, dl = cl_dlights; i < MAX_DLIGHTS; i++, dl++) {
+	dl->key = SaveBuf_ReadInt(buf);
+	SaveBuf_Read(buf, dl->origin, sizeof(dl->origin));
+	SaveBuf_Read(buf, &dl->radius, sizeof(dl->radius));
+	SaveBuf_Read(buf, &dl->die, sizeof(dl->die));
+	SaveBuf_Read(buf, &dl->decay, sizeof(dl->decay));
+	SaveBuf_Read(buf, &dl->minlight, sizeof(dl->minlight));
+	color = SaveBuf_ReadInt(buf);
+	dl->color = (color >= 0 && color < 4) ? dl_colors[color] : NULL;
+    }
+
+    for (i = 0; i < cl.maxclients; i++)
+	cl.players[i].frags = SaveBuf_ReadInt(buf);
+
+    /* snap entities to their next update instead of lerping to it */
+    for (i = 0; i < MAX_EDICTS; i++)
+	cl_entities[i].msgtime = 0;
+}
+
+static void
+CL_CheckState(savebuf_t *buf)
+{
+    const dlight_t *dl = cl_dlights;
+
+    SaveBuf_Skip(buf, CL_STATE_SIZE + sizeof(cl_lightstyle));
+    SaveBuf_Skip(buf, MAX_DLIGHTS * (4 + sizeof(dl->origin)
+				     + sizeof(dl->radius) + sizeof(dl->die)
+				     + sizeof(dl->decay) + sizeof(dl->minlight)
+				     + 4));
+    SaveBuf_Skip(buf, cl.maxclients * 4);
+}
+
+/*
+==============================================================================
+
+SNAPSHOTS
+
+==============================================================================
+*/
+
+static int savestate_size = SAVESTATE_MIN_SIZE;
+
+static qboolean
+SaveState_Available(void)
+{
+    if (!sv.active || svs.maxclients != 1 || !svs.clients->active)
+	return false;
+    if (cls.state != ca_active || cls.demoplayback)
+	return false;
+
+    return true;
+}
+
+static void
+SaveState_Write(savebuf_t *buf)
+{
+    int lengthofs;
+
+    SaveBuf_WriteInt(buf, SAVESTATE_MAGIC);
+    SaveBuf_WriteInt(buf, SAVESTATE_VERSION);
+    lengthofs = buf->cursize;
+    SaveBuf_WriteInt(buf, 0);
+    SaveBuf_WriteInt(buf, pr_crc);
+    SaveBuf_Write(buf, sv.name, sizeof(sv.name));
+    SaveBuf_WriteInt(buf, progs->entityfields);
+    SaveBuf_WriteInt(buf, progs->numglobals);
+
+    SV_SaveState(buf);
+    CL_SaveState(buf);
+    SV_SaveEdicts(buf);
+
+    SV_SaveStrings(buf);
+    Loop_SaveState(buf);
+    S_SaveChannels(buf);
+
+    if (buf->data && !buf->overflowed)
+	memcpy(buf->data + lengthofs, &buf->cursize, sizeof(buf->cursize));
+}
+
+/*
+ * Walk the sections after the header without loading anything. A good
+ * snapshot ends exactly where its header says it does.
+ */
+static qboolean
+SaveState_Check(savebuf_t *buf)
+{
+    SV_CheckState(buf);
+    CL_CheckState(buf);
+    SV_CheckEdicts(buf);
+
+    SV_CheckStrings(buf);
+    Loop_CheckState(buf);
+    S_CheckChannels(buf);
+
+    return !buf->overflowed && buf->cursize == buf->maxsize;
+}
+
+/*
+================
+SaveState_Size
+
+Upper bound on the size of a snapshot. Grows with the largest game seen
+so far but never shrinks.
+================
+*/
+int
+SaveState_Size(void)
+{
+    savebuf_t buf;
+
+    if (SaveState_Available()) {
+	memset(&buf, 0, sizeof(buf));
+	buf.maxsize = 0x7fffffff;
+	SaveState_Write(&buf);
+
+	/* headroom for more edicts and strings later in the map */
+	buf.cursize += buf.cursize / 2;
+	if (savestate_size < buf.cursize)
+	    savestate_size = buf.cursize;
+    }
+
+    return savestate_size;
+}
+
+qboolean
+SaveState_Save(void *data, int size)
+{
+    savebuf_t buf;
+
+    if (!SaveState_Available())
+	return false;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.data = data;
+    buf.maxsize = size;
+    SaveState_Write(&buf);
+    if (!buf.overflowed && ss_dirty.records)
+	ss_dirty.bytes += buf.cursize;
+
+    return !buf.overflowed;
+}
+
+qboolean
+SaveState_Load(const void *data, int size)
+{
+    savebuf_t buf, check;
+    char name[sizeof(sv.name)];
+    int length, crc, entityfields, numglobals;
+
+    if (!SaveState_Available())
+	return false;
+
+    memset(&buf, 0, sizeof(buf));
+    buf.data = (byte *)data;
+    buf.maxsize = size;
+
+    if (SaveBuf_ReadInt(&buf) != SAVESTATE_MAGIC
+	|| SaveBuf_ReadInt(&buf) != SAVESTATE_VERSION)
+	return false;
+    length = SaveBuf_ReadInt(&buf);
+    crc = SaveBuf_ReadInt(&buf);
+    SaveBuf_Read(&buf, name, sizeof(name));
+    entityfields = SaveBuf_ReadInt(&buf);
+    numglobals = SaveBuf_ReadInt(&buf);
+
+    if (buf.overflowed || length > size)
+	return false;
+    if (crc != pr_crc || entityfields != progs->entityfields
+	|| numglobals != progs->numglobals)
+	return false;
+    name[sizeof(name) - 1] = 0;
+    if (strcmp(name, sv.name))
+	return false;
+    buf.maxsize = length;
+
+    /* nothing is touched until the whole snapshot is known to be good */
+    check = buf;
+    if (!SaveState_Check(&check)) {
+	Con_Printf("%s: corrupt snapshot\n", __func__);
+	return false;
+    }
+
+    SV_LoadState(&buf);
+    CL_LoadState(&buf);
+    SV_LoadEdicts(&buf);
+
+    SV_LoadStrings(&buf);
+    Loop_LoadState(&buf);
+    S_LoadChannels(&buf);
+
+    if (buf.overflowed)
+	Con_Printf("%s: truncated snapshot\n", __func__);
+
+    return !buf.overflowed;
+}
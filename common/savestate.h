@@ -0,0 +1,64 @@
+/*
+Copyright (C) 1996-1997 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+// savestate.h -- binary snapshots of a running local game
+
+#include "qtypes.h"
+
+/*
+ * A snapshot is written straight into the caller's buffer. With a NULL
+ * data pointer nothing is stored and cursize only measures the snapshot.
+ */
+typedef struct {
+    byte *data;
+    int maxsize;
+    int cursize;
+    qboolean overflowed;	// ran past maxsize; the snapshot is invalid
+} savebuf_t;
+
+void SaveBuf_Write(savebuf_t *buf, const void *data, int length);
+void SaveBuf_WriteInt(savebuf_t *buf, int value);
+void SaveBuf_WriteString(savebuf_t *buf, const char *s);
+
+qboolean SaveBuf_Read(savebuf_t *buf, void *data, int length);
+int SaveBuf_ReadInt(savebuf_t *buf);
+const char *SaveBuf_ReadString(savebuf_t *buf);	// NULL if none written
+
+/*
+ * A snapshot is checked from end to end before any of it is loaded. The
+ * check functions walk the same layout as the loaders, but only move the
+ * cursor; anything out of range sets overflowed.
+ */
+qboolean SaveBuf_Skip(savebuf_t *buf, int length);
+void SaveBuf_SkipString(savebuf_t *buf);
+
+/*
+ * Snapshots can only be taken of, and restored into, an active single
+ * player game on the map they were taken on.
+ */
+int SaveState_Size(void);
+qboolean SaveState_Save(void *data, int size);
+qboolean SaveState_Load(const void *data, int size);
+void SaveState_Init(void);
+
+#endif /* SAVESTATE_H */
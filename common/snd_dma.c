@@ -515,6 +515,71 @@ S_StopAllSoundsC(void)
     S_StopAllSounds(true);
 }
 
+/*
+ * Channels are saved with their sfx by name and their end time relative to
+ * paintedtime, so they carry on from wherever the mixer is on restore.
+ */
+void
+S_SaveChannels(savebuf_t *buf)
+{
+    channel_t ch;
+    int i, count;
+
+    count = sound_started ? total_channels : 0;
+    SaveBuf_WriteInt(buf, count);
+    for (i = 0; i < count; i++) {
+	ch = channels[i];
+	SaveBuf_WriteString(buf, ch.sfx ? ch.sfx->name : NULL);
+	ch.sfx = NULL;
+	ch.end -= paintedtime;
+	SaveBuf_Write(buf, &ch, sizeof(ch));
+    }
+}
+
+void
+S_LoadChannels(savebuf_t *buf)
+{
+    channel_t ch;
+    const char *name;
+    int i, count;
+
+    count = SaveBuf_ReadInt(buf);
+    if (count < 0 || count > MAX_CHANNELS) {
+	buf->overflowed = true;
+	return;
+    }
+    if (sound_started)
+	memset(channels, 0, MAX_CHANNELS * sizeof(channel_t));
+
+    for (i = 0; i < count; i++) {
+	name = SaveBuf_ReadString(buf);
+	SaveBuf_Read(buf, &ch, sizeof(ch));
+	if (!sound_started)
+	    continue;
+	ch.sfx = name ? S_FindName(name) : NULL;
+	ch.end += paintedtime;
+	channels[i] = ch;
+    }
+    if (sound_started && count)
+	total_channels = count;
+}
+
+void
+S_CheckChannels(savebuf_t *buf)
+{
+    int i, count;
+
+    count = SaveBuf_ReadInt(buf);
+    if (count < 0 || count > MAX_CHANNELS) {
+	buf->overflowed = true;
+	return;
+    }
+    for (i = 0; i < count; i++) {
+	SaveBuf_SkipString(buf);
+	SaveBuf_Skip(buf, sizeof(channel_t));
+    }
+}
+
 void S_ClearBuffer(void)
 {
    if (!sound_started || !shm)
@@ -111,7 +111,7 @@ sfxcache_t *
 S_LoadSound(sfx_t *s)
 {
     char namebuffer[256];
-    byte *data;
+    const byte *data;
     wavinfo_t *info;
     int len;
     float stepscale;
@@ -130,7 +130,9 @@ S_LoadSound(sfx_t *s)
 
 //      Con_Printf ("loading %s\n",namebuffer);
 
-    data = (byte*)COM_LoadStackFile(namebuffer, stackbuf, sizeof(stackbuf), NULL);
+    data = (const byte*)COM_MapFile(namebuffer, NULL);
+    if (!data)
+	data = (byte*)COM_LoadStackFile(namebuffer, stackbuf, sizeof(stackbuf), NULL);
 
     if (!data) {
 	Con_Printf("Couldn't load %s\n", namebuffer);
@@ -243,7 +245,7 @@ GetWavinfo
 ============
 */
 
-wavinfo_t *GetWavinfo (const char *name, byte *wav, int wavlength)
+wavinfo_t *GetWavinfo (const char *name, const byte *wav, int wavlength)
 {
    static wavinfo_t info;
    int format;
@@ -24,6 +24,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "cvar.h"
 #include "mathlib.h"
 #include "qtypes.h"
+#include "savestate.h"
 #include "zone.h"
 
 #ifdef NQ_HACK
@@ -120,6 +121,9 @@ void S_PaintChannels(int endtime);
 void S_InitPaintChannels(void);
 
 /* music stream support */
+void S_SaveChannels(savebuf_t *buf);
+void S_LoadChannels(savebuf_t *buf);
+void S_CheckChannels(savebuf_t *buf);
 void S_RawSamples(int samples, int rate, int width, int channels, byte * data, float volume);
 				/* Expects data in signed 16 bit, or unsigned 8 bit format. */
 
@@ -169,7 +173,7 @@ sfxcache_t *S_LoadSound(sfx_t *s);
 
 void SND_InitScaletable(void);
 void SNDDMA_Submit(void);
-wavinfo_t *GetWavinfo (const char *name, byte *wav, int wavlength);
+wavinfo_t *GetWavinfo (const char *name, const byte *wav, int wavlength);
 
 void S_AmbientOff(void);
 void S_AmbientOn(void);
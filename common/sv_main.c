@@ -162,6 +162,8 @@ void SV_Init(void)
     Cvar_RegisterVariable(&sv_aim);
     Cvar_RegisterVariable(&sv_nostep);
 
+    SV_InitWorld();
+
     Cmd_AddCommand("sv_protocol", SV_Protocol_f);
     Cmd_SetCompletion("sv_protocol", SV_Protocol_Arg_f);
 
@@ -548,11 +550,7 @@ void SV_WriteEntitiesToClient(edict_t *clent, sizebuf_t *msg)
             continue;
 
          // ignore if not touching a PV leaf
-         for (i = 0; i < ent->num_leafs; i++)
-            if (Mod_TestLeafBit(pvs, ent->leafnums[i]))
-               break;
-
-         if (i == ent->num_leafs)
+         if (!Mod_TestLeafBits(pvs, ent->leafnums, ent->num_leafs))
             continue;	// not visible
       }
 
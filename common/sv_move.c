@@ -47,8 +47,11 @@ int c_yes, c_no;
 qboolean SV_CheckBottom(edict_t *ent)
 {
    vec3_t mins, maxs, start, stop;
-   trace_t trace;
-   int x, y;
+   vec3_t corners[4];
+   int contents[4];
+   svmove_t moves[4];
+   trace_t trace, traces[4];
+   int i, x, y;
    float mid, bottom;
 
    VectorAdd(ent->v.origin, ent->v.mins, mins);
@@ -57,14 +60,16 @@ qboolean SV_CheckBottom(edict_t *ent)
    // if all of the points under the corners are solid world, don't bother
    // with the tougher checks
    // the corners must be within 16 of the midpoint
-   start[2] = mins[2] - 1;
-   for (x = 0; x <= 1; x++)
-      for (y = 0; y <= 1; y++) {
-         start[0] = x ? maxs[0] : mins[0];
-         start[1] = y ? maxs[1] : mins[1];
-         if (SV_PointContents(start) != CONTENTS_SOLID)
-            goto realcheck;
+   for (x = 0, i = 0; x <= 1; x++)
+      for (y = 0; y <= 1; y++, i++) {
+         corners[i][0] = x ? maxs[0] : mins[0];
+         corners[i][1] = y ? maxs[1] : mins[1];
+         corners[i][2] = mins[2] - 1;
       }
+   SV_PointContentsBatch((const vec3_t *)corners, contents, 4);
+   for (i = 0; i < 4; i++)
+      if (contents[i] != CONTENTS_SOLID)
+         goto realcheck;
 
    c_yes++;
    return true;		// we got out easy
@@ -87,18 +92,25 @@ realcheck:
    mid = bottom = trace.endpos[2];
 
    // the corners must be within 16 of the midpoint
-   for (x = 0; x <= 1; x++)
-      for (y = 0; y <= 1; y++) {
-         start[0] = stop[0] = x ? maxs[0] : mins[0];
-         start[1] = stop[1] = y ? maxs[1] : mins[1];
-
-         trace = SV_Move(start, vec3_origin, vec3_origin, stop, true, ent);
-
-         if (trace.fraction != 1.0 && trace.endpos[2] > bottom)
-            bottom = trace.endpos[2];
-         if (trace.fraction == 1.0 || mid - trace.endpos[2] > STEPSIZE)
-            return false;
+   for (x = 0, i = 0; x <= 1; x++)
+      for (y = 0; y <= 1; y++, i++) {
+         moves[i].start[0] = moves[i].end[0] = x ? maxs[0] : mins[0];
+         moves[i].start[1] = moves[i].end[1] = y ? maxs[1] : mins[1];
+         moves[i].start[2] = start[2];
+         moves[i].end[2] = stop[2];
+         VectorCopy(vec3_origin, moves[i].mins);
+         VectorCopy(vec3_origin, moves[i].maxs);
+         moves[i].type = true;
+         moves[i].passedict = ent;
       }
+   SV_MoveBatch(moves, traces, 4);
+
+   for (i = 0; i < 4; i++) {
+      if (traces[i].fraction != 1.0 && traces[i].endpos[2] > bottom)
+         bottom = traces[i].endpos[2];
+      if (traces[i].fraction == 1.0 || mid - traces[i].endpos[2] > STEPSIZE)
+         return false;
+   }
 
    c_yes++;
    return true;
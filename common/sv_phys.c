@@ -1257,6 +1257,8 @@ SV_Physics(void)
    edict_t *ent2;
 #endif
 
+   SV_ClearTraceCache();
+
    /* let the progs know that a new frame has started */
    pr_global_struct->self  = EDICT_TO_PROG(sv.edicts);
    pr_global_struct->other = EDICT_TO_PROG(sv.edicts);
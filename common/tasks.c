@@ -0,0 +1,190 @@
+/*
+Copyright (C) 1996-1997 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+// tasks.c -- worker thread pool
+
+#include "qtypes.h"
+#include "tasks.h"
+
+#ifdef HAVE_THREADS
+#include <rthreads/rthreads.h>
+
+static struct {
+    slock_t *lock;
+    scond_t *work;		// signalled when a new job is posted
+    scond_t *done;		// signalled when the last index completes
+    sthread_t *threads[MAX_TASK_THREADS];
+    int numworkers;
+    qboolean quit;
+
+    unsigned generation;
+    taskfunc_t func;
+    void *data;
+    int count;
+    int next;
+    int pending;
+} pool;
+#endif
+
+static int task_threads = 1;
+
+#ifdef HAVE_THREADS
+/*
+ * Hand out indices of the current job until none are left. Called with the
+ * pool lock held; the lock is dropped around each job.
+ */
+static void
+Tasks_Drain(void)
+{
+    while (pool.next < pool.count) {
+	int index = pool.next++;
+
+	slock_unlock(pool.lock);
+	pool.func(pool.data, index);
+	slock_lock(pool.lock);
+
+	if (--pool.pending == 0)
+	    scond_signal(pool.done);
+    }
+}
+
+static void
+Tasks_Worker(void *unused)
+{
+    unsigned seen = 0;
+
+    slock_lock(pool.lock);
+    seen = pool.generation;
+    for (;;) {
+	while (!pool.quit && pool.generation == seen)
+	    scond_wait(pool.work, pool.lock);
+	if (pool.quit)
+	    break;
+	seen = pool.generation;
+	Tasks_Drain();
+    }
+    slock_unlock(pool.lock);
+}
+
+static void
+Tasks_StopWorkers(void)
+{
+    int i;
+
+    if (!pool.numworkers)
+	return;
+
+    slock_lock(pool.lock);
+    pool.quit = true;
+    scond_broadcast(pool.work);
+    slock_unlock(pool.lock);
+
+    for (i = 0; i < pool.numworkers; i++)
+	sthread_join(pool.threads[i]);
+    pool.numworkers = 0;
+    pool.quit = false;
+}
+
+static void
+Tasks_StartWorkers(int count)
+{
+    if (!pool.lock) {
+	pool.lock = slock_new();
+	pool.work = scond_new();
+	pool.done = scond_new();
+	if (!pool.lock || !pool.work || !pool.done)
+	    return;
+    }
+
+    while (pool.numworkers < count) {
+	sthread_t *thread = sthread_create(Tasks_Worker, NULL);
+	if (!thread)
+	    break;
+	pool.threads[pool.numworkers++] = thread;
+    }
+}
+#endif
+
+void
+Tasks_SetThreads(int numthreads)
+{
+    if (numthreads < 1)
+	numthreads = 1;
+    if (numthreads > MAX_TASK_THREADS)
+	numthreads = MAX_TASK_THREADS;
+#ifdef HAVE_THREADS
+    task_threads = numthreads;
+#endif
+}
+
+int
+Tasks_NumThreads(void)
+{
+    return task_threads;
+}
+
+void
+Tasks_Shutdown(void)
+{
+#ifdef HAVE_THREADS
+    Tasks_StopWorkers();
+    scond_free(pool.done);
+    scond_free(pool.work);
+    slock_free(pool.lock);
+    pool.done = NULL;
+    pool.work = NULL;
+    pool.lock = NULL;
+#endif
+    task_threads = 1;
+}
+
+void
+Tasks_Run(taskfunc_t func, void *data, int count)
+{
+    int i;
+
+#ifdef HAVE_THREADS
+    if (task_threads > 1 && count > 1) {
+	if (pool.numworkers != task_threads - 1) {
+	    Tasks_StopWorkers();
+	    Tasks_StartWorkers(task_threads - 1);
+	    task_threads = pool.numworkers + 1;
+	}
+	if (pool.numworkers) {
+	    slock_lock(pool.lock);
+	    pool.func = func;
+	    pool.data = data;
+	    pool.count = count;
+	    pool.next = 0;
+	    pool.pending = count;
+	    pool.generation++;
+	    scond_broadcast(pool.work);
+
+	    Tasks_Drain();
+	    while (pool.pending)
+		scond_wait(pool.done, pool.lock);
+	    slock_unlock(pool.lock);
+	    return;
+	}
+    }
+#endif
+
+    for (i = 0; i < count; i++)
+	func(data, i);
+}
@@ -0,0 +1,46 @@
+/*
+Copyright (C) 1996-1997 Id Software, Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+
+#ifndef TASKS_H
+#define TASKS_H
+
+// tasks.h -- a small pool of worker threads for data-parallel jobs
+
+#define MAX_TASK_THREADS 16
+
+typedef void (*taskfunc_t)(void *data, int index);
+
+/*
+ * Set the number of threads taking part in Tasks_Run, counting the caller.
+ * Workers are (re)started lazily; without HAVE_THREADS this is a no-op and
+ * every job runs on the calling thread.
+ */
+void Tasks_SetThreads(int numthreads);
+int Tasks_NumThreads(void);
+void Tasks_Shutdown(void);
+
+/*
+ * Call func(data, i) for every i in [0, count) and return once all of them
+ * have completed. The calling thread takes jobs as well; the order in which
+ * indices are handed out is unspecified, so jobs must not depend on it.
+ */
+void Tasks_Run(taskfunc_t func, void *data, int count);
+
+#endif /* TASKS_H */
@@ -53,6 +53,7 @@ typedef struct {
     int maxwarpwidth;
     int maxwarpheight;
     pixel_t *direct;		// direct drawing to framebuffer, if not NULL
+    unsigned *colorbuffer;	// true color view, if not NULL (see d_colorview)
 } viddef_t;
 
 extern viddef_t vid;		// global video state
@@ -70,6 +71,10 @@ void VID_ShiftPalette(unsigned char *palette);
 
 // called for bonus and pain flashes, and for underwater color changes
 
+void VID_SetColorRamps(byte colorramps[3][256]);
+
+// the same shifts and gamma as per channel ramps, for true color output
+
 extern unsigned short ramps[3][256];
 extern void (*VID_SetGammaRamp)(unsigned short ramp[3][256]);
 
@@ -505,6 +505,7 @@ void V_UpdatePalette(void)
    qboolean newobj;
    byte *basepal, *newpal;
    byte pal[768];
+   byte colorramps[3][256];
    qboolean force;
 
    V_CalcPowerupCshift();
@@ -561,6 +562,23 @@ void V_UpdatePalette(void)
    }
 
    VID_ShiftPalette(pal);
+
+   /* the same shifts applied to every level of each channel */
+   for (i = 0; i < 256; i++)
+   {
+      int c[3] = { i, i, i };
+      int k;
+
+      for (j = 0; j < NUM_CSHIFTS; j++)
+         for (k = 0; k < 3; k++)
+            c[k] += (cl.cshifts[j].percent *
+                  (cl.cshifts[j].destcolor[k] - c[k])) >> 8;
+
+      for (k = 0; k < 3; k++)
+         colorramps[k][i] = gammatable[c[k]];
+   }
+
+   VID_SetColorRamps(colorramps);
 }
 
 /*
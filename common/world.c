@@ -19,8 +19,16 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 */
 // world.c -- world query functions
 
+#include <stdlib.h>
+
+#if defined(__x86_64__) && defined(__SSE2__) && !defined(__FMA__)
+#include <emmintrin.h>
+#endif
+
 #include "bspfile.h"
+#include "cmd.h"
 #include "console.h"
+#include "cvar.h"
 #include "mathlib.h"
 #include "model.h"
 #include "progs.h"
@@ -243,13 +251,84 @@ typedef struct areanode_s {
     struct areanode_s *children[2];
     link_t trigger_edicts;
     link_t solid_edicts;
+
+    /*
+     * A box reaches the node when its maxs are above every reachmin and
+     * its mins below every reachmax; bit 1 << axis of reachmask (and of
+     * reachmask >> 2 for reachmax) says whether there is a bound at all.
+     */
+    int reachmask;
+    float reachmin[2], reachmax[2];
 } areanode_t;
 
-#define	AREA_DEPTH	4
-#define	AREA_NODES	32
+/*
+ * The tree is at least AREA_DEPTH levels deep, and goes deeper on maps
+ * with many entities, aiming for AREA_LEAF_EDICTS per leaf. Cells are not
+ * split below AREA_MIN_SIZE units across. sv_areadepth forces a depth
+ * instead; 4 gives the original fixed tree. The new value is used from the
+ * next map.
+ */
+#define	AREA_DEPTH		4
+#define	AREA_MAX_DEPTH		8
+#define	AREA_NODES		((2 << AREA_MAX_DEPTH) - 1)
+#define	AREA_MIN_SIZE		256
+#define	AREA_LEAF_EDICTS	8
+
+cvar_t sv_areadepth = { "sv_areadepth", "0" };
 
 static areanode_t sv_areanodes[AREA_NODES];
 static int sv_numareanodes;
+static int sv_areadepth_built;
+
+static struct {
+   uint64_t traces;
+   uint64_t nodes;		// nodes visited by traces
+   uint64_t tested;		// edicts looked at by traces
+   uint64_t clipped;		// edicts traces did an exact clip against
+   uint64_t touches;		// SV_LinkEdict calls that touched triggers
+   uint64_t touchtested;	// edicts looked at for those
+   uint64_t links;		// edicts linked into the tree
+   uint64_t cachelookups;	// SV_Move calls with the trace cache on
+   uint64_t cachehits;
+   uint64_t cacheflushed;	// cached traces dropped by a link or unlink
+} sv_areastats;
+
+/*
+ * With sv_tracecache set, SV_Move remembers its results until the end of
+ * the server frame. A cached trace is dropped as soon as an edict whose
+ * box touches the box of the move is linked or unlinked. Changes that
+ * don't go through SV_LinkEdict, like progs changing an owner or solid
+ * type in place, are not noticed, which is why it is off by default.
+ */
+#define TRACE_CACHE_SIZE	256	// power of two
+
+typedef struct {
+   vec3_t start, mins, maxs, end;
+   int type;
+   edict_t *passedict;
+} tracekey_t;
+
+typedef struct {
+   tracekey_t key;
+   int frame;			// only valid while this is sv_traceframe
+   vec3_t boxmins, boxmaxs;
+   trace_t trace;
+} tracecache_t;
+
+cvar_t sv_tracecache = { "sv_tracecache", "0" };
+
+static tracecache_t sv_tracecache_entries[TRACE_CACHE_SIZE];
+static int sv_traceframe = 1;
+static int sv_tracecache_used;	// entries filled this frame
+
+/*
+ * Edicts whose area fields were written since they were last linked may
+ * sit in the wrong node, so area queries check everything on this list
+ * as well. Linking an edict takes it off again.
+ */
+static int sv_movededicts[MAX_EDICTS];
+static int sv_nummoved;
+static int sv_areastamp;
 
 #if defined(QW_HACK) && defined(SERVERONLY)
 /*
@@ -327,11 +406,13 @@ SV_CreateAreaNode
 ===============
 */
 static areanode_t *
-SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
+SV_CreateAreaNode(int depth, int maxdepth, vec3_t mins, vec3_t maxs,
+      const areanode_t *parent, int side)
 {
    areanode_t *anode;
    vec3_t size;
    vec3_t mins1, maxs1, mins2, maxs2;
+   int axis;
 
    anode = &sv_areanodes[sv_numareanodes];
    sv_numareanodes++;
@@ -339,14 +420,37 @@ SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
    ClearLink(&anode->trigger_edicts);
    ClearLink(&anode->solid_edicts);
 
-   if (depth == AREA_DEPTH)
+   if (parent)
+   {
+      axis = parent->axis;
+      anode->reachmask = parent->reachmask;
+      anode->reachmin[0] = parent->reachmin[0];
+      anode->reachmin[1] = parent->reachmin[1];
+      anode->reachmax[0] = parent->reachmax[0];
+      anode->reachmax[1] = parent->reachmax[1];
+      if (side == 0)
+      {
+         if (!(anode->reachmask & (1 << axis)) || parent->dist > anode->reachmin[axis])
+            anode->reachmin[axis] = parent->dist;
+         anode->reachmask |= 1 << axis;
+      }
+      else
+      {
+         if (!(anode->reachmask & (4 << axis)) || parent->dist < anode->reachmax[axis])
+            anode->reachmax[axis] = parent->dist;
+         anode->reachmask |= 4 << axis;
+      }
+   }
+
+   VectorSubtract(maxs, mins, size);
+   if (depth == maxdepth || (depth >= AREA_DEPTH
+            && size[0] < AREA_MIN_SIZE * 2 && size[1] < AREA_MIN_SIZE * 2))
    {
       anode->axis = -1;
       anode->children[0] = anode->children[1] = NULL;
       return anode;
    }
 
-   VectorSubtract(maxs, mins, size);
    if (size[0] > size[1])
       anode->axis = 0;
    else
@@ -360,12 +464,40 @@ SV_CreateAreaNode(int depth, vec3_t mins, vec3_t maxs)
 
    maxs1[anode->axis] = mins2[anode->axis] = anode->dist;
 
-   anode->children[0] = SV_CreateAreaNode(depth + 1, mins2, maxs2);
-   anode->children[1] = SV_CreateAreaNode(depth + 1, mins1, maxs1);
+   anode->children[0] = SV_CreateAreaNode(depth + 1, maxdepth, mins2, maxs2, anode, 0);
+   anode->children[1] = SV_CreateAreaNode(depth + 1, maxdepth, mins1, maxs1, anode, 1);
 
    return anode;
 }
 
+/*
+===============
+SV_AreaDepth
+
+Picks the tree depth from the number of entities the map spawns
+===============
+*/
+static int
+SV_AreaDepth(void)
+{
+   const char *data;
+   int depth, edicts;
+
+   if (sv_areadepth.value >= 1)
+      return qmin((int)sv_areadepth.value, AREA_MAX_DEPTH);
+
+   edicts = 0;
+   for (data = sv.worldmodel->entities; data && *data; data++)
+      if (*data == '{')
+         edicts++;
+
+   depth = AREA_DEPTH;
+   while (depth < AREA_MAX_DEPTH && (AREA_LEAF_EDICTS << depth) < edicts)
+      depth++;
+
+   return depth;
+}
+
 /*
 ===============
 SV_ClearWorld
@@ -375,14 +507,71 @@ SV_ClearWorld
 void
 SV_ClearWorld(void)
 {
+   int i;
+
    SV_InitBoxHull();
 
    memset(sv_areanodes, 0, sizeof(sv_areanodes));
    sv_numareanodes = 0;
-   SV_CreateAreaNode(0, sv.worldmodel->mins, sv.worldmodel->maxs);
+   sv_areadepth_built = SV_AreaDepth();
+   SV_CreateAreaNode(0, sv_areadepth_built, sv.worldmodel->mins,
+         sv.worldmodel->maxs, NULL, 0);
+
+   for (i = 0; i < sv.max_edicts; i++)
+      EDICT_NUM(i)->moved = false;
+   sv_nummoved = 0;
+
+   memset(sv_tracecache_entries, 0, sizeof(sv_tracecache_entries));
+   sv_tracecache_used = 0;
 }
 
 
+/*
+===============
+SV_ClearTraceCache
+
+Called at the start of each server frame
+===============
+*/
+void
+SV_ClearTraceCache(void)
+{
+   if (!sv_tracecache_used)
+      return;
+   if (++sv_traceframe == 0)
+   {
+      memset(sv_tracecache_entries, 0, sizeof(sv_tracecache_entries));
+      sv_traceframe = 1;
+   }
+   sv_tracecache_used = 0;
+}
+
+static void
+SV_FlushTraceCache(const edict_t *ent)
+{
+   tracecache_t *entry;
+   int i;
+
+   if (!sv_tracecache_used)
+      return;
+
+   for (i = 0, entry = sv_tracecache_entries; i < TRACE_CACHE_SIZE; i++, entry++)
+   {
+      if (entry->frame != sv_traceframe)
+         continue;
+      if (entry->boxmins[0] > ent->v.absmax[0]
+            || entry->boxmins[1] > ent->v.absmax[1]
+            || entry->boxmins[2] > ent->v.absmax[2]
+            || entry->boxmaxs[0] < ent->v.absmin[0]
+            || entry->boxmaxs[1] < ent->v.absmin[1]
+            || entry->boxmaxs[2] < ent->v.absmin[2])
+         continue;
+      entry->frame = 0;
+      sv_tracecache_used--;
+      sv_areastats.cacheflushed++;
+   }
+}
+
 /*
 ===============
 SV_UnlinkEdict
@@ -394,6 +583,7 @@ SV_UnlinkEdict(edict_t *ent)
 {
    if (!ent->area.prev)
       return;			// not linked in anywhere
+   SV_FlushTraceCache(ent);
    RemoveLink(&ent->area);
    ent->area.prev = ent->area.next = NULL;
 }
@@ -425,6 +615,7 @@ static void SV_TouchLinks(edict_t *ent, areanode_t *node)
 
       lnext = l->next;
       touch = EDICT_FROM_AREA(l);
+      sv_areastats.touchtested++;
       if (touch == ent)
          continue;
       if (!touch->v.touch || touch->v.solid != SOLID_TRIGGER)
@@ -519,6 +710,8 @@ SV_LinkEdict(edict_t *ent, qboolean touch_triggers)
    if (ent->area.prev)
       SV_UnlinkEdict(ent);	/* unlink from old position */
 
+   ent->moved = false;
+
    if (ent == sv.edicts)
       return;			/* don't add the world */
 
@@ -578,6 +771,8 @@ SV_LinkEdict(edict_t *ent, qboolean touch_triggers)
       ent->v.absmax[2] += 1;
    }
 
+   SV_FlushTraceCache(ent);
+
    /* link to PVS leafs */
    ent->num_leafs = 0;
    if (ent->v.modelindex)
@@ -605,11 +800,190 @@ SV_LinkEdict(edict_t *ent, qboolean touch_triggers)
    else
       InsertLinkBefore(&ent->area, &node->solid_edicts);
 
+   /*
+    * With backwards mins and maxs the center may lie outside the abs box,
+    * so area queries can't rely on the node it was linked to.
+    */
+   if (ent->v.mins[0] > ent->v.maxs[0]
+         || ent->v.mins[1] > ent->v.maxs[1]
+         || ent->v.mins[2] > ent->v.maxs[2])
+      SV_MarkMoved(ent);
+
+   sv_areastats.links++;
+
    if (touch_triggers)
+   {
       /* touch all entities at this node and decend for more */
+      sv_areastats.touches++;
       SV_TouchLinks(ent, sv_areanodes);
+   }
+}
+
+
+/*
+===============
+SV_MarkMoved
+
+===============
+*/
+void
+SV_MarkMoved(edict_t *ent)
+{
+   if (ent->moved || ent == sv.edicts)
+      return;
+   ent->moved = true;
+   sv_movededicts[sv_nummoved++] = NUM_FOR_EDICT(ent);
+}
+
+static int *sv_arealist;
+static int sv_areacount;
+
+static void
+SV_AreaEdicts_r(const areanode_t *node, const vec3_t mins, const vec3_t maxs)
+{
+   const link_t *l;
+   edict_t *check;
+
+   for (l = node->solid_edicts.next; l != &node->solid_edicts; l = l->next) {
+      check = EDICT_FROM_AREA(l);
+      check->areastamp = sv_areastamp;
+      sv_arealist[sv_areacount++] = NUM_FOR_EDICT(check);
+   }
+   for (l = node->trigger_edicts.next; l != &node->trigger_edicts; l = l->next) {
+      check = EDICT_FROM_AREA(l);
+      check->areastamp = sv_areastamp;
+      sv_arealist[sv_areacount++] = NUM_FOR_EDICT(check);
+   }
+
+   if (node->axis == -1)
+      return;
+
+   if (maxs[node->axis] > node->dist)
+      SV_AreaEdicts_r(node->children[0], mins, maxs);
+   if (mins[node->axis] < node->dist)
+      SV_AreaEdicts_r(node->children[1], mins, maxs);
 }
 
+static int
+SV_AreaCompare(const void *a, const void *b)
+{
+   return *(const int *)a - *(const int *)b;
+}
+
+/*
+===============
+SV_AreaEdicts
+
+An edict linked into the tree has its box center inside its abs box, so
+it sits in a node the query box reaches whenever that center is inside
+the query box. The box is widened by a unit to cover rounding.
+===============
+*/
+int
+SV_AreaEdicts(const vec3_t mins, const vec3_t maxs, int *list)
+{
+   vec3_t boxmins, boxmaxs;
+   edict_t *check;
+   int i, num;
+
+   for (i = 0; i < 3; i++) {
+      boxmins[i] = mins[i] - 1;
+      boxmaxs[i] = maxs[i] + 1;
+   }
+
+   if (++sv_areastamp == 0) {
+      for (i = 0; i < sv.max_edicts; i++)
+         EDICT_NUM(i)->areastamp = 0;
+      sv_areastamp = 1;
+   }
+
+   sv_arealist = list;
+   sv_areacount = 0;
+   SV_AreaEdicts_r(sv_areanodes, boxmins, boxmaxs);
+
+   /* add the moved edicts, dropping any that have been relinked */
+   num = 0;
+   for (i = 0; i < sv_nummoved; i++) {
+      check = EDICT_NUM(sv_movededicts[i]);
+      if (!check->moved)
+         continue;
+      if (check->free || check->v.solid == SOLID_NOT) {
+         /* can't be found; any store that changes that marks it again */
+         check->moved = false;
+         continue;
+      }
+      sv_movededicts[num++] = sv_movededicts[i];
+      if (check->areastamp != sv_areastamp) {
+         check->areastamp = sv_areastamp;
+         list[sv_areacount++] = sv_movededicts[i];
+      }
+   }
+   sv_nummoved = num;
+
+   qsort(list, sv_areacount, sizeof(*list), SV_AreaCompare);
+
+   return sv_areacount;
+}
+
+/*
+===============
+SV_AreaStats_f
+===============
+*/
+static void
+SV_AreaStats_f(void)
+{
+   const areanode_t *node;
+   const link_t *l;
+   int i, count, linked, longest;
+   double traces = sv_areastats.traces;
+   double touches = sv_areastats.touches;
+
+   linked = longest = 0;
+   for (i = 0, node = sv_areanodes; i < sv_numareanodes; i++, node++)
+   {
+      count = 0;
+      for (l = node->solid_edicts.next; l && l != &node->solid_edicts; l = l->next)
+         count++;
+      for (l = node->trigger_edicts.next; l && l != &node->trigger_edicts; l = l->next)
+         count++;
+      linked += count;
+      longest = qmax(longest, count);
+   }
+
+   Con_Printf("area tree: depth %d, %d nodes, %d edicts linked, "
+         "longest node list %d\n", sv_areadepth_built, sv_numareanodes,
+         linked, longest);
+   Con_Printf("%.0f traces: %.1f nodes, %.1f edicts tested, "
+         "%.2f clipped per trace\n", traces,
+         traces ? sv_areastats.nodes / traces : 0.0,
+         traces ? sv_areastats.tested / traces : 0.0,
+         traces ? sv_areastats.clipped / traces : 0.0);
+   Con_Printf("%.0f trigger checks: %.1f edicts tested per check\n",
+         touches, touches ? sv_areastats.touchtested / touches : 0.0);
+   Con_Printf("%.0f edicts linked\n", (double)sv_areastats.links);
+   Con_Printf("trace cache: %.0f hits in %.0f lookups (%.1f%%), %.0f flushed\n",
+         (double)sv_areastats.cachehits, (double)sv_areastats.cachelookups,
+         sv_areastats.cachelookups ?
+         sv_areastats.cachehits * 100.0 / sv_areastats.cachelookups : 0.0,
+         (double)sv_areastats.cacheflushed);
+
+   if (Cmd_Argc() > 1 && !strcmp(Cmd_Argv(1), "reset"))
+      memset(&sv_areastats, 0, sizeof(sv_areastats));
+}
+
+/*
+===============
+SV_InitWorld
+===============
+*/
+void
+SV_InitWorld(void)
+{
+   Cvar_RegisterVariable(&sv_areadepth);
+   Cvar_RegisterVariable(&sv_tracecache);
+   Cmd_AddCommand("area_stats", SV_AreaStats_f);
+}
 
 /*
 ===============================================================================
@@ -679,6 +1053,111 @@ int SV_TruePointContents (vec3_t p)
 	return SV_HullPointContents (&sv.worldmodel->hulls[0], 0, p);
 }
 
+/*
+ * Several points go down the hull side by side, with the plane distances
+ * of the non-axial planes worked out together. The sums are made in the
+ * same order as in SV_HullPointContents, so every point ends up in the
+ * same leaf. Fused multiply-adds would round differently, so targets that
+ * have them use the plain version.
+ */
+#if defined(__x86_64__) && defined(__SSE2__) && !defined(__FMA__)
+#define SV_SIMD_CONTENTS
+#endif
+
+#ifdef SV_SIMD_CONTENTS
+static void
+SV_HullPointContents4(hull_t *hull, int num, const vec3_t *points,
+      int *contents, int count)
+{
+   float nx[4], ny[4], nz[4], dist[4], d[4];
+   qboolean axial[4];
+   int nums[4];
+   __m128 px, py, pz, dv;
+   mclipnode_t *node;
+   mplane_t *plane;
+   int lane, active;
+
+   for (lane = 0; lane < 4; lane++)
+   {
+      nums[lane] = lane < count ? num : CONTENTS_EMPTY;
+      nx[lane] = ny[lane] = nz[lane] = dist[lane] = 0;
+   }
+   px = _mm_setr_ps(points[0][0], count > 1 ? points[1][0] : 0,
+         count > 2 ? points[2][0] : 0, count > 3 ? points[3][0] : 0);
+   py = _mm_setr_ps(points[0][1], count > 1 ? points[1][1] : 0,
+         count > 2 ? points[2][1] : 0, count > 3 ? points[3][1] : 0);
+   pz = _mm_setr_ps(points[0][2], count > 1 ? points[1][2] : 0,
+         count > 2 ? points[2][2] : 0, count > 3 ? points[3][2] : 0);
+
+   do
+   {
+      for (lane = 0; lane < 4; lane++)
+      {
+         if (nums[lane] < 0)
+            continue;
+         if (nums[lane] < hull->firstclipnode || nums[lane] > hull->lastclipnode)
+            SV_Error("%s: bad node number (%i)", __func__, nums[lane]);
+         plane = hull->planes + hull->clipnodes[nums[lane]].planenum;
+         axial[lane] = plane->type < 3;
+         nx[lane] = plane->normal[0];
+         ny[lane] = plane->normal[1];
+         nz[lane] = plane->normal[2];
+         dist[lane] = plane->dist;
+      }
+
+      dv = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(nx), px),
+            _mm_mul_ps(_mm_loadu_ps(ny), py));
+      dv = _mm_add_ps(dv, _mm_mul_ps(_mm_loadu_ps(nz), pz));
+      dv = _mm_sub_ps(dv, _mm_loadu_ps(dist));
+      _mm_storeu_ps(d, dv);
+
+      active = 0;
+      for (lane = 0; lane < 4; lane++)
+      {
+         if (nums[lane] < 0)
+            continue;
+         node = hull->clipnodes + nums[lane];
+         if (axial[lane])
+         {
+            plane = hull->planes + node->planenum;
+            d[lane] = points[lane][plane->type] - plane->dist;
+         }
+         nums[lane] = node->children[d[lane] < 0];
+         active |= nums[lane] >= 0;
+      }
+   } while (active);
+
+   for (lane = 0; lane < count; lane++)
+      contents[lane] = nums[lane];
+}
+#endif
+
+/*
+==================
+SV_PointContentsBatch
+
+==================
+*/
+void
+SV_PointContentsBatch(const vec3_t *points, int *contents, int count)
+{
+   hull_t *hull = &sv.worldmodel->hulls[0];
+   int i;
+
+#ifdef SV_SIMD_CONTENTS
+   for (i = 0; i < count; i += 4)
+      SV_HullPointContents4(hull, 0, points + i, contents + i, qmin(count - i, 4));
+#else
+   for (i = 0; i < count; i++)
+      contents[i] = SV_HullPointContents(hull, 0, (float *)points[i]);
+#endif
+#ifdef QUAKE2RJ
+   for (i = 0; i < count; i++)
+      if (contents[i] <= CONTENTS_CURRENT_0 && contents[i] >= CONTENTS_CURRENT_DOWN)
+         contents[i] = CONTENTS_WATER;
+#endif
+}
+
 
 //===========================================================================
 
@@ -983,77 +1462,96 @@ SV_ClipMoveToEntity(edict_t *ent, vec3_t start, vec3_t mins, vec3_t maxs,
 
 /*
 ====================
-SV_ClipToLinks
+SV_ClipToEdict
 
-Mins and maxs enclose the entire area swept by the move
+Returns false once the move is known to be all solid, after which no
+other edict can change the result
 ====================
 */
-static void SV_ClipToLinks(areanode_t *node, moveclip_t *clip)
+static qboolean SV_ClipToEdict(edict_t *touch, moveclip_t *clip)
 {
-   link_t *l, *next;
-   edict_t *touch;
    trace_t trace;
 
-   /* touch linked edicts */
-   for (l = node->solid_edicts.next; l != &node->solid_edicts; l = next)
+   sv_areastats.tested++;
+   if (touch->v.solid == SOLID_NOT)
+      return true;
+   if (touch == clip->passedict)
+      return true;
+   if (touch->v.solid == SOLID_TRIGGER)
+      Sys_Error ("Trigger in clipping list (%s)",touch->v.classname + pr_strings);
+
+   if ((clip->type == MOVE_NOMONSTERS ||
+            clip->type == MOVE_PHASE) && touch->v.solid != SOLID_BSP)
+      return true;
+
+   if (clip->boxmins[0] > touch->v.absmax[0]
+         || clip->boxmins[1] > touch->v.absmax[1]
+         || clip->boxmins[2] > touch->v.absmax[2]
+         || clip->boxmaxs[0] < touch->v.absmin[0]
+         || clip->boxmaxs[1] < touch->v.absmin[1]
+         || clip->boxmaxs[2] < touch->v.absmin[2])
+      return true;
+
+   if (clip->passedict && clip->passedict->v.size[0]
+         && !touch->v.size[0])
+      return true;		/* points never interact */
+
+   /* might intersect, so do an exact clip */
+   if (clip->trace.allsolid)
+      return false;
+
+   if (clip->passedict)
    {
-      next = l->next;
-      touch = EDICT_FROM_AREA(l);
-      if (touch->v.solid == SOLID_NOT)
-         continue;
-      if (touch == clip->passedict)
-         continue;
-      if (touch->v.solid == SOLID_TRIGGER)
-			Sys_Error ("Trigger in clipping list (%s)",touch->v.classname + pr_strings);
+      if (PROG_TO_EDICT(touch->v.owner) == clip->passedict)
+         return true;	/* don't clip against own missiles */
+      if (PROG_TO_EDICT(clip->passedict->v.owner) == touch)
+         return true;	/* don't clip against owner */
+   }
 
-      if ((clip->type == MOVE_NOMONSTERS ||
-               clip->type == MOVE_PHASE) && touch->v.solid != SOLID_BSP)
-         continue;
+   sv_areastats.clipped++;
+   if ((int)touch->v.flags & FL_MONSTER)
+      trace = SV_ClipMoveToEntity(
+            touch, clip->start, clip->mins2, clip->maxs2, clip->end, touch);
+   else
+      trace = SV_ClipMoveToEntity(
+            touch, clip->start, clip->mins, clip->maxs, clip->end, touch);
 
-      if (clip->boxmins[0] > touch->v.absmax[0]
-            || clip->boxmins[1] > touch->v.absmax[1]
-            || clip->boxmins[2] > touch->v.absmax[2]
-            || clip->boxmaxs[0] < touch->v.absmin[0]
-            || clip->boxmaxs[1] < touch->v.absmin[1]
-            || clip->boxmaxs[2] < touch->v.absmin[2])
-         continue;
+   if (trace.allsolid || trace.startsolid
+         || trace.fraction < clip->trace.fraction)
+   {
+      trace.ent = touch;
+      if (clip->trace.startsolid)
+      {
+         clip->trace = trace;
+         clip->trace.startsolid = true;
+      } else
+         clip->trace = trace;
+   }
+   else if (trace.startsolid)
+      clip->trace.startsolid = true;
 
-      if (clip->passedict && clip->passedict->v.size[0]
-            && !touch->v.size[0])
-         continue;		/* points never interact */
+   return true;
+}
 
-      /* might intersect, so do an exact clip */
-      if (clip->trace.allsolid)
-         return;
+/*
+====================
+SV_ClipToLinks
 
-      if (clip->passedict)
-      {
-         if (PROG_TO_EDICT(touch->v.owner) == clip->passedict)
-            continue;	/* don't clip against own missiles */
-         if (PROG_TO_EDICT(clip->passedict->v.owner) == touch)
-            continue;	/* don't clip against owner */
-      }
+Mins and maxs enclose the entire area swept by the move
+====================
+*/
+static void SV_ClipToLinks(areanode_t *node, moveclip_t *clip)
+{
+   link_t *l, *next;
 
-      if ((int)touch->v.flags & FL_MONSTER)
-         trace = SV_ClipMoveToEntity(
-               touch, clip->start, clip->mins2, clip->maxs2, clip->end, touch);
-      else
-         trace = SV_ClipMoveToEntity(
-               touch, clip->start, clip->mins, clip->maxs, clip->end, touch);
+   sv_areastats.nodes++;
 
-      if (trace.allsolid || trace.startsolid
-            || trace.fraction < clip->trace.fraction)
-      {
-         trace.ent = touch;
-         if (clip->trace.startsolid)
-         {
-            clip->trace = trace;
-            clip->trace.startsolid = true;
-         } else
-            clip->trace = trace;
-      }
-      else if (trace.startsolid)
-         clip->trace.startsolid = true;
+   /* touch linked edicts */
+   for (l = node->solid_edicts.next; l != &node->solid_edicts; l = next)
+   {
+      next = l->next;
+      if (!SV_ClipToEdict(EDICT_FROM_AREA(l), clip))
+         return;
    }
 
    /* recurse down both sides */
@@ -1094,25 +1592,62 @@ static void SV_MoveBounds(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
 
 /*
 ==================
-SV_Move
+SV_TraceCacheEntry
+
+Fills in the key for a move and returns the cache slot it belongs in
 ==================
 */
-trace_t SV_Move(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, int type,
-	edict_t *passedict)
+static tracecache_t *SV_TraceCacheEntry(tracekey_t *key, const vec3_t start,
+      const vec3_t mins, const vec3_t maxs, const vec3_t end, int type,
+      edict_t *passedict)
 {
-   moveclip_t clip;
+   const byte *data;
+   unsigned hash;
+   size_t i;
+
+   memset(key, 0, sizeof(*key));
+   VectorCopy(start, key->start);
+   VectorCopy(mins, key->mins);
+   VectorCopy(maxs, key->maxs);
+   VectorCopy(end, key->end);
+   key->type = type;
+   key->passedict = passedict;
+
+   sv_areastats.cachelookups++;
+
+   /* FNV-1a over the raw bytes, so -0 and NaN keys stay distinct */
+   hash = 2166136261u;
+   data = (const byte *)key;
+   for (i = 0; i < sizeof(*key); i++)
+   {
+      hash ^= data[i];
+      hash *= 16777619u;
+   }
+
+   return &sv_tracecache_entries[hash & (TRACE_CACHE_SIZE - 1)];
+}
 
-   memset(&clip, 0, sizeof(moveclip_t));
+/*
+==================
+SV_MoveClipInit
+
+Clips the move to the world and sets up for clipping it to entities
+==================
+*/
+static void SV_MoveClipInit(moveclip_t *clip, vec3_t start, vec3_t mins,
+      vec3_t maxs, vec3_t end, int type, edict_t *passedict)
+{
+   memset(clip, 0, sizeof(moveclip_t));
 
    /* clip to world */
-   clip.trace = SV_ClipMoveToEntity(sv.edicts, start, mins, maxs, end, passedict);
+   clip->trace = SV_ClipMoveToEntity(sv.edicts, start, mins, maxs, end, passedict);
 
-   clip.start = start;
-   clip.end = end;
-   clip.mins = mins;
-   clip.maxs = maxs;
-   clip.type = type;
-   clip.passedict = passedict;
+   clip->start = start;
+   clip->end = end;
+   clip->mins = mins;
+   clip->maxs = maxs;
+   clip->type = type;
+   clip->passedict = passedict;
 
 	if (type == MOVE_MISSILE || type == MOVE_PHASE)
    {
@@ -1120,22 +1655,188 @@ trace_t SV_Move(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, int type,
       int i;
       for (i = 0; i < 3; i++)
       {
-         clip.mins2[i] = -15;
-         clip.maxs2[i] = 15;
+         clip->mins2[i] = -15;
+         clip->maxs2[i] = 15;
       }
    }
    else
    {
-      VectorCopy(mins, clip.mins2);
-      VectorCopy(maxs, clip.maxs2);
+      VectorCopy(mins, clip->mins2);
+      VectorCopy(maxs, clip->maxs2);
    }
 
    /* create the bounding box of the entire move */
-   SV_MoveBounds(start, clip.mins2, clip.maxs2, end, clip.boxmins,
-         clip.boxmaxs);
+   SV_MoveBounds(start, clip->mins2, clip->maxs2, end, clip->boxmins,
+         clip->boxmaxs);
+}
+
+/*
+==================
+SV_Move
+==================
+*/
+trace_t SV_Move(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end, int type,
+	edict_t *passedict)
+{
+   moveclip_t clip;
+   tracecache_t *entry = NULL;
+   tracekey_t key;
+
+   if (sv_tracecache.value)
+   {
+      entry = SV_TraceCacheEntry(&key, start, mins, maxs, end, type, passedict);
+      if (entry->frame == sv_traceframe && !memcmp(&entry->key, &key, sizeof(key)))
+      {
+         sv_areastats.cachehits++;
+         return entry->trace;
+      }
+   }
+
+   SV_MoveClipInit(&clip, start, mins, maxs, end, type, passedict);
 
    /* clip to entities */
+   sv_areastats.traces++;
    SV_ClipToLinks(sv_areanodes, &clip);
 
+   if (entry)
+   {
+      if (entry->frame != sv_traceframe)
+         sv_tracecache_used++;
+      entry->key = key;
+      entry->frame = sv_traceframe;
+      VectorCopy(clip.boxmins, entry->boxmins);
+      VectorCopy(clip.boxmaxs, entry->boxmaxs);
+      entry->trace = clip.trace;
+   }
+
    return clip.trace;
 }
+
+/*
+ * Edicts gathered for a batch of moves, in the order SV_ClipToLinks would
+ * visit them, along with the node each one is linked to.
+ */
+static vec3_t sv_missilemins = { -15, -15, -15 };
+static vec3_t sv_missilemaxs = { 15, 15, 15 };
+static edict_t *sv_batchedicts[MAX_EDICTS];
+static const areanode_t *sv_batchnodes[MAX_EDICTS];
+static int sv_numbatch;
+
+static void SV_GatherLinks(const areanode_t *node, const vec3_t boxmins,
+      const vec3_t boxmaxs)
+{
+   const link_t *l;
+
+   sv_areastats.nodes++;
+   for (l = node->solid_edicts.next; l != &node->solid_edicts; l = l->next)
+   {
+      sv_batchedicts[sv_numbatch] = EDICT_FROM_AREA(l);
+      sv_batchnodes[sv_numbatch] = node;
+      sv_numbatch++;
+   }
+
+   if (node->axis == -1)
+      return;
+
+   if (boxmaxs[node->axis] > node->dist)
+      SV_GatherLinks(node->children[0], boxmins, boxmaxs);
+   if (boxmins[node->axis] < node->dist)
+      SV_GatherLinks(node->children[1], boxmins, boxmaxs);
+}
+
+/*
+ * True if SV_ClipToLinks would get to node with this move's box. The
+ * comparisons are the ones made on the way down, so NaNs and infinities
+ * behave the same.
+ */
+static qboolean SV_BoxReachesNode(const areanode_t *node, const vec3_t boxmins,
+      const vec3_t boxmaxs)
+{
+   int axis;
+
+   for (axis = 0; axis < 2; axis++)
+   {
+      if ((node->reachmask & (1 << axis)) && !(boxmaxs[axis] > node->reachmin[axis]))
+         return false;
+      if ((node->reachmask & (4 << axis)) && !(boxmins[axis] < node->reachmax[axis]))
+         return false;
+   }
+
+   return true;
+}
+
+/*
+==================
+SV_MoveBatch
+
+Gives the same traces as calling SV_Move for each move in turn, but walks
+the area tree only once for the whole batch
+==================
+*/
+void SV_MoveBatch(svmove_t *moves, trace_t *traces, int count)
+{
+   moveclip_t clip;
+   vec3_t boxmins = { 0, 0, 0 }, boxmaxs = { 0, 0, 0 };
+   int i, j;
+
+   if (count < 1)
+      return;
+   if (count == 1 || sv_tracecache.value)
+   {
+      /* the cache works one move at a time */
+      for (i = 0; i < count; i++)
+         traces[i] = SV_Move(moves[i].start, moves[i].mins, moves[i].maxs,
+               moves[i].end, moves[i].type, moves[i].passedict);
+      return;
+   }
+   /* the tree is walked with a box that holds all of the moves */
+   for (i = 0; i < count; i++)
+   {
+      float *mins = moves[i].mins, *maxs = moves[i].maxs;
+
+      if (moves[i].type == MOVE_MISSILE || moves[i].type == MOVE_PHASE)
+      {
+         mins = sv_missilemins;
+         maxs = sv_missilemaxs;
+      }
+      SV_MoveBounds(moves[i].start, mins, maxs, moves[i].end,
+            clip.boxmins, clip.boxmaxs);
+      for (j = 0; j < 3; j++)
+      {
+         if (!(clip.boxmins[j] == clip.boxmins[j] && clip.boxmaxs[j] == clip.boxmaxs[j]))
+            break;
+         if (!i || clip.boxmins[j] < boxmins[j])
+            boxmins[j] = clip.boxmins[j];
+         if (!i || clip.boxmaxs[j] > boxmaxs[j])
+            boxmaxs[j] = clip.boxmaxs[j];
+      }
+      if (j < 3)
+         break;
+   }
+   if (i < count)
+   {
+      /* a NaN can't be merged into the box, so trace one at a time */
+      for (i = 0; i < count; i++)
+         traces[i] = SV_Move(moves[i].start, moves[i].mins, moves[i].maxs,
+               moves[i].end, moves[i].type, moves[i].passedict);
+      return;
+   }
+
+   sv_numbatch = 0;
+   SV_GatherLinks(sv_areanodes, boxmins, boxmaxs);
+
+   for (i = 0; i < count; i++)
+   {
+      SV_MoveClipInit(&clip, moves[i].start, moves[i].mins, moves[i].maxs,
+            moves[i].end, moves[i].type, moves[i].passedict);
+      sv_areastats.traces++;
+      for (j = 0; j < sv_numbatch; j++)
+      {
+         if (!SV_BoxReachesNode(sv_batchnodes[j], clip.boxmins, clip.boxmaxs))
+            continue;
+         if (!SV_ClipToEdict(sv_batchedicts[j], &clip))
+            break;
+      }
+      traces[i] = clip.trace;
+   }
+}
@@ -49,10 +49,18 @@ typedef struct {
 #define	MOVE_PHASE		4
 
 
+void SV_InitWorld(void);
+
+// registers the area tree variables and commands
+
 void SV_ClearWorld(void);
 
 // called after the world model has been loaded, before linking any entities
 
+void SV_ClearTraceCache(void);
+
+// forgets the traces cached during the last server frame
+
 void SV_UnlinkEdict(edict_t *ent);
 
 // call before removing an entity, and before trying to move one,
@@ -66,6 +74,18 @@ void SV_LinkEdict(edict_t *ent, qboolean touch_triggers);
 // sets ent->v.absmin and ent->v.absmax
 // if touchtriggers, calls prog functions for the intersected triggers
 
+void SV_MarkMoved(edict_t *ent);
+
+// call when origin, mins, maxs or solid are changed without relinking, so
+// area queries keep looking at the edict until it is linked again
+
+int SV_AreaEdicts(const vec3_t mins, const vec3_t maxs, int *list);
+
+// fills list with the numbers of all edicts whose box center may lie
+// inside the given box, in ascending order, and returns how many there
+// are. The caller still has to test each edict. The list needs room for
+// sv.max_edicts entries.
+
 int SV_PointContents(vec3_t p);
 
 // returns the CONTENTS_* value from the world at the given point.
@@ -87,6 +107,21 @@ trace_t SV_Move(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t end,
 
 // passedict is explicitly excluded from clipping checks (normally NULL)
 
+typedef struct {
+    vec3_t start, mins, maxs, end;
+    int type;
+    edict_t *passedict;
+} svmove_t;
+
+void SV_MoveBatch(svmove_t *moves, trace_t *traces, int count);
+
+// the same as calling SV_Move for each move, but faster for moves that
+// are close together
+
+void SV_PointContentsBatch(const vec3_t *points, int *contents, int count);
+
+// SV_PointContents for several points at once
+
 #if defined(QW_HACK) && defined(SERVERONLY)
 void SV_AddLinksToPmove(const vec3_t mins, const vec3_t maxs);
 #endif
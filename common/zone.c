@@ -321,6 +321,12 @@ static int hunk_size;
 
 static int hunk_low_used;
 static int hunk_high_used;
+static int hunk_peak_used;	/* high water mark of low + high */
+
+static INLINE void Hunk_UpdatePeak(void)
+{
+   hunk_peak_used = qmax(hunk_peak_used, hunk_low_used + hunk_high_used);
+}
 
 static qboolean hunk_tempactive;
 static int hunk_tempmark;
@@ -426,6 +432,7 @@ static void Hunk_Print(qboolean all)
    }
    Con_Printf("-------------------------\n");
    Con_Printf("%8i total blocks\n", totalblocks);
+   Con_Printf("%8i peak bytes used\n", hunk_peak_used);
 }
 
 static void Hunk_f(void)
@@ -439,8 +446,14 @@ static void Hunk_f(void)
          Hunk_Print(true);
          return;
       }
+      if (!strcmp(Cmd_Argv(1), "peak")) {
+         Con_Printf("%i bytes peak, %i in use\n", hunk_peak_used,
+               hunk_low_used + hunk_high_used);
+         hunk_peak_used = hunk_low_used + hunk_high_used;
+         return;
+      }
    }
-   Con_Printf("Usage: hunk print|printall\n");
+   Con_Printf("Usage: hunk print|printall|peak\n");
 }
 
 /*
@@ -468,6 +481,7 @@ void * Hunk_AllocName(int size, const char *name)
 
    h = (hunk_t *)(hunk_base + hunk_low_used);
    hunk_low_used += size;
+   Hunk_UpdatePeak();
 
    Cache_FreeLow(hunk_low_used);
 
@@ -559,6 +573,7 @@ void *Hunk_HighAllocName(int size, const char *name)
    }
 
    hunk_high_used += size;
+   Hunk_UpdatePeak();
    Cache_FreeHigh(hunk_high_used);
 
    h = (hunk_t *)(hunk_base + hunk_size - hunk_high_used);
@@ -629,6 +644,7 @@ void *Hunk_TempAllocExtend(int size)
    }
 
    hunk_high_used += size;
+   Hunk_UpdatePeak();
    Cache_FreeHigh(hunk_high_used);
 
    newobj = (hunk_t *)(hunk_base + hunk_size - hunk_high_used);
@@ -0,0 +1,239 @@
+/* Copyright  (C) 2010-2018 The RetroArch team
+ *
+ * ---------------------------------------------------------------------------------------
+ * The following license statement only applies to this file (rthreads.c).
+ * ---------------------------------------------------------------------------------------
+ *
+ * Permission is hereby granted, free of charge,
+ * to any person obtaining a copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include <rthreads/rthreads.h>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+struct thread_data
+{
+   void (*func)(void*);
+   void *userdata;
+};
+
+struct sthread
+{
+#if defined(_WIN32)
+   HANDLE thread;
+#else
+   pthread_t id;
+#endif
+};
+
+struct slock
+{
+#if defined(_WIN32)
+   CRITICAL_SECTION lock;
+#else
+   pthread_mutex_t lock;
+#endif
+};
+
+struct scond
+{
+#if defined(_WIN32)
+   CONDITION_VARIABLE cond;
+#else
+   pthread_cond_t cond;
+#endif
+};
+
+#if defined(_WIN32)
+static DWORD CALLBACK thread_wrap(void *data_)
+#else
+static void *thread_wrap(void *data_)
+#endif
+{
+   struct thread_data *data = (struct thread_data*)data_;
+   if (!data)
+      return 0;
+   data->func(data->userdata);
+   free(data);
+   return 0;
+}
+
+sthread_t *sthread_create(void (*thread_func)(void*), void *userdata)
+{
+   bool thread_created      = false;
+   struct thread_data *data = NULL;
+   sthread_t *thread        = (sthread_t*)calloc(1, sizeof(*thread));
+
+   if (!thread)
+      return NULL;
+
+   data = (struct thread_data*)malloc(sizeof(*data));
+   if (!data)
+      goto error;
+
+   data->func     = thread_func;
+   data->userdata = userdata;
+
+#if defined(_WIN32)
+   thread->thread = CreateThread(NULL, 0, thread_wrap, data, 0, NULL);
+   thread_created = !!thread->thread;
+#else
+   thread_created = pthread_create(&thread->id, NULL, thread_wrap, data) == 0;
+#endif
+
+   if (thread_created)
+      return thread;
+
+error:
+   if (data)
+      free(data);
+   free(thread);
+   return NULL;
+}
+
+void sthread_join(sthread_t *thread)
+{
+   if (!thread)
+      return;
+#if defined(_WIN32)
+   WaitForSingleObject(thread->thread, INFINITE);
+   CloseHandle(thread->thread);
+#else
+   pthread_join(thread->id, NULL);
+#endif
+   free(thread);
+}
+
+slock_t *slock_new(void)
+{
+   slock_t *lock = (slock_t*)calloc(1, sizeof(*lock));
+   if (!lock)
+      return NULL;
+
+#if defined(_WIN32)
+   InitializeCriticalSection(&lock->lock);
+#else
+   if (pthread_mutex_init(&lock->lock, NULL) != 0)
+   {
+      free(lock);
+      return NULL;
+   }
+#endif
+
+   return lock;
+}
+
+void slock_free(slock_t *lock)
+{
+   if (!lock)
+      return;
+
+#if defined(_WIN32)
+   DeleteCriticalSection(&lock->lock);
+#else
+   pthread_mutex_destroy(&lock->lock);
+#endif
+   free(lock);
+}
+
+void slock_lock(slock_t *lock)
+{
+   if (!lock)
+      return;
+#if defined(_WIN32)
+   EnterCriticalSection(&lock->lock);
+#else
+   pthread_mutex_lock(&lock->lock);
+#endif
+}
+
+void slock_unlock(slock_t *lock)
+{
+   if (!lock)
+      return;
+#if defined(_WIN32)
+   LeaveCriticalSection(&lock->lock);
+#else
+   pthread_mutex_unlock(&lock->lock);
+#endif
+}
+
+scond_t *scond_new(void)
+{
+   scond_t *cond = (scond_t*)calloc(1, sizeof(*cond));
+   if (!cond)
+      return NULL;
+
+#if defined(_WIN32)
+   InitializeConditionVariable(&cond->cond);
+#else
+   if (pthread_cond_init(&cond->cond, NULL) != 0)
+   {
+      free(cond);
+      return NULL;
+   }
+#endif
+
+   return cond;
+}
+
+void scond_free(scond_t *cond)
+{
+   if (!cond)
+      return;
+
+#if !defined(_WIN32)
+   pthread_cond_destroy(&cond->cond);
+#endif
+   free(cond);
+}
+
+void scond_wait(scond_t *cond, slock_t *lock)
+{
+#if defined(_WIN32)
+   SleepConditionVariableCS(&cond->cond, &lock->lock, INFINITE);
+#else
+   pthread_cond_wait(&cond->cond, &lock->lock);
+#endif
+}
+
+int scond_broadcast(scond_t *cond)
+{
+#if defined(_WIN32)
+   WakeAllConditionVariable(&cond->cond);
+   return 0;
+#else
+   return pthread_cond_broadcast(&cond->cond);
+#endif
+}
+
+void scond_signal(scond_t *cond)
+{
+#if defined(_WIN32)
+   WakeConditionVariable(&cond->cond);
+#else
+   pthread_cond_signal(&cond->cond);
+#endif
+}